@@ -0,0 +1,396 @@
+/*
+ *	Tiny File System
+ *
+ *	File:	backend.c
+ *
+ */
+
+#define _GNU_SOURCE
+
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <math.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include "backend.h"
+
+/*
+ * Block backends
+ *
+ *	file	the disk file on the host, as TFS has always used
+ *	ram		the disk in memory, for as long as the process lasts
+ *	hdd		a ram disk that takes as long as a disk drive would
+ *	ssd		a ram disk that takes as long as a flash drive would
+ *
+ * Only the file backend has a host file for io_uring, splicing and the
+ * host page cache to work on; with the others every transfer is a memcpy,
+ * plus a modelled delay for hdd and ssd, so cache, readahead and request
+ * scheduling changes can be measured the same way on any machine.
+ */
+
+/*
+ * file
+ */
+static int file_fd = -1;
+static char *file_map_addr = NULL;
+static size_t file_map_size = 0;
+
+static int file_create(const char *path, size_t size) {
+	file_fd = open(path, O_CREAT | O_TRUNC | O_RDWR, S_IRUSR | S_IWUSR);
+	if (file_fd < 0) {
+		perror("disk_open failed");
+		return -1;
+	}
+	if (ftruncate(file_fd, size) < 0) {
+		perror("disk_create failed");
+		close(file_fd);
+		file_fd = -1;
+		return -1;
+	}
+	return 0;
+}
+
+static int file_open(const char *path) {
+	file_fd = open(path, O_RDWR, S_IRUSR | S_IWUSR);
+	if (file_fd < 0) {
+		perror("disk_open failed");
+		return -1;
+	}
+	return 0;
+}
+
+static void file_close() {
+	if (file_map_addr != NULL) {
+		msync(file_map_addr, file_map_size, MS_SYNC);
+		munmap(file_map_addr, file_map_size);
+		file_map_addr = NULL;
+		file_map_size = 0;
+	}
+	close(file_fd);
+	file_fd = -1;
+}
+
+static ssize_t file_read(const struct iovec *iov, int iovcnt, off_t off) {
+	return iovcnt == 1 ? pread(file_fd, iov[0].iov_base, iov[0].iov_len, off) : preadv(file_fd, iov, iovcnt, off);
+}
+
+static ssize_t file_write(const struct iovec *iov, int iovcnt, off_t off) {
+	return iovcnt == 1 ? pwrite(file_fd, iov[0].iov_base, iov[0].iov_len, off) : pwritev(file_fd, iov, iovcnt, off);
+}
+
+static void *file_map(size_t *size) {
+	struct stat st;
+
+	if (file_map_addr == NULL) {
+		if (file_fd < 0 || fstat(file_fd, &st) < 0) {
+			return NULL;
+		}
+		void *map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, file_fd, 0);
+		if (map == MAP_FAILED) {
+			perror("disk_map failed");
+			return NULL;
+		}
+		file_map_addr = map;
+		file_map_size = st.st_size;
+	}
+	*size = file_map_size;
+	return file_map_addr;
+}
+
+static int file_sync() {
+	if (file_map_addr != NULL && msync(file_map_addr, file_map_size, MS_ASYNC) < 0) {
+		perror("msync failed");
+		return -1;
+	}
+	return 0;
+}
+
+static int file_get_fd() {
+	return file_fd;
+}
+
+static const struct bio_backend file_backend = {
+	.name	= "file",
+	.create	= file_create,
+	.open	= file_open,
+	.close	= file_close,
+	.read	= file_read,
+	.write	= file_write,
+	.map	= file_map,
+	.sync	= file_sync,
+	.fd		= file_get_fd,
+};
+
+/*
+ * ram
+ */
+static char *ram_disk = NULL;
+static size_t ram_size = 0;
+
+static int ram_create(const char *path, size_t size) {
+	free(ram_disk);
+	ram_disk = calloc(1, size);
+	if (ram_disk == NULL) {
+		perror("ram disk allocation failed");
+		return -1;
+	}
+	ram_size = size;
+	return 0;
+}
+
+//The disk an earlier mount by this process made, kept so it can be mounted again
+static int ram_open(const char *path) {
+	return ram_disk != NULL ? 0 : -1;
+}
+
+static void ram_close() {
+}
+
+//Copy between the disk and iov, as much of it as lies within the disk
+static ssize_t ram_copy(const struct iovec *iov, int iovcnt, off_t off, int write) {
+	ssize_t done = 0;
+	int i;
+	for (i = 0; i < iovcnt && (size_t)off < ram_size; i++) {
+		size_t len = iov[i].iov_len;
+		if (len > ram_size - off) {
+			len = ram_size - off;
+		}
+		if (write) {
+			memcpy(ram_disk + off, iov[i].iov_base, len);
+		} else {
+			memcpy(iov[i].iov_base, ram_disk + off, len);
+		}
+		off += len;
+		done += len;
+	}
+	return done;
+}
+
+static ssize_t ram_read(const struct iovec *iov, int iovcnt, off_t off) {
+	return ram_copy(iov, iovcnt, off, 0);
+}
+
+static ssize_t ram_write(const struct iovec *iov, int iovcnt, off_t off) {
+	return ram_copy(iov, iovcnt, off, 1);
+}
+
+static void *ram_map(size_t *size) {
+	*size = ram_size;
+	return ram_disk;
+}
+
+static int ram_sync() {
+	return 0;
+}
+
+static int no_fd() {
+	return -1;
+}
+
+static const struct bio_backend ram_backend = {
+	.name	= "ram",
+	.create	= ram_create,
+	.open	= ram_open,
+	.close	= ram_close,
+	.read	= ram_read,
+	.write	= ram_write,
+	.map	= ram_map,
+	.sync	= ram_sync,
+	.fd		= no_fd,
+};
+
+/*
+ * hdd and ssd
+ *
+ * A transfer is done on the ram disk at once, then the caller sleeps until
+ * the modelled device would have finished it. Devices serve transfers one
+ * at a time per queue in the order they arrive, so a transfer also waits
+ * out the ones ahead of it: a disk drive has one queue, an arm and a head;
+ * a flash drive has several queues, one per channel, and no seek.
+ *
+ * On a disk drive a transfer starting where the last one ended streams on
+ * with no seek or rotation. Any other costs a seek, growing with the
+ * square root of the distance from track-to-track to full stroke, and
+ * half a revolution on average to get the first block under the head.
+ *
+ * Neither model can be mapped, that would skip the delays.
+ */
+#define LAT_QUEUES_MAX 64
+
+struct latency_model {
+	int			hdd;
+	double		seek_us;			/* hdd: full-stroke seek */
+	double		track_us;			/* hdd: track-to-track seek */
+	double		rpm;				/* hdd: spindle speed */
+	double		read_us;			/* ssd: to read a page */
+	double		write_us;			/* ssd: to program a page */
+	int			queues;				/* ssd: transfers served at once */
+	double		mbps;				/* media transfer rate, MB/s */
+};
+
+static struct latency_model model;
+static uint64_t busy_until[LAT_QUEUES_MAX];	/* when each queue is next free, ns */
+static off_t head_pos = 0;					/* hdd: byte the head will be over next */
+static pthread_mutex_t model_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static uint64_t clock_ns() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+//How long the device takes over a transfer of len bytes at off, once it starts on it
+static uint64_t service_ns(off_t off, size_t len, int write) {
+	double us = len / model.mbps;
+	if (!model.hdd) {
+		return (uint64_t)((us + (write ? model.write_us : model.read_us)) * 1000);
+	}
+	if (off != head_pos) {
+		double distance = (double)(off > head_pos ? off - head_pos : head_pos - off) / ram_size;
+		us += model.track_us + (model.seek_us - model.track_us) * sqrt(distance);
+		us += 30e6 / model.rpm;
+	}
+	head_pos = off + len;
+	return (uint64_t)(us * 1000);
+}
+
+//Sleep until the device has done a transfer of len bytes at off
+static void model_wait(off_t off, size_t len, int write) {
+	int i, q = 0;
+	uint64_t now = clock_ns();
+
+	pthread_mutex_lock(&model_lock);
+	for (i = 1; i < model.queues; i++) {
+		if (busy_until[i] < busy_until[q]) {
+			q = i;
+		}
+	}
+	uint64_t start = busy_until[q] > now ? busy_until[q] : now;
+	uint64_t done = start + service_ns(off, len, write);
+	busy_until[q] = done;
+	pthread_mutex_unlock(&model_lock);
+
+	struct timespec ts = { .tv_sec = done / 1000000000, .tv_nsec = done % 1000000000 };
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) != 0) {
+	}
+}
+
+static ssize_t model_read(const struct iovec *iov, int iovcnt, off_t off) {
+	ssize_t done = ram_copy(iov, iovcnt, off, 0);
+	if (done > 0) {
+		model_wait(off, done, 0);
+	}
+	return done;
+}
+
+static ssize_t model_write(const struct iovec *iov, int iovcnt, off_t off) {
+	ssize_t done = ram_copy(iov, iovcnt, off, 1);
+	if (done > 0) {
+		model_wait(off, done, 1);
+	}
+	return done;
+}
+
+static void *no_map(size_t *size) {
+	return NULL;
+}
+
+static const struct bio_backend latency_backend = {
+	.name	= "latency",
+	.create	= ram_create,
+	.open	= ram_open,
+	.close	= ram_close,
+	.read	= model_read,
+	.write	= model_write,
+	.map	= no_map,
+	.sync	= ram_sync,
+	.fd		= no_fd,
+};
+
+//Set one model parameter from name=value, 0 on success
+static int model_param(const char *param) {
+	const char *eq = strchr(param, '=');
+	if (eq == NULL) {
+		return -1;
+	}
+	size_t len = eq - param;
+	double value = atof(eq + 1);
+	if (value <= 0) {
+		return -1;
+	}
+	if (model.hdd && len == 7 && strncmp(param, "seek_us", len) == 0) {
+		model.seek_us = value;
+	} else if (model.hdd && len == 8 && strncmp(param, "track_us", len) == 0) {
+		model.track_us = value;
+	} else if (model.hdd && len == 3 && strncmp(param, "rpm", len) == 0) {
+		model.rpm = value;
+	} else if (!model.hdd && len == 7 && strncmp(param, "read_us", len) == 0) {
+		model.read_us = value;
+	} else if (!model.hdd && len == 8 && strncmp(param, "write_us", len) == 0) {
+		model.write_us = value;
+	} else if (!model.hdd && len == 6 && strncmp(param, "queues", len) == 0 && value <= LAT_QUEUES_MAX) {
+		model.queues = value;
+	} else if (len == 4 && strncmp(param, "mbps", len) == 0) {
+		model.mbps = value;
+	} else {
+		return -1;
+	}
+	return 0;
+}
+
+//The model spec asks for: hdd or ssd, then :name=value for each parameter not left as is
+static int model_init(const char *spec) {
+	memset(&model, 0, sizeof(model));
+	memset(busy_until, 0, sizeof(busy_until));
+	head_pos = 0;
+	model.hdd = strncmp(spec, "hdd", 3) == 0;
+	if (model.hdd) {
+		//a 7200 rpm desktop drive
+		model.seek_us = 16000;
+		model.track_us = 1000;
+		model.rpm = 7200;
+		model.queues = 1;
+		model.mbps = 150;
+	} else {
+		//a SATA flash drive
+		model.read_us = 80;
+		model.write_us = 200;
+		model.queues = 8;
+		model.mbps = 500;
+	}
+
+	const char *param = spec + 3;
+	while (*param == ':') {
+		char buf[64];
+		param++;
+		size_t len = strcspn(param, ":");
+		snprintf(buf, sizeof(buf), "%.*s", (int)len, param);
+		if (model_param(buf) < 0) {
+			fprintf(stderr, "%s: unknown backend parameter %s\n", spec, buf);
+			return -1;
+		}
+		param += len;
+	}
+	return *param == '\0' ? 0 : -1;
+}
+
+const struct bio_backend *backend_get(const char *spec) {
+	if (spec == NULL || strcmp(spec, "file") == 0) {
+		return &file_backend;
+	}
+	if (strcmp(spec, "ram") == 0) {
+		return &ram_backend;
+	}
+	if ((strncmp(spec, "hdd", 3) == 0 || strncmp(spec, "ssd", 3) == 0) && model_init(spec) == 0) {
+		return &latency_backend;
+	}
+	return NULL;
+}
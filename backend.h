@@ -0,0 +1,33 @@
+/*
+ *	Tiny File System
+ *	File:	backend.h
+ *
+ */
+
+#ifndef _BACKEND_H_
+#define _BACKEND_H_
+
+#include <stddef.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+/*
+ * What block.c keeps the disk on. Offsets and lengths are in bytes;
+ * read and write return what they moved, or -1, as preadv/pwritev do.
+ */
+struct bio_backend {
+	const char	*name;
+	int			(*create)(const char *path, size_t size);	/* a new, zeroed disk of size bytes */
+	int			(*open)(const char *path);					/* the disk there is, -1 if there is none */
+	void		(*close)();
+	ssize_t		(*read)(const struct iovec *iov, int iovcnt, off_t off);
+	ssize_t		(*write)(const struct iovec *iov, int iovcnt, off_t off);
+	void		*(*map)(size_t *size);						/* the disk as memory, NULL if it can not be */
+	int			(*sync)();									/* start writing a mapping back */
+	int			(*fd)();									/* host file under it, -1 if none */
+};
+
+/* file, ram, hdd[:param=value...] or ssd[:param=value...], NULL if spec names none of them */
+const struct bio_backend *backend_get(const char *spec);
+
+#endif
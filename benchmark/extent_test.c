@@ -0,0 +1,145 @@
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <string.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "../libtfs.h"
+#include "../block.h"
+#include "../tfs.h"
+
+/*
+ * Extent tree test. Makes a volume with extent-mapped files and has two
+ * writers append to their own file a block at a time, taking turns, so
+ * neither file ever gets two adjacent blocks and each needs an extent per
+ * block: far more than the root and one level of index blocks can hold.
+ * Both files are read back after a remount, then removed, and a file as
+ * large as both together has to fit in the space they gave back.
+ * Runs in-process with libtfs, on the inode layout of this tree:
+ *
+ *	make -C .. libtfs.a && make extent_test && ./extent_test /tmp/extent.disk
+ */
+#define DISK_MB 256
+#define N_BLOCKS 20000
+#define N_FILES 2
+#define READ_BLOCKS 64
+#define FILEPERM 0644
+
+_Static_assert(sizeof(struct inode) == 128, "the test is about the extent root of the 128-byte inode");
+
+static const char *names[N_FILES] = { "/left", "/right" };
+
+//Contents of block i of file f, different in every block of both files
+static void fill(char *buf, int f, int i) {
+	int j;
+	for (j = 0; j < BLOCK_SIZE / (int)sizeof(uint32_t); j++) {
+		((uint32_t *)buf)[j] = ((uint32_t)f << 28) ^ ((uint32_t)i << 8) ^ j;
+	}
+}
+
+static void fail(int test, const char *what) {
+	printf("TEST %d: %s failure \n", test, what);
+	exit(1);
+}
+
+int main(int argc, char **argv) {
+	struct tfs_options opts;
+	struct tfs_file *files[N_FILES], *file;
+	char *buf = malloc(READ_BLOCKS * BLOCK_SIZE);
+	char expect[BLOCK_SIZE];
+	struct stat st;
+	int f, i, j;
+
+	if (argc != 2) {
+		fprintf(stderr, "usage: %s diskfile\n", argv[0]);
+		return 1;
+	}
+	tfs_options_init(&opts);
+	opts.nostats = 1;
+	opts.format = 1;
+	opts.extents = 1;
+	opts.disk_mb = DISK_MB;
+
+	/* TEST 1: two files written a block at a time, in turns */
+	if (tfs_mount(argv[1], &opts) < 0) {
+		fail(1, "Mount");
+	}
+	for (f = 0; f < N_FILES; f++) {
+		if (tfs_create(names[f], FILEPERM, getuid(), getgid(), &files[f]) < 0) {
+			fail(1, "File create");
+		}
+	}
+	for (i = 0; i < N_BLOCKS; i++) {
+		for (f = 0; f < N_FILES; f++) {
+			fill(expect, f, i);
+			if (tfs_write(files[f], expect, BLOCK_SIZE, (off_t)i * BLOCK_SIZE) != BLOCK_SIZE) {
+				printf("%s: block %d \n", names[f], i);
+				fail(1, "Interleaved write");
+			}
+		}
+	}
+	for (f = 0; f < N_FILES; f++) {
+		tfs_release(files[f]);
+	}
+	tfs_unmount();
+	printf("TEST 1: Interleaved write of %d blocks per file Success \n", N_BLOCKS);
+
+	/* TEST 2: both files read back after a remount */
+	opts.format = 0;
+	if (tfs_mount(argv[1], &opts) < 0) {
+		fail(2, "Remount");
+	}
+	for (f = 0; f < N_FILES; f++) {
+		if (tfs_getattr(names[f], &st) < 0 || st.st_size != (off_t)N_BLOCKS * BLOCK_SIZE) {
+			fail(2, "File size");
+		}
+		if (tfs_open(names[f], O_RDONLY, &file) < 0) {
+			fail(2, "File open");
+		}
+		for (i = 0; i < N_BLOCKS; i += READ_BLOCKS) {
+			int n = N_BLOCKS - i < READ_BLOCKS ? N_BLOCKS - i : READ_BLOCKS;
+			if (tfs_read(file, buf, n * BLOCK_SIZE, (off_t)i * BLOCK_SIZE) != n * BLOCK_SIZE) {
+				fail(2, "File read");
+			}
+			for (j = 0; j < n; j++) {
+				fill(expect, f, i + j);
+				if (memcmp(buf + j * BLOCK_SIZE, expect, BLOCK_SIZE) != 0) {
+					printf("%s: block %d \n", names[f], i + j);
+					fail(2, "File contents");
+				}
+			}
+		}
+		tfs_release(file);
+	}
+	printf("TEST 2: Read back after remount Success \n");
+
+	/* TEST 3: removing them gives back every block, tree blocks included */
+	for (f = 0; f < N_FILES; f++) {
+		if (tfs_unlink(names[f]) < 0) {
+			fail(3, "File unlink");
+		}
+	}
+	if (tfs_create("/whole", FILEPERM, getuid(), getgid(), &file) < 0) {
+		fail(3, "File create");
+	}
+	memset(buf, 'w', READ_BLOCKS * BLOCK_SIZE);
+	for (i = 0; i < N_FILES * N_BLOCKS; i += READ_BLOCKS) {
+		if (tfs_write(file, buf, READ_BLOCKS * BLOCK_SIZE, (off_t)i * BLOCK_SIZE) != READ_BLOCKS * BLOCK_SIZE) {
+			fail(3, "Write into freed space");
+		}
+	}
+	tfs_release(file);
+	if (tfs_unlink("/whole") < 0) {
+		fail(3, "File unlink");
+	}
+	tfs_unmount();
+	printf("TEST 3: Space given back Success \n");
+
+	free(buf);
+	printf("Extent test: files of %d extents written, read back and removed \n", N_BLOCKS);
+	return 0;
+}
@@ -0,0 +1,110 @@
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/types.h>
+#include <time.h>
+
+/* You need to change this macro to your TFS mount point*/
+#define TESTDIR "/tmp/jlw373/mountdir"
+
+/*
+ * Large sequential transfer benchmark. Writes a FILE_MB file in XFER_SIZE
+ * requests, then reads it back, and reports throughput and, given the pid
+ * of the tfs process, how much CPU tfs spent per MiB moved.
+ *
+ * Run it once against a mount made the usual way, where whole blocks are
+ * spliced between /dev/fuse and DISKFILE, and once against one mounted
+ * with -o nosplice, where every byte is copied through tfs. Mount with
+ * -o big_writes,max_read=131072 or the kernel sends 4 KiB requests:
+ *
+ *	./tfs -o big_writes,max_read=131072 mountdir ; ./io_bench $(pidof tfs)
+ *	./tfs -o big_writes,max_read=131072,nosplice mountdir ; ./io_bench $(pidof tfs)
+ */
+#define FILE_MB 16
+#define XFER_SIZE (128 * 1024)
+#define PASSES 4
+
+static char buf[XFER_SIZE];
+
+static double now() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+//CPU seconds (user + system) used so far by process pid, or 0 without one
+static double cpu_seconds(int pid) {
+	char path[64];
+	unsigned long utime, stime;
+	FILE *f;
+
+	if (pid <= 0) {
+		return 0;
+	}
+	sprintf(path, "/proc/%d/stat", pid);
+	if ((f = fopen(path, "r")) == NULL) {
+		return 0;
+	}
+	if (fscanf(f, "%*d %*s %*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu", &utime, &stime) != 2) {
+		utime = stime = 0;
+	}
+	fclose(f);
+	return (double)(utime + stime) / sysconf(_SC_CLK_TCK);
+}
+
+static void report(const char *what, double secs, double cpu, int pid) {
+	double mb = (double)FILE_MB * PASSES;
+	printf("%-6s %8.1f MB/s", what, mb / secs);
+	if (pid > 0) {
+		printf("   tfs CPU %6.2f ms/MiB", cpu * 1000 / mb);
+	}
+	printf("\n");
+}
+
+int main(int argc, char **argv) {
+	int pid = argc > 1 ? atoi(argv[1]) : 0;
+	int i, p, fd;
+	double start, cpu;
+
+	memset(buf, 0x5a, XFER_SIZE);
+	if ((fd = open(TESTDIR "/io_bench", O_CREAT | O_RDWR, 0666)) < 0) {
+		perror("open");
+		exit(1);
+	}
+
+	/* sequential writes, over the same blocks after the first pass */
+	cpu = cpu_seconds(pid);
+	start = now();
+	for (p = 0; p < PASSES; p++) {
+		for (i = 0; i < FILE_MB * 1024 * 1024 / XFER_SIZE; i++) {
+			if (pwrite(fd, buf, XFER_SIZE, (off_t)i * XFER_SIZE) != XFER_SIZE) {
+				perror("write");
+				exit(1);
+			}
+		}
+		fsync(fd);
+	}
+	report("write", now() - start, cpu_seconds(pid) - cpu, pid);
+
+	/* sequential reads, with the kernel page cache dropped before each pass */
+	cpu = cpu_seconds(pid);
+	start = now();
+	for (p = 0; p < PASSES; p++) {
+		posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+		for (i = 0; i < FILE_MB * 1024 * 1024 / XFER_SIZE; i++) {
+			if (pread(fd, buf, XFER_SIZE, (off_t)i * XFER_SIZE) != XFER_SIZE || buf[XFER_SIZE - 1] != 0x5a) {
+				perror("read");
+				exit(1);
+			}
+		}
+	}
+	report("read", now() - start, cpu_seconds(pid) - cpu, pid);
+
+	close(fd);
+	unlink(TESTDIR "/io_bench");
+	return 0;
+}
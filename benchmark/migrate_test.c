@@ -0,0 +1,416 @@
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <string.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "../libtfs.h"
+
+/*
+ * Migration test. Writes a disk file laid out the way the original tfs
+ * made one, including what it left unset: block 0 past its 24-byte
+ * superblock and the ends of both bitmap blocks hold leftover bytes, the
+ * root inode was never marked valid, and only the inodes' type, size and
+ * block pointers were written. Then mounts it in-process with libtfs,
+ * which converts it, checks the tree reads back as it was made, before
+ * and after a remount, and that the converted volume takes new files.
+ * Needs libtfs built with 4096-byte blocks, the only size the original
+ * tfs had:
+ *
+ *	make -C .. libtfs.a && make migrate_test && ./migrate_test /tmp/migrate.disk
+ */
+#define OLD_MAGIC 0x5C3A
+#define OLD_BLOCK 4096
+#define OLD_INUM 1024
+#define OLD_DNUM 16384
+#define OLD_DISK_SIZE (32 * 1024 * 1024)
+#define OLD_DIRENTS 19					/* dirent slots laid out per directory block */
+#define N_MANY 40
+#define N_BIG_BLOCKS 10
+#define N_NEW 100
+#define FSPATHLEN 256
+#define FILEPERM 0644
+#define DIRPERM 0755
+
+/* the original on-disk structures, as the original tfs.h had them */
+struct old_superblock {
+	uint32_t	magic_num;
+	uint16_t	max_inum;
+	uint16_t	max_dnum;
+	uint32_t	i_bitmap_blk;
+	uint32_t	d_bitmap_blk;
+	uint32_t	i_start_blk;
+	uint32_t	d_start_blk;
+};
+
+struct old_inode {
+	uint16_t	ino;
+	uint16_t	valid;
+	uint32_t	size;
+	uint32_t	type;
+	uint32_t	link;
+	int			direct_ptr[16];
+	int			indirect_ptr[8];
+	struct stat	vstat;
+};
+
+struct old_dirent {
+	uint16_t	ino;
+	uint16_t	valid;
+	char		name[208];
+	uint16_t	len;
+};
+
+_Static_assert(sizeof(struct old_inode) == 256, "the original inode was 256 bytes on x86-64 Linux");
+
+static unsigned char *disk;
+static int next_ino = 0;
+static int next_blk = 0;
+
+static unsigned char* block(int blkno) {
+	return disk + (size_t)blkno * OLD_BLOCK;
+}
+
+static struct old_superblock* sb() {
+	return (struct old_superblock *)block(0);
+}
+
+static struct old_inode* inode(int ino) {
+	return (struct old_inode *)block(sb()->i_start_blk) + ino;
+}
+
+static void set_bit(int blkno, int i) {
+	block(blkno)[i / 8] |= 1 << (i % 8);
+}
+
+static void clear_bit(int blkno, int i) {
+	block(blkno)[i / 8] &= ~(1 << (i % 8));
+}
+
+//What malloc'd memory held when the original tfs wrote a whole block from a smaller buffer
+static void leftovers(unsigned char *p, size_t len, int seed) {
+	size_t i;
+	for (i = 0; i < len; i++) {
+		p[i] = (unsigned char)(seed * 131 + i * 7 + 0x51);
+	}
+}
+
+static int old_ino() {
+	set_bit(sb()->i_bitmap_blk, next_ino);
+	return next_ino++;
+}
+
+static int old_blk() {
+	set_bit(sb()->d_bitmap_blk, next_blk);
+	return next_blk++;
+}
+
+static void old_inode_init(int ino, int type) {
+	struct old_inode* in = inode(ino);
+	in->ino = ino;
+	in->valid = 1;
+	in->type = type;
+	in->size = 0;
+	in->vstat.st_size = 0;
+	memset(in->direct_ptr, -1, sizeof(in->direct_ptr));
+	//never set by the original tfs
+	leftovers((unsigned char *)in->indirect_ptr, sizeof(in->indirect_ptr), ino);
+}
+
+//Add name to directory dir as the original dir_add did: the first free slot, or a new block
+static void old_dir_add(int dir, const char *name, int ino) {
+	struct old_inode* d = inode(dir);
+	struct old_dirent* slot = NULL;
+	int i, j;
+	for (i = 0; i < 16 && slot == NULL; i++) {
+		if (d->direct_ptr[i] == -1) {
+			continue;
+		}
+		struct old_dirent* entries = (struct old_dirent *)block(sb()->d_start_blk + d->direct_ptr[i]);
+		for (j = 0; j < OLD_DIRENTS; j++) {
+			if (entries[j].valid == 0) {
+				slot = &entries[j];
+				break;
+			}
+		}
+	}
+	if (slot == NULL) {
+		for (i = 0; d->direct_ptr[i] != -1; i++);
+		d->direct_ptr[i] = old_blk();
+		unsigned char* b = block(sb()->d_start_blk + d->direct_ptr[i]);
+		memset(b, 0, OLD_DIRENTS * sizeof(struct old_dirent));
+		leftovers(b + OLD_DIRENTS * sizeof(struct old_dirent), OLD_BLOCK - OLD_DIRENTS * sizeof(struct old_dirent), dir);
+		slot = (struct old_dirent *)b;
+	}
+	slot->ino = ino;
+	slot->valid = 1;
+	slot->len = strlen(name);
+	strcpy(slot->name, name);
+	d->size += sizeof(struct old_dirent);
+	d->vstat.st_size += sizeof(struct old_dirent);
+	d->link++;
+}
+
+static int old_mkdir(int parent, const char *name) {
+	int ino = old_ino();
+	old_dir_add(parent, name, ino);
+	old_inode_init(ino, 0);
+	old_dir_add(ino, ".", ino);
+	old_dir_add(ino, "..", parent);
+	return ino;
+}
+
+static int old_create(int parent, const char *name, const char *data, int len) {
+	int ino = old_ino();
+	int i;
+	old_dir_add(parent, name, ino);
+	old_inode_init(ino, 1);
+	struct old_inode* in = inode(ino);
+	for (i = 0; i * OLD_BLOCK < len; i++) {
+		int n = len - i * OLD_BLOCK < OLD_BLOCK ? len - i * OLD_BLOCK : OLD_BLOCK;
+		in->direct_ptr[i] = old_blk();
+		memcpy(block(sb()->d_start_blk + in->direct_ptr[i]), data + i * OLD_BLOCK, n);
+	}
+	in->size = len;
+	in->vstat.st_size = len;
+	return ino;
+}
+
+//Unlink as the original tfs did: blocks and inode freed, the entry's slot marked free
+static void old_unlink(int parent, const char *name, int ino) {
+	struct old_inode* in = inode(ino);
+	struct old_inode* d = inode(parent);
+	int i, j;
+	for (i = 0; i < 16; i++) {
+		if (in->direct_ptr[i] != -1) {
+			clear_bit(sb()->d_bitmap_blk, in->direct_ptr[i]);
+		}
+	}
+	clear_bit(sb()->i_bitmap_blk, ino);
+	in->valid = 0;
+	for (i = 0; i < 16; i++) {
+		if (d->direct_ptr[i] == -1) {
+			continue;
+		}
+		struct old_dirent* entries = (struct old_dirent *)block(sb()->d_start_blk + d->direct_ptr[i]);
+		for (j = 0; j < OLD_DIRENTS; j++) {
+			if (entries[j].valid == 1 && strcmp(entries[j].name, name) == 0) {
+				entries[j].valid = 0;
+			}
+		}
+	}
+	d->size -= sizeof(struct old_dirent);
+	d->link--;
+}
+
+static void big_block(char *buf, int i) {
+	memset(buf, 'a' + i, OLD_BLOCK);
+	sprintf(buf, "block %d", i);
+}
+
+static void make_disk(const char *path) {
+	struct old_superblock* s;
+	char* big = malloc(N_BIG_BLOCKS * OLD_BLOCK);
+	char name[FSPATHLEN], data[FSPATHLEN];
+	int i, fd;
+
+	disk = calloc(1, OLD_DISK_SIZE);
+	leftovers(block(0), OLD_BLOCK, 0);
+	s = sb();
+	s->magic_num = OLD_MAGIC;
+	s->max_inum = OLD_INUM;
+	s->max_dnum = OLD_DNUM;
+	s->i_bitmap_blk = 1;
+	s->d_bitmap_blk = 2;
+	s->i_start_blk = 3;
+	s->d_start_blk = 3 + OLD_INUM * sizeof(struct old_inode) / OLD_BLOCK;
+	//what a real image had just past the superblock: it reads as features with every bit tfs knows set
+	*(uint32_t *)(block(0) + sizeof(struct old_superblock)) = 0x20d51;
+	leftovers(block(1) + OLD_INUM / 8, OLD_BLOCK - OLD_INUM / 8, 1);
+	leftovers(block(2) + OLD_DNUM / 8, OLD_BLOCK - OLD_DNUM / 8, 2);
+
+	//the root was built on the stack with only ino, type, mode and direct_ptr set
+	int root = old_ino();
+	struct old_inode* r = inode(root);
+	leftovers((unsigned char *)r, sizeof(*r), 3);
+	r->ino = root;
+	r->valid = 0;
+	r->type = 0;
+	r->vstat.st_mode = S_IFDIR | 0755;
+	memset(r->direct_ptr, -1, sizeof(r->direct_ptr));
+
+	int a = old_mkdir(root, "a");
+	old_mkdir(a, "b");
+	old_create(a, "f1", "hello from the original tfs", 27);
+	for (i = 0; i < N_BIG_BLOCKS; i++) {
+		big_block(big + i * OLD_BLOCK, i);
+	}
+	old_create(root, "big", big, N_BIG_BLOCKS * OLD_BLOCK);
+	int many = old_mkdir(root, "many");
+	for (i = 0; i < N_MANY; i++) {
+		sprintf(name, "file%d", i);
+		sprintf(data, "contents of file %d", i);
+		old_create(many, name, data, strlen(data));
+	}
+	int gone = old_create(many, "gone", "removed", 7);
+	old_unlink(many, "gone", gone);
+
+	if ((fd = open(path, O_CREAT | O_TRUNC | O_WRONLY, 0600)) < 0
+			|| write(fd, disk, OLD_DISK_SIZE) != OLD_DISK_SIZE || close(fd) < 0) {
+		perror(path);
+		exit(1);
+	}
+	free(big);
+	free(disk);
+}
+
+static int entries;
+
+static int count_entry(void *buf, const char *name, const struct stat *stbuf, off_t off) {
+	entries++;
+	return 0;
+}
+
+static int read_file(const char *path, char *buf, size_t size) {
+	struct tfs_file *file;
+	if (tfs_open(path, O_RDONLY, &file) < 0) {
+		return -1;
+	}
+	int n = tfs_read(file, buf, size, 0);
+	tfs_release(file);
+	return n;
+}
+
+static void fail(int test, const char *what) {
+	printf("TEST %d: %s failure \n", test, what);
+	exit(1);
+}
+
+//Check the tree make_disk() wrote, and the extra files made after converting it
+static void check_tree(int test, int extra) {
+	char* buf = malloc(N_BIG_BLOCKS * OLD_BLOCK);
+	char expect[OLD_BLOCK], path[FSPATHLEN];
+	struct stat st;
+	int i;
+
+	if (tfs_getattr("/", &st) < 0 || !S_ISDIR(st.st_mode)) {
+		fail(test, "Root directory");
+	}
+	entries = 0;
+	if (tfs_readdir("/", NULL, count_entry) < 0 || entries < 3) {
+		fail(test, "Root directory listing");
+	}
+	if (tfs_getattr("/a", &st) < 0 || !S_ISDIR(st.st_mode)
+			|| tfs_getattr("/a/b", &st) < 0 || !S_ISDIR(st.st_mode)) {
+		fail(test, "Directory lookup");
+	}
+	if (read_file("/a/f1", buf, OLD_BLOCK) != 27 || memcmp(buf, "hello from the original tfs", 27) != 0) {
+		fail(test, "Small file read");
+	}
+	if (read_file("/big", buf, N_BIG_BLOCKS * OLD_BLOCK) != N_BIG_BLOCKS * OLD_BLOCK) {
+		fail(test, "Large file read");
+	}
+	for (i = 0; i < N_BIG_BLOCKS; i++) {
+		big_block(expect, i);
+		if (memcmp(buf + i * OLD_BLOCK, expect, OLD_BLOCK) != 0) {
+			fail(test, "Large file contents");
+		}
+	}
+	for (i = 0; i < N_MANY; i++) {
+		sprintf(path, "/many/file%d", i);
+		sprintf(expect, "contents of file %d", i);
+		if (read_file(path, buf, OLD_BLOCK) != (int)strlen(expect) || memcmp(buf, expect, strlen(expect)) != 0) {
+			fail(test, "Directory of many files");
+		}
+	}
+	entries = 0;
+	if (tfs_readdir("/many", NULL, count_entry) < 0 || entries != N_MANY + 2 + extra) {
+		fail(test, "Directory of many files listing");
+	}
+	if (tfs_getattr("/many/gone", &st) != -ENOENT) {
+		fail(test, "Removed file");
+	}
+	free(buf);
+}
+
+int main(int argc, char **argv) {
+	struct tfs_options opts;
+	struct tfs_file *file;
+	char path[FSPATHLEN];
+	struct stat st;
+	int i;
+
+	if (argc != 2) {
+		fprintf(stderr, "usage: %s diskfile\n", argv[0]);
+		return 1;
+	}
+	make_disk(argv[1]);
+	tfs_options_init(&opts);
+	opts.nostats = 1;
+
+	/* TEST 1: mount converts the volume */
+	if (tfs_mount(argv[1], &opts) < 0) {
+		fail(1, "Mount");
+	}
+	printf("TEST 1: Mount Success \n");
+
+	/* TEST 2: the tree reads back as the original tfs made it */
+	check_tree(2, 0);
+	printf("TEST 2: Converted tree Success \n");
+
+	/* TEST 3: new files and directories on the converted volume */
+	for (i = 0; i < N_NEW; i++) {
+		sprintf(path, "/many/new%d", i);
+		if (tfs_create(path, FILEPERM, getuid(), getgid(), &file) < 0) {
+			fail(3, "File create");
+		}
+		if (tfs_write(file, path, strlen(path), 0) != (int)strlen(path)) {
+			fail(3, "File write");
+		}
+		tfs_release(file);
+	}
+	if (tfs_mkdir("/c", DIRPERM, getuid(), getgid()) < 0) {
+		fail(3, "Directory create");
+	}
+	tfs_unmount();
+	printf("TEST 3: New files Success \n");
+
+	/* TEST 4: all of it is still there after a remount, which converts nothing */
+	if (tfs_mount(argv[1], &opts) < 0) {
+		fail(4, "Remount");
+	}
+	check_tree(4, N_NEW);
+	for (i = 0; i < N_NEW; i++) {
+		sprintf(path, "/many/new%d", i);
+		if (tfs_getattr(path, &st) < 0 || st.st_size != (off_t)strlen(path)) {
+			fail(4, "New file lookup");
+		}
+	}
+	if (tfs_getattr("/c", &st) < 0 || !S_ISDIR(st.st_mode)) {
+		fail(4, "New directory lookup");
+	}
+	printf("TEST 4: Remount Success \n");
+
+	/* TEST 5: converted entries can be removed */
+	for (i = 0; i < N_NEW; i++) {
+		sprintf(path, "/many/new%d", i);
+		if (tfs_unlink(path) < 0) {
+			fail(5, "File unlink");
+		}
+	}
+	if (tfs_unlink("/a/f1") < 0 || tfs_rmdir("/a/b") < 0 || tfs_rmdir("/a") < 0 || tfs_rmdir("/c") < 0) {
+		fail(5, "Remove");
+	}
+	if (tfs_getattr("/a", &st) != -ENOENT) {
+		fail(5, "Directory remove");
+	}
+	tfs_unmount();
+	printf("TEST 5: Remove Success \n");
+
+	printf("Migration test: volume of the original tfs converted and verified \n");
+	return 0;
+}
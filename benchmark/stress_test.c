@@ -0,0 +1,217 @@
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/types.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <time.h>
+
+/* You need to change this macro to your TFS mount point*/
+#define TESTDIR "/tmp/jlw373/mountdir"
+
+/*
+ * Concurrency stress test: N_THREADS threads hammer the mount at once with
+ * a mix of operations that share directories and files, so that every pair
+ * of locks the file system takes gets contended. Each thread checks the
+ * data it reads back, and a watchdog fails the test if no thread finishes
+ * an operation for WATCHDOG_SECS, which is what a deadlock looks like from
+ * the outside.
+ */
+#define N_THREADS 32
+#define ITERS 200
+#define BLOCKSIZE 4096
+#define SHARED_BLOCKS 64
+#define FSPATHLEN 256
+#define FILEPERM 0666
+#define DIRPERM 0755
+#define WATCHDOG_SECS 30
+
+static volatile unsigned long progress = 0;
+static volatile int finished = 0;
+
+static void fail(int id, const char *what) {
+	printf("thread %d: %s failure (errno %d: %s)\n", id, what, errno, strerror(errno));
+	exit(1);
+}
+
+static void fill(char *buf, int seed) {
+	int i;
+	for (i = 0; i < BLOCKSIZE; i++) {
+		buf[i] = (char)(seed * 31 + i);
+	}
+}
+
+static void *worker(void *arg) {
+	int id = (int)(long)arg;
+	char buf[BLOCKSIZE], expect[BLOCKSIZE];
+	char path[FSPATHLEN], dirpath[FSPATHLEN / 2];
+	int i, fd;
+	unsigned int seed = id;
+
+	sprintf(dirpath, TESTDIR "/stress/t%d", id);
+	if (mkdir(dirpath, DIRPERM) < 0) {
+		fail(id, "mkdir");
+	}
+
+	for (i = 0; i < ITERS; i++) {
+		int blk = rand_r(&seed) % SHARED_BLOCKS;
+
+		switch (rand_r(&seed) % 6) {
+		case 0:
+			/* private file: write, read back, remove */
+			snprintf(path, FSPATHLEN, "%s/f%d", dirpath, i);
+			if ((fd = creat(path, FILEPERM)) < 0) {
+				fail(id, "creat");
+			}
+			fill(expect, id + i);
+			if (pwrite(fd, expect, BLOCKSIZE, (off_t)blk * BLOCKSIZE) != BLOCKSIZE) {
+				fail(id, "write");
+			}
+			close(fd);
+			if ((fd = open(path, O_RDONLY)) < 0) {
+				fail(id, "open");
+			}
+			if (pread(fd, buf, BLOCKSIZE, (off_t)blk * BLOCKSIZE) != BLOCKSIZE || memcmp(buf, expect, BLOCKSIZE) != 0) {
+				fail(id, "read back");
+			}
+			close(fd);
+			if (unlink(path) < 0) {
+				fail(id, "unlink");
+			}
+			break;
+		case 1:
+			/* shared file: readers of the blocks the writers keep rewriting with the same pattern */
+			if ((fd = open(TESTDIR "/stress/shared", O_RDONLY)) < 0) {
+				fail(id, "open shared");
+			}
+			fill(expect, blk);
+			if (pread(fd, buf, BLOCKSIZE, (off_t)blk * BLOCKSIZE) != BLOCKSIZE || memcmp(buf, expect, BLOCKSIZE) != 0) {
+				fail(id, "read shared");
+			}
+			close(fd);
+			break;
+		case 2:
+			if ((fd = open(TESTDIR "/stress/shared", O_WRONLY)) < 0) {
+				fail(id, "open shared");
+			}
+			fill(buf, blk);
+			if (pwrite(fd, buf, BLOCKSIZE, (off_t)blk * BLOCKSIZE) != BLOCKSIZE) {
+				fail(id, "write shared");
+			}
+			close(fd);
+			break;
+		case 3:
+			/* directories in a directory everyone uses, racing on the same names */
+			sprintf(path, TESTDIR "/stress/common/d%d", blk);
+			if (mkdir(path, DIRPERM) < 0 && errno != EEXIST) {
+				fail(id, "mkdir common");
+			}
+			if (rmdir(path) < 0 && errno != ENOENT && errno != ENOTEMPTY) {
+				fail(id, "rmdir common");
+			}
+			break;
+		case 4:
+			/* a file in another thread's directory, which may be gone by now */
+			sprintf(path, TESTDIR "/stress/common/f%d", blk);
+			if ((fd = creat(path, FILEPERM)) >= 0) {
+				close(fd);
+			}
+			if (unlink(path) < 0 && errno != ENOENT) {
+				fail(id, "unlink common");
+			}
+			break;
+		case 5: {
+			DIR *dir = opendir(TESTDIR "/stress/common");
+			if (dir == NULL) {
+				fail(id, "opendir common");
+			}
+			while (readdir(dir) != NULL)
+				;
+			closedir(dir);
+			break;
+		}
+		}
+		__sync_fetch_and_add(&progress, 1);
+	}
+
+	if (rmdir(dirpath) < 0) {
+		fail(id, "rmdir");
+	}
+	return NULL;
+}
+
+static void *watchdog(void *arg) {
+	unsigned long last = progress;
+	int idle = 0;
+	while (!finished) {
+		sleep(1);
+		if (progress != last) {
+			last = progress;
+			idle = 0;
+		} else if (++idle >= WATCHDOG_SECS) {
+			printf("No operation completed for %d seconds: deadlock suspected\n", WATCHDOG_SECS);
+			exit(1);
+		}
+	}
+	return NULL;
+}
+
+int main(int argc, char **argv) {
+	pthread_t threads[N_THREADS], dog;
+	char buf[BLOCKSIZE];
+	struct timespec start, end;
+	int i, fd;
+
+	if (mkdir(TESTDIR "/stress", DIRPERM) < 0 || mkdir(TESTDIR "/stress/common", DIRPERM) < 0) {
+		perror("mkdir");
+		printf("Check if dir %s already exists, and if it exists, manually remove and re-run \n", TESTDIR "/stress");
+		exit(1);
+	}
+	if ((fd = creat(TESTDIR "/stress/shared", FILEPERM)) < 0) {
+		perror("creat");
+		exit(1);
+	}
+	for (i = 0; i < SHARED_BLOCKS; i++) {
+		fill(buf, i);
+		if (write(fd, buf, BLOCKSIZE) != BLOCKSIZE) {
+			perror("write");
+			exit(1);
+		}
+	}
+	close(fd);
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	pthread_create(&dog, NULL, watchdog, NULL);
+	for (i = 0; i < N_THREADS; i++) {
+		pthread_create(&threads[i], NULL, worker, (void *)(long)i);
+	}
+	for (i = 0; i < N_THREADS; i++) {
+		pthread_join(threads[i], NULL);
+	}
+	finished = 1;
+	pthread_join(dog, NULL);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	/* the shared file must still hold one whole pattern per block */
+	if ((fd = open(TESTDIR "/stress/shared", O_RDONLY)) < 0) {
+		perror("open");
+		exit(1);
+	}
+	for (i = 0; i < SHARED_BLOCKS; i++) {
+		char expect[BLOCKSIZE];
+		fill(expect, i);
+		if (read(fd, buf, BLOCKSIZE) != BLOCKSIZE || memcmp(buf, expect, BLOCKSIZE) != 0) {
+			printf("Shared file block %d corrupted \n", i);
+			exit(1);
+		}
+	}
+	close(fd);
+
+	printf("Stress test: %d threads x %d operations in %.2f s, no deadlock \n", N_THREADS, ITERS,
+		(end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9);
+	return 0;
+}
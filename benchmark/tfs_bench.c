@@ -0,0 +1,651 @@
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/types.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <time.h>
+
+/*
+ * Benchmark driver. Runs a set of workloads against a mounted TFS with N
+ * threads at once and prints one JSON object with a result per phase:
+ * operations, bytes, wall time, throughput, and p50/p99/p999 latency of
+ * the individual operations.
+ *
+ *	seq		sequential write, then read, of a file per thread, per I/O size
+ *	rand	random aligned writes, then reads, over the same files, per I/O size
+ *	meta	mdtest-style storms: each thread creates, stats, then unlinks files in its own directory
+ *	deep	stat of a file at the end of a long chain of directories
+ *	bigdir	all threads creating, stating, listing and unlinking names in one large directory
+ *
+ *	./tfs_bench -t 8 -s 4k,64k,1m -o results.json mountdir
+ *
+ * Reads drop the kernel page cache for the file first, so they reach TFS.
+ * Everything is made under mountdir/tfs_bench and removed afterwards.
+ */
+#define BENCH_DIR "tfs_bench"
+#define FSPATHLEN 1024
+#define FILEPERM 0666
+#define DIRPERM 0755
+#define MAX_SIZES 8
+#define MAX_PHASES 64
+
+struct params {
+	const char	*mount;
+	int			threads;
+	size_t		sizes[MAX_SIZES];		/* I/O sizes for seq and rand */
+	int			nsizes;
+	size_t		file_size;				/* bytes per thread for seq and rand */
+	int			files;					/* files per thread for meta */
+	int			depth;					/* directories above the file for deep */
+	int			lookups;				/* stats per thread for deep */
+	int			dir_entries;			/* names in the directory for bigdir */
+	const char	*workloads;
+};
+
+static struct params p = {
+	.threads = 4,
+	.file_size = 4 << 20,
+	.files = 64,
+	.depth = 16,
+	.lookups = 2000,
+	.dir_entries = 512,
+	.workloads = "seq,rand,meta,deep,bigdir",
+};
+
+struct worker {
+	int			id;
+	pthread_t	thread;
+	uint64_t	*lat;					/* ns per operation */
+	size_t		nlat;
+	size_t		cap;
+	uint64_t	bytes;
+	int			errors;
+	uint64_t	began;					/* when the thread started and finished the phase */
+	uint64_t	ended;
+	unsigned	seed;
+	char		*buf;
+};
+
+struct phase;
+typedef void (*phase_fn)(struct worker *w, const struct phase *ph);
+
+struct phase {
+	const char	*name;
+	size_t		io_size;
+	phase_fn	run;
+};
+
+static struct worker *workers;
+static pthread_barrier_t start_line;
+static char root[FSPATHLEN / 2];
+static char *buf_pool;
+
+struct result {
+	char		name[32];
+	size_t		io_size;
+	size_t		ops;
+	uint64_t	bytes;
+	int			errors;
+	double		secs;
+	double		p50, p99, p999;			/* us */
+};
+
+static struct result results[MAX_PHASES];
+static int nresults = 0;
+
+static uint64_t now_ns() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void record(struct worker *w, uint64_t start) {
+	if (w->nlat == w->cap) {
+		w->cap = w->cap ? w->cap * 2 : 1024;
+		w->lat = realloc(w->lat, w->cap * sizeof(uint64_t));
+	}
+	w->lat[w->nlat++] = now_ns() - start;
+}
+
+static void die(const char *what) {
+	perror(what);
+	exit(1);
+}
+
+/*
+ * Workloads. Each runs in every thread, between the start line and the
+ * join that ends the phase's wall time.
+ */
+static void thread_file(struct worker *w, char *path) {
+	snprintf(path, FSPATHLEN, "%s/t%d/data", root, w->id);
+}
+
+static void seq_write(struct worker *w, const struct phase *ph) {
+	char path[FSPATHLEN];
+	off_t off;
+	int fd;
+
+	thread_file(w, path);
+	if ((fd = open(path, O_CREAT | O_WRONLY, FILEPERM)) < 0) {
+		die("open");
+	}
+	for (off = 0; off + ph->io_size <= p.file_size; off += ph->io_size) {
+		uint64_t start = now_ns();
+		if (pwrite(fd, w->buf, ph->io_size, off) != (ssize_t)ph->io_size) {
+			w->errors++;
+		} else {
+			w->bytes += ph->io_size;
+		}
+		record(w, start);
+	}
+	fsync(fd);
+	close(fd);
+}
+
+static void seq_read(struct worker *w, const struct phase *ph) {
+	char path[FSPATHLEN];
+	off_t off;
+	int fd;
+
+	thread_file(w, path);
+	if ((fd = open(path, O_RDONLY)) < 0) {
+		die("open");
+	}
+	posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+	for (off = 0; off + ph->io_size <= p.file_size; off += ph->io_size) {
+		uint64_t start = now_ns();
+		if (pread(fd, w->buf, ph->io_size, off) != (ssize_t)ph->io_size) {
+			w->errors++;
+		} else {
+			w->bytes += ph->io_size;
+		}
+		record(w, start);
+	}
+	close(fd);
+}
+
+static void rand_io(struct worker *w, const struct phase *ph, int writing) {
+	char path[FSPATHLEN];
+	size_t n = p.file_size / ph->io_size, i;
+	int fd;
+
+	thread_file(w, path);
+	if ((fd = open(path, writing ? O_WRONLY : O_RDONLY)) < 0) {
+		die("open");
+	}
+	if (!writing) {
+		posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+	}
+	for (i = 0; i < n; i++) {
+		off_t off = (off_t)(rand_r(&w->seed) % n) * ph->io_size;
+		uint64_t start = now_ns();
+		ssize_t done = writing ? pwrite(fd, w->buf, ph->io_size, off) : pread(fd, w->buf, ph->io_size, off);
+		if (done != (ssize_t)ph->io_size) {
+			w->errors++;
+		} else {
+			w->bytes += ph->io_size;
+		}
+		record(w, start);
+	}
+	if (writing) {
+		fsync(fd);
+	}
+	close(fd);
+}
+
+static void rand_write(struct worker *w, const struct phase *ph) {
+	rand_io(w, ph, 1);
+}
+
+static void rand_read(struct worker *w, const struct phase *ph) {
+	rand_io(w, ph, 0);
+}
+
+static void meta_create(struct worker *w, const struct phase *ph) {
+	char path[FSPATHLEN];
+	int i, fd;
+	for (i = 0; i < p.files; i++) {
+		snprintf(path, FSPATHLEN, "%s/t%d/m%d", root, w->id, i);
+		uint64_t start = now_ns();
+		if ((fd = open(path, O_CREAT | O_EXCL | O_WRONLY, FILEPERM)) < 0) {
+			w->errors++;
+		} else {
+			close(fd);
+		}
+		record(w, start);
+	}
+}
+
+static void meta_stat(struct worker *w, const struct phase *ph) {
+	char path[FSPATHLEN];
+	struct stat st;
+	int i;
+	for (i = 0; i < p.files; i++) {
+		snprintf(path, FSPATHLEN, "%s/t%d/m%d", root, w->id, i);
+		uint64_t start = now_ns();
+		if (stat(path, &st) < 0) {
+			w->errors++;
+		}
+		record(w, start);
+	}
+}
+
+static void meta_unlink(struct worker *w, const struct phase *ph) {
+	char path[FSPATHLEN];
+	int i;
+	for (i = 0; i < p.files; i++) {
+		snprintf(path, FSPATHLEN, "%s/t%d/m%d", root, w->id, i);
+		uint64_t start = now_ns();
+		if (unlink(path) < 0) {
+			w->errors++;
+		}
+		record(w, start);
+	}
+}
+
+//root/deep/d0/d1/.../leaf
+static void deep_path(char *path, int depth) {
+	int i, len = snprintf(path, FSPATHLEN, "%s/deep", root);
+	for (i = 0; i < depth && len < FSPATHLEN; i++) {
+		len += snprintf(path + len, FSPATHLEN - len, "/d%d", i);
+	}
+}
+
+static void deep_lookup(struct worker *w, const struct phase *ph) {
+	char path[FSPATHLEN];
+	struct stat st;
+	int i;
+	deep_path(path, p.depth);
+	strncat(path, "/leaf", FSPATHLEN - strlen(path) - 1);
+	for (i = 0; i < p.lookups; i++) {
+		uint64_t start = now_ns();
+		if (stat(path, &st) < 0) {
+			w->errors++;
+		}
+		record(w, start);
+	}
+}
+
+//Thread id makes names id, id + threads, ... of the shared directory
+static void bigdir_create(struct worker *w, const struct phase *ph) {
+	char path[FSPATHLEN];
+	int i, fd;
+	for (i = w->id; i < p.dir_entries; i += p.threads) {
+		snprintf(path, FSPATHLEN, "%s/big/entry-%06d", root, i);
+		uint64_t start = now_ns();
+		if ((fd = open(path, O_CREAT | O_EXCL | O_WRONLY, FILEPERM)) < 0) {
+			w->errors++;
+		} else {
+			close(fd);
+		}
+		record(w, start);
+	}
+}
+
+static void bigdir_stat(struct worker *w, const struct phase *ph) {
+	char path[FSPATHLEN];
+	struct stat st;
+	int i;
+	for (i = 0; i < p.dir_entries; i++) {
+		snprintf(path, FSPATHLEN, "%s/big/entry-%06d", root, rand_r(&w->seed) % p.dir_entries);
+		uint64_t start = now_ns();
+		if (stat(path, &st) < 0) {
+			w->errors++;
+		}
+		record(w, start);
+	}
+}
+
+static void bigdir_list(struct worker *w, const struct phase *ph) {
+	char path[FSPATHLEN];
+	struct dirent *de;
+	int n = 0;
+	snprintf(path, FSPATHLEN, "%s/big", root);
+	uint64_t start = now_ns();
+	DIR *dir = opendir(path);
+	if (dir == NULL) {
+		w->errors++;
+		return;
+	}
+	while ((de = readdir(dir)) != NULL) {
+		n++;
+	}
+	closedir(dir);
+	record(w, start);
+	if (n < p.dir_entries) {
+		w->errors++;
+	}
+}
+
+static void bigdir_unlink(struct worker *w, const struct phase *ph) {
+	char path[FSPATHLEN];
+	int i;
+	for (i = w->id; i < p.dir_entries; i += p.threads) {
+		snprintf(path, FSPATHLEN, "%s/big/entry-%06d", root, i);
+		uint64_t start = now_ns();
+		if (unlink(path) < 0) {
+			w->errors++;
+		}
+		record(w, start);
+	}
+}
+
+/*
+ * Phases
+ */
+struct run_arg {
+	struct worker		*w;
+	const struct phase	*ph;
+};
+
+static void *worker_main(void *arg) {
+	struct run_arg *ra = arg;
+	pthread_barrier_wait(&start_line);
+	ra->w->began = now_ns();
+	ra->ph->run(ra->w, ra->ph);
+	ra->w->ended = now_ns();
+	return NULL;
+}
+
+static int cmp_u64(const void *a, const void *b) {
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+	return x < y ? -1 : x > y;
+}
+
+static double pct(uint64_t *lat, size_t n, double q) {
+	if (n == 0) {
+		return 0;
+	}
+	size_t i = (size_t)(q * n);
+	return lat[i < n ? i : n - 1] / 1000.0;
+}
+
+static void run_phase(const struct phase *ph) {
+	struct run_arg args[p.threads];
+	struct result *r = &results[nresults++];
+	uint64_t began = UINT64_MAX, ended = 0;
+	size_t total = 0;
+	int i;
+
+	pthread_barrier_init(&start_line, NULL, p.threads + 1);
+	for (i = 0; i < p.threads; i++) {
+		struct worker *w = &workers[i];
+		w->nlat = 0;
+		w->bytes = 0;
+		w->errors = 0;
+		args[i].w = w;
+		args[i].ph = ph;
+		pthread_create(&w->thread, NULL, worker_main, &args[i]);
+	}
+	pthread_barrier_wait(&start_line);
+	for (i = 0; i < p.threads; i++) {
+		pthread_join(workers[i].thread, NULL);
+		began = workers[i].began < began ? workers[i].began : began;
+		ended = workers[i].ended > ended ? workers[i].ended : ended;
+	}
+	pthread_barrier_destroy(&start_line);
+
+	//the phase lasts from the first thread starting it to the last one finishing
+	memset(r, 0, sizeof(*r));
+	r->secs = (ended - began) / 1e9;
+
+	snprintf(r->name, sizeof(r->name), "%s", ph->name);
+	r->io_size = ph->io_size;
+	for (i = 0; i < p.threads; i++) {
+		total += workers[i].nlat;
+		r->bytes += workers[i].bytes;
+		r->errors += workers[i].errors;
+	}
+	uint64_t *all = malloc((total ? total : 1) * sizeof(uint64_t));
+	for (i = 0, total = 0; i < p.threads; i++) {
+		memcpy(all + total, workers[i].lat, workers[i].nlat * sizeof(uint64_t));
+		total += workers[i].nlat;
+	}
+	qsort(all, total, sizeof(uint64_t), cmp_u64);
+	r->ops = total;
+	r->p50 = pct(all, total, 0.50);
+	r->p99 = pct(all, total, 0.99);
+	r->p999 = pct(all, total, 0.999);
+	free(all);
+	fprintf(stderr, "%-16s %8zu %8zu ops %8.3f s %10.0f ops/s %8.1f MB/s  p50 %.1f p99 %.1f p999 %.1f us%s\n",
+		r->name, r->io_size, r->ops, r->secs, r->ops / r->secs, r->bytes / r->secs / (1 << 20),
+		r->p50, r->p99, r->p999, r->errors ? "  ERRORS" : "");
+}
+
+static int wanted(const char *workload) {
+	size_t len = strlen(workload);
+	const char *s = p.workloads;
+	while (s != NULL && *s) {
+		if (strncmp(s, workload, len) == 0 && (s[len] == ',' || s[len] == '\0')) {
+			return 1;
+		}
+		s = strchr(s, ',');
+		s = s != NULL ? s + 1 : NULL;
+	}
+	return 0;
+}
+
+static void make_dir(const char *path) {
+	if (mkdir(path, DIRPERM) < 0 && errno != EEXIST) {
+		die(path);
+	}
+}
+
+static void remove_path(const char *path) {
+	if (unlink(path) < 0 && errno != ENOENT) {
+		perror(path);
+	}
+}
+
+static void setup() {
+	char path[FSPATHLEN];
+	int i;
+
+	snprintf(root, sizeof(root), "%s/" BENCH_DIR, p.mount);
+	if (mkdir(root, DIRPERM) < 0) {
+		perror(root);
+		printf("Check if dir %s already exists, and if it exists, manually remove and re-run \n", root);
+		exit(1);
+	}
+	for (i = 0; i < p.threads; i++) {
+		snprintf(path, FSPATHLEN, "%s/t%d", root, i);
+		make_dir(path);
+	}
+}
+
+static void teardown() {
+	char path[FSPATHLEN];
+	int i;
+	for (i = 0; i < p.threads; i++) {
+		snprintf(path, FSPATHLEN, "%s/t%d/data", root, i);
+		remove_path(path);
+		snprintf(path, FSPATHLEN, "%s/t%d", root, i);
+		rmdir(path);
+	}
+	rmdir(root);
+}
+
+static void deep_make() {
+	char path[FSPATHLEN];
+	int i, fd;
+	for (i = 0; i <= p.depth; i++) {
+		deep_path(path, i);
+		make_dir(path);
+	}
+	strncat(path, "/leaf", FSPATHLEN - strlen(path) - 1);
+	if ((fd = open(path, O_CREAT | O_WRONLY, FILEPERM)) < 0) {
+		die(path);
+	}
+	close(fd);
+}
+
+static void deep_remove() {
+	char path[FSPATHLEN];
+	int i;
+	deep_path(path, p.depth);
+	strncat(path, "/leaf", FSPATHLEN - strlen(path) - 1);
+	remove_path(path);
+	for (i = p.depth; i >= 0; i--) {
+		deep_path(path, i);
+		rmdir(path);
+	}
+}
+
+static size_t parse_size(const char *s) {
+	char *end;
+	size_t n = strtoul(s, &end, 10);
+	if (*end == 'k' || *end == 'K') {
+		n <<= 10;
+	} else if (*end == 'm' || *end == 'M') {
+		n <<= 20;
+	}
+	return n;
+}
+
+static void usage(const char *prog) {
+	fprintf(stderr,
+		"usage: %s [options] mountdir\n"
+		"  -t threads     threads running each phase at once (%d)\n"
+		"  -s sizes       I/O sizes for seq and rand, comma separated (4k,64k,1m)\n"
+		"  -f size        file size per thread for seq and rand (4m)\n"
+		"  -n files       files per thread for meta (%d)\n"
+		"  -d depth       directories above the file for deep (%d)\n"
+		"  -l lookups     stats per thread for deep (%d)\n"
+		"  -e entries     names in the directory for bigdir (%d)\n"
+		"  -w workloads   any of seq,rand,meta,deep,bigdir (all)\n"
+		"  -o file        write the JSON there rather than to stdout\n",
+		prog, p.threads, p.files, p.depth, p.lookups, p.dir_entries);
+	exit(1);
+}
+
+static void print_json(FILE *f) {
+	int i;
+	fprintf(f, "{\n  \"mount\": \"%s\",\n  \"threads\": %d,\n  \"file_size\": %zu,\n  \"results\": [\n",
+		p.mount, p.threads, p.file_size);
+	for (i = 0; i < nresults; i++) {
+		struct result *r = &results[i];
+		fprintf(f, "    {\"phase\": \"%s\", \"io_size\": %zu, \"ops\": %zu, \"bytes\": %llu, \"errors\": %d, "
+			"\"secs\": %.6f, \"ops_per_sec\": %.1f, \"mb_per_sec\": %.2f, "
+			"\"p50_us\": %.2f, \"p99_us\": %.2f, \"p999_us\": %.2f}%s\n",
+			r->name, r->io_size, r->ops, (unsigned long long)r->bytes, r->errors, r->secs,
+			r->ops / r->secs, r->bytes / r->secs / (1 << 20), r->p50, r->p99, r->p999,
+			i < nresults - 1 ? "," : "");
+	}
+	fprintf(f, "  ]\n}\n");
+}
+
+int main(int argc, char **argv) {
+	const char *out = NULL;
+	size_t max_size = 0;
+	struct phase ph;
+	int i, opt, errors = 0;
+
+	while ((opt = getopt(argc, argv, "t:s:f:n:d:l:e:w:o:")) != -1) {
+		switch (opt) {
+		case 't': p.threads = atoi(optarg); break;
+		case 's': {
+			char *list = strdup(optarg), *tok;
+			p.nsizes = 0;
+			for (tok = strtok(list, ","); tok != NULL && p.nsizes < MAX_SIZES; tok = strtok(NULL, ",")) {
+				p.sizes[p.nsizes++] = parse_size(tok);
+			}
+			free(list);
+			break;
+		}
+		case 'f': p.file_size = parse_size(optarg); break;
+		case 'n': p.files = atoi(optarg); break;
+		case 'd': p.depth = atoi(optarg); break;
+		case 'l': p.lookups = atoi(optarg); break;
+		case 'e': p.dir_entries = atoi(optarg); break;
+		case 'w': p.workloads = optarg; break;
+		case 'o': out = optarg; break;
+		default: usage(argv[0]);
+		}
+	}
+	if (optind != argc - 1 || p.threads < 1) {
+		usage(argv[0]);
+	}
+	p.mount = argv[optind];
+	if (p.nsizes == 0) {
+		p.sizes[0] = 4 << 10;
+		p.sizes[1] = 64 << 10;
+		p.sizes[2] = 1 << 20;
+		p.nsizes = 3;
+	}
+	for (i = 0; i < p.nsizes; i++) {
+		if (p.sizes[i] == 0 || p.sizes[i] > p.file_size) {
+			fprintf(stderr, "I/O size %zu does not fit the %zu byte files\n", p.sizes[i], p.file_size);
+			exit(1);
+		}
+		if (p.sizes[i] > max_size) {
+			max_size = p.sizes[i];
+		}
+	}
+
+	workers = calloc(p.threads, sizeof(struct worker));
+	buf_pool = malloc(p.threads * max_size);
+	for (i = 0; i < p.threads; i++) {
+		workers[i].id = i;
+		workers[i].seed = i + 1;
+		workers[i].buf = buf_pool + (size_t)i * max_size;
+		memset(workers[i].buf, 'a' + i % 26, max_size);
+	}
+	setup();
+
+	//every I/O size writes the files whole before reading them, so reads never hit holes
+	for (i = 0; i < p.nsizes; i++) {
+		ph.io_size = p.sizes[i];
+		if (wanted("seq")) {
+			ph.name = "seq_write"; ph.run = seq_write; run_phase(&ph);
+			ph.name = "seq_read"; ph.run = seq_read; run_phase(&ph);
+		}
+		if (wanted("rand")) {
+			if (!wanted("seq")) {
+				ph.name = "seq_write"; ph.run = seq_write; run_phase(&ph);
+			}
+			ph.name = "rand_write"; ph.run = rand_write; run_phase(&ph);
+			ph.name = "rand_read"; ph.run = rand_read; run_phase(&ph);
+		}
+	}
+	ph.io_size = 0;
+	if (wanted("meta")) {
+		ph.name = "meta_create"; ph.run = meta_create; run_phase(&ph);
+		ph.name = "meta_stat"; ph.run = meta_stat; run_phase(&ph);
+		ph.name = "meta_unlink"; ph.run = meta_unlink; run_phase(&ph);
+	}
+	if (wanted("deep")) {
+		deep_make();
+		ph.name = "deep_lookup"; ph.run = deep_lookup; run_phase(&ph);
+		deep_remove();
+	}
+	if (wanted("bigdir")) {
+		char path[FSPATHLEN];
+		snprintf(path, FSPATHLEN, "%s/big", root);
+		make_dir(path);
+		ph.name = "bigdir_create"; ph.run = bigdir_create; run_phase(&ph);
+		ph.name = "bigdir_stat"; ph.run = bigdir_stat; run_phase(&ph);
+		ph.name = "bigdir_readdir"; ph.run = bigdir_list; run_phase(&ph);
+		ph.name = "bigdir_unlink"; ph.run = bigdir_unlink; run_phase(&ph);
+		rmdir(path);
+	}
+	teardown();
+
+	for (i = 0; i < nresults; i++) {
+		errors += results[i].errors;
+	}
+	FILE *f = out != NULL ? fopen(out, "w") : stdout;
+	if (f == NULL) {
+		die(out);
+	}
+	print_json(f);
+	if (f != stdout) {
+		fclose(f);
+	}
+	return errors ? 2 : 0;
+}
@@ -14,53 +14,171 @@
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <sys/syscall.h>
+#include <errno.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <linux/io_uring.h>
+//linux/fs.h, pulled in by io_uring.h, has a BLOCK_SIZE of its own
+#undef BLOCK_SIZE
 
 #include "block.h"
+#include "backend.h"
+#include "stats.h"
 
-//Disk size set to 32MB
-#define DISK_SIZE	32*1024*1024
+static const struct bio_backend *backend = NULL;
+static int dev_opened = 0;
 
-int diskfile = -1;
+/*
+ * Write-back block cache
+ *
+ * bio_read/bio_write go through a fixed set of frames sized by the budget
+ * given to bio_cache_init(). Frames are found through a hash table on the
+ * block number and replaced with the CLOCK algorithm; dirty frames are only
+ * written to the disk file on eviction or bio_flush().
+ *
+ * A miss reads the disk file without holding cache_lock: the frame is
+ * marked loading meanwhile, which keeps it from being replaced, and anyone
+ * else wanting that block waits on frame_loaded.
+ */
+struct cache_frame {
+	int					block;			/* cached block number, -1 if unused */
+	int					dirty;			/* frame differs from the disk file */
+	int					referenced;		/* CLOCK reference bit */
+	int					loading;		/* being read from the disk file, contents not valid yet */
+	struct cache_frame	*hash_next;		/* next frame in the same hash bucket */
+	char				*data;
+};
+
+static struct cache_frame *frames = NULL;
+static struct cache_frame **hash_table = NULL;
+static char *frame_data = NULL;
+static int nframes = 0;
+static int hash_mask = 0;
+static int clock_hand = 0;
+static struct bio_cache_stats stats;
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t frame_loaded = PTHREAD_COND_INITIALIZER;
+
+/*
+ * Mapped mode: after bio_map() the whole disk is reached through memory,
+ * mapped shared for the file backend, and block reads and writes are
+ * memcpy()s into the mapping rather than a pread/pwrite each, with the
+ * page cache doing the caching. Callers can also get a block's address
+ * with bio_block_addr() and keep metadata in place there; "reading" or
+ * "writing" such a block to its own address costs nothing. bio_flush()
+ * hands the mapping to msync(). Backends that model a device's delays
+ * can not be mapped.
+ */
+static char *disk_map = NULL;
+static size_t disk_map_size = 0;
+
+static void ra_stop();
+static void uring_stop();
+
+//Keep the disk on the backend spec names (see backend.c) from the next dev_init/dev_open on, 0 on success
+int dev_backend(const char* spec) {
+	const struct bio_backend *be = backend_get(spec);
+	if (be == NULL || dev_opened) {
+		return -1;
+	}
+	backend = be;
+	return 0;
+}
+
+static const struct bio_backend *dev_get_backend() {
+	if (backend == NULL) {
+		backend = backend_get(NULL);
+	}
+	return backend;
+}
 
-//Creates a file which is your new emulated disk
-void dev_init(const char* diskfile_path) {
-    if (diskfile >= 0) {
+//Creates a file of size bytes which is your new emulated disk
+void dev_init(const char* diskfile_path, size_t size) {
+    if (dev_opened) {
 		return;
     }
     
-    diskfile = open(diskfile_path, O_CREAT | O_RDWR, S_IRUSR | S_IWUSR);
-    if (diskfile < 0) {
-		perror("disk_open failed");
+    if (dev_get_backend()->create(diskfile_path, size) < 0) {
 		exit(EXIT_FAILURE);
     }
-	
-    ftruncate(diskfile, DISK_SIZE);
+    dev_opened = 1;
 }
 
 //Function to open the disk file
 int dev_open(const char* diskfile_path) {
-    if (diskfile >= 0) {
+    if (dev_opened) {
 		return 0;
     }
     
-    diskfile = open(diskfile_path, O_RDWR, S_IRUSR | S_IWUSR);
-    if (diskfile < 0) {
-		perror("disk_open failed");
+    if (dev_get_backend()->open(diskfile_path) < 0) {
 		return -1;
     }
+    dev_opened = 1;
 	return 0;
 }
 
 void dev_close() {
-    if (diskfile >= 0) {
-		close(diskfile);
+	ra_stop();
+	uring_stop();
+    if (dev_opened) {
+		bio_flush();
+		//the backend unmaps it
+		disk_map = NULL;
+		disk_map_size = 0;
+		backend->close();
+		dev_opened = 0;
     }
+	free(frames);
+	free(hash_table);
+	free(frame_data);
+	frames = NULL;
+	hash_table = NULL;
+	frame_data = NULL;
+	nframes = 0;
+}
+
+//Map the open disk so blocks are reached through memory, 0 on success
+int bio_map() {
+	if (disk_map != NULL) {
+		return 0;
+	}
+	if (!dev_opened || (disk_map = backend->map(&disk_map_size)) == NULL) {
+		return -1;
+	}
+	return 0;
+}
+
+//Address of a block in the mapping, NULL if the disk file is not mapped
+void *bio_block_addr(const int block_num) {
+	if (disk_map == NULL || block_num < 0 || (size_t)(block_num + 1) * BLOCK_SIZE > disk_map_size) {
+		return NULL;
+	}
+	return disk_map + (size_t)block_num * BLOCK_SIZE;
+}
+
+//Address of count blocks in the mapping, NULL if they are not all mapped
+static char *map_range(const int block_num, const int count) {
+	if (bio_block_addr(block_num) == NULL || bio_block_addr(block_num + count - 1) == NULL) {
+		return NULL;
+	}
+	return disk_map + (size_t)block_num * BLOCK_SIZE;
 }
 
 //Read a block from the disk
-int bio_read(const int block_num, void *buf) {
+static int disk_read(const int block_num, void *buf) {
     int retstat = 0;
-    retstat = pread(diskfile, buf, BLOCK_SIZE, block_num*BLOCK_SIZE);
+    char *addr = bio_block_addr(block_num);
+    if (addr != NULL) {
+		if (addr != buf) {
+			memcpy(buf, addr, BLOCK_SIZE);
+		}
+		return BLOCK_SIZE;
+    }
+    struct iovec iov = { .iov_base = buf, .iov_len = BLOCK_SIZE };
+    retstat = backend->read(&iov, 1, (off_t)block_num*BLOCK_SIZE);
     if (retstat <= 0) {
 		memset (buf, 0, BLOCK_SIZE);
 		if (retstat < 0)
@@ -71,12 +189,999 @@ int bio_read(const int block_num, void *buf) {
 }
 
 //Write a block to the disk
-int bio_write(const int block_num, const void *buf) {
+static int disk_write(const int block_num, const void *buf) {
     int retstat = 0;
-    retstat = pwrite(diskfile, buf, BLOCK_SIZE, block_num*BLOCK_SIZE);
+    char *addr = bio_block_addr(block_num);
+    if (addr != NULL) {
+		if (addr != buf) {
+			memcpy(addr, buf, BLOCK_SIZE);
+		}
+		return BLOCK_SIZE;
+    }
+    struct iovec iov = { .iov_base = (void *)buf, .iov_len = BLOCK_SIZE };
+    retstat = backend->write(&iov, 1, (off_t)block_num*BLOCK_SIZE);
     if (retstat < 0) {
 		    perror("block_write failed");
     }
     return retstat;
 }
 
+
+//Set up the block cache with room for budget bytes of blocks, 0 disables it
+void bio_cache_init(size_t budget) {
+	int i;
+
+	pthread_mutex_lock(&cache_lock);
+	if (frames != NULL || budget < BLOCK_SIZE) {
+		pthread_mutex_unlock(&cache_lock);
+		return;
+	}
+
+	nframes = budget / BLOCK_SIZE;
+	int buckets = 1;
+	while (buckets < nframes) {
+		buckets <<= 1;
+	}
+	hash_mask = buckets - 1;
+
+	frames = calloc(nframes, sizeof(struct cache_frame));
+	hash_table = calloc(buckets, sizeof(struct cache_frame *));
+	frame_data = malloc((size_t)nframes * BLOCK_SIZE);
+	if (frames == NULL || hash_table == NULL || frame_data == NULL) {
+		perror("block cache allocation failed");
+		free(frames);
+		free(hash_table);
+		free(frame_data);
+		frames = NULL;
+		hash_table = NULL;
+		frame_data = NULL;
+		nframes = 0;
+		pthread_mutex_unlock(&cache_lock);
+		return;
+	}
+	for (i = 0; i < nframes; i++) {
+		frames[i].block = -1;
+		frames[i].data = frame_data + (size_t)i * BLOCK_SIZE;
+	}
+	clock_hand = 0;
+	memset(&stats, 0, sizeof(stats));
+	stats.nframes = nframes;
+	pthread_mutex_unlock(&cache_lock);
+}
+
+static struct cache_frame *cache_lookup(int block_num) {
+	struct cache_frame *frame = hash_table[block_num & hash_mask];
+	while (frame != NULL && frame->block != block_num) {
+		frame = frame->hash_next;
+	}
+	return frame;
+}
+
+//Look up block_num, waiting out a read of it in progress, with cache_lock held
+static struct cache_frame *cache_lookup_loaded(int block_num) {
+	struct cache_frame *frame;
+	while ((frame = cache_lookup(block_num)) != NULL && frame->loading) {
+		pthread_cond_wait(&frame_loaded, &cache_lock);
+	}
+	return frame;
+}
+
+static void cache_unhash(struct cache_frame *frame) {
+	struct cache_frame **link = &hash_table[frame->block & hash_mask];
+	while (*link != frame) {
+		link = &(*link)->hash_next;
+	}
+	*link = frame->hash_next;
+	frame->hash_next = NULL;
+}
+
+//Pick a frame for block_num with CLOCK, writing back the old contents if dirty
+static struct cache_frame *cache_replace(int block_num) {
+	struct cache_frame *frame;
+	int scanned = 0;
+	for (;;) {
+		frame = &frames[clock_hand];
+		clock_hand = (clock_hand + 1) % nframes;
+		if (frame->block == -1) {
+			break;
+		}
+		if (frame->loading) {
+			//every frame busy loading, wait for one to finish
+			if (++scanned > 2 * nframes) {
+				pthread_cond_wait(&frame_loaded, &cache_lock);
+				scanned = 0;
+			}
+			continue;
+		}
+		if (frame->referenced) {
+			frame->referenced = 0;
+			continue;
+		}
+		if (frame->dirty) {
+			disk_write(frame->block, frame->data);
+			frame->dirty = 0;
+			stats.writebacks++;
+			stats.ndirty--;
+		}
+		cache_unhash(frame);
+		stats.evictions++;
+		break;
+	}
+
+	frame->block = block_num;
+	frame->referenced = 1;
+	frame->hash_next = hash_table[block_num & hash_mask];
+	hash_table[block_num & hash_mask] = frame;
+	return frame;
+}
+
+//Read a block through the cache
+static int cache_read(const int block_num, void *buf) {
+	if (nframes == 0) {
+		return disk_read(block_num, buf);
+	}
+
+	pthread_mutex_lock(&cache_lock);
+	struct cache_frame *frame = cache_lookup_loaded(block_num);
+	if (frame != NULL) {
+		stats.hits++;
+	} else {
+		stats.misses++;
+		frame = cache_replace(block_num);
+		frame->loading = 1;
+		pthread_mutex_unlock(&cache_lock);
+		int retstat = disk_read(block_num, frame->data);
+		pthread_mutex_lock(&cache_lock);
+		frame->loading = 0;
+		pthread_cond_broadcast(&frame_loaded);
+		if (retstat < 0) {
+			cache_unhash(frame);
+			frame->block = -1;
+			memset(buf, 0, BLOCK_SIZE);
+			pthread_mutex_unlock(&cache_lock);
+			return -1;
+		}
+	}
+	frame->referenced = 1;
+	memcpy(buf, frame->data, BLOCK_SIZE);
+	pthread_mutex_unlock(&cache_lock);
+	return BLOCK_SIZE;
+}
+
+//Write a block into the cache, it reaches the disk on eviction or bio_flush()
+static int cache_write(const int block_num, const void *buf) {
+	if (nframes == 0) {
+		return disk_write(block_num, buf);
+	}
+
+	pthread_mutex_lock(&cache_lock);
+	struct cache_frame *frame = cache_lookup_loaded(block_num);
+	if (frame == NULL) {
+		frame = cache_replace(block_num);
+	}
+	memcpy(frame->data, buf, BLOCK_SIZE);
+	frame->referenced = 1;
+	if (!frame->dirty) {
+		frame->dirty = 1;
+		stats.ndirty++;
+	}
+	pthread_mutex_unlock(&cache_lock);
+	return BLOCK_SIZE;
+}
+
+int bio_read(const int block_num, void *buf) {
+	uint64_t start = stats_now();
+	int retstat = cache_read(block_num, buf);
+	stats_op_done(STATS_BIO_READ, start, retstat < 0, BLOCK_SIZE);
+	return retstat;
+}
+
+int bio_write(const int block_num, const void *buf) {
+	uint64_t start = stats_now();
+	int retstat = cache_write(block_num, buf);
+	stats_op_done(STATS_BIO_WRITE, start, retstat < 0, BLOCK_SIZE);
+	return retstat;
+}
+
+/*
+ * Range I/O moves count consecutive blocks with a single transfer,
+ * bypassing the frames. A request's buffer is either one piece of memory
+ * or, for vectored requests, an iovec per block, so blocks adjacent on
+ * disk go together whatever memory they come from or go to.
+ *
+ * Reads take any cached block from its frame, which is never older than
+ * the disk file; the disk read itself happens without cache_lock, and is
+ * redone under it if a frame was written back meanwhile (it may have been
+ * one of ours, evicted after the read and before the frames were checked).
+ * Writes give cached frames the new data up front, dirty so that evicting
+ * one still writes the new data, and mark them clean once the write is
+ * done.
+ */
+static char *req_block(const struct bio_req *req, int i) {
+	if (req->iov != NULL) {
+		return req->iov[i].iov_base;
+	}
+	return (char *)req->buf + (size_t)i * BLOCK_SIZE;
+}
+
+//Zero a read request's blocks from byte off on, past what the disk file gave
+static void req_zero_from(struct bio_req *req, size_t off) {
+	int i;
+	for (i = off / BLOCK_SIZE; i < req->count; i++) {
+		size_t skip = (size_t)i * BLOCK_SIZE < off ? off - (size_t)i * BLOCK_SIZE : 0;
+		memset(req_block(req, i) + skip, 0, BLOCK_SIZE - skip);
+	}
+}
+
+//Move a request's blocks to or from the disk file, zero-filling what a read came up short on
+static ssize_t req_io(struct bio_req *req) {
+	int i;
+	size_t len = (size_t)req->count * BLOCK_SIZE;
+	off_t off = (off_t)req->block * BLOCK_SIZE;
+	ssize_t retstat;
+	struct iovec whole = { .iov_base = req->buf, .iov_len = len };
+	const struct iovec *iov = req->iov != NULL ? req->iov : &whole;
+	int iovcnt = req->iov != NULL ? req->count : 1;
+
+	char *addr = map_range(req->block, req->count);
+	if (addr != NULL) {
+		for (i = 0; i < req->count; i++) {
+			char *block = addr + (size_t)i * BLOCK_SIZE;
+			if (req->write) {
+				memcpy(block, req_block(req, i), BLOCK_SIZE);
+			} else {
+				memcpy(req_block(req, i), block, BLOCK_SIZE);
+			}
+		}
+		return len;
+	}
+
+	if (req->write) {
+		retstat = backend->write(iov, iovcnt, off);
+		if (retstat < 0) {
+			perror("block_write failed");
+		}
+		return retstat;
+	}
+	retstat = backend->read(iov, iovcnt, off);
+	if (retstat < 0) {
+		perror("block_read failed");
+	}
+	req_zero_from(req, retstat < 0 ? 0 : retstat);
+	return retstat;
+}
+
+//Wait until no frame in the request's range is mid-load, with cache_lock held
+static void req_wait_loaded(const struct bio_req *req) {
+	int i;
+	if (nframes == 0) {
+		return;
+	}
+	for (i = 0; i < req->count; i++) {
+		struct cache_frame *frame = cache_lookup(req->block + i);
+		if (frame != NULL && frame->loading) {
+			pthread_cond_wait(&frame_loaded, &cache_lock);
+			i = -1;
+		}
+	}
+}
+
+//Copy cached blocks of a read over what came from disk, with cache_lock held
+static void req_overlay(const struct bio_req *req) {
+	int i;
+	if (nframes == 0) {
+		return;
+	}
+	for (i = 0; i < req->count; i++) {
+		struct cache_frame *frame = cache_lookup(req->block + i);
+		//a frame still loading holds what is on disk, which the read already has
+		if (frame != NULL && !frame->loading) {
+			memcpy(req_block(req, i), frame->data, BLOCK_SIZE);
+			stats.hits++;
+		}
+	}
+}
+
+//Give cached frames the data a write carries, marking them clean or dirty, with cache_lock held
+static void req_refresh(const struct bio_req *req, int dirty) {
+	int i;
+	if (nframes == 0) {
+		return;
+	}
+	for (i = 0; i < req->count; i++) {
+		struct cache_frame *frame = cache_lookup(req->block + i);
+		if (frame == NULL) {
+			continue;
+		}
+		memcpy(frame->data, req_block(req, i), BLOCK_SIZE);
+		if (frame->dirty != dirty) {
+			frame->dirty = dirty;
+			stats.ndirty += dirty ? 1 : -1;
+		}
+	}
+}
+
+//Start a request's cache bookkeeping, with cache_lock held
+static void req_start(struct bio_req *req) {
+	req->done = 0;
+	req->result = 0;
+	req->writebacks = stats.writebacks;
+	if (req->write) {
+		req_wait_loaded(req);
+		req_refresh(req, 1);
+	}
+}
+
+//Finish a request given what its transfer returned, with cache_lock held
+static void req_finish(struct bio_req *req, ssize_t res) {
+	size_t len = (size_t)req->count * BLOCK_SIZE;
+
+	if (res == -EINVAL || res == -EOPNOTSUPP) {
+		//a ring on a kernel without this opcode: do it the old way
+		res = req_io(req);
+	}
+	if (req->write) {
+		if (res >= 0 && (size_t)res < len) {
+			res = req_io(req);
+		}
+		if (res >= 0) {
+			req_refresh(req, 0);
+		}
+	} else {
+		if (res >= 0 && (size_t)res < len) {
+			//past the end of the disk file, or a short read from the ring
+			res = req_io(req);
+		}
+		if (res >= 0 && stats.writebacks != req->writebacks) {
+			res = req_io(req);
+		}
+		if (res < 0) {
+			req_zero_from(req, 0);
+		}
+		req_overlay(req);
+	}
+	req->result = res < 0 ? -1 : (int)len;
+	req->done = 1;
+}
+
+//Do a request synchronously
+static int req_sync(struct bio_req *req) {
+	if (nframes == 0) {
+		req->writebacks = 0;
+		req_finish(req, req_io(req));
+		return req->result;
+	}
+	pthread_mutex_lock(&cache_lock);
+	req_start(req);
+	if (req->write) {
+		//held across the write so no stale frame can be written back over it
+		req_finish(req, req_io(req));
+	} else {
+		pthread_mutex_unlock(&cache_lock);
+		ssize_t res = req_io(req);
+		pthread_mutex_lock(&cache_lock);
+		req_finish(req, res);
+	}
+	pthread_mutex_unlock(&cache_lock);
+	return req->result;
+}
+
+int bio_read_range(const int block_num, const int count, void *buf) {
+	struct bio_req req = { .block = block_num, .count = count, .buf = buf };
+	return req_sync(&req);
+}
+
+int bio_write_range(const int block_num, const int count, const void *buf) {
+	struct bio_req req = { .block = block_num, .count = count, .buf = (void *)buf, .write = 1 };
+	return req_sync(&req);
+}
+
+/*
+ * Asynchronous I/O. bio_submit() starts a batch of range transfers and
+ * bio_wait() waits for them, so a caller can have many of them in flight
+ * at once. With bio_uring_init() called, each thread queues its requests
+ * on an io_uring of its own, set up on first use with raw syscalls, and a
+ * batch costs one io_uring_enter to submit and one to reap; otherwise (or
+ * when the disk file is mapped) bio_submit() just does the transfers.
+ * Requests must be waited for by the thread that submitted them.
+ */
+#define URING_ENTRIES_MAX	4096
+
+struct uring {
+	int						fd;
+	unsigned				entries;		/* SQ size, and most requests in flight */
+	unsigned				queued;			/* in the SQ, not yet submitted */
+	unsigned				inflight;		/* submitted, not yet reaped */
+	unsigned				*sq_head, *sq_tail, *sq_mask, *sq_array;
+	unsigned				*cq_head, *cq_tail, *cq_mask;
+	struct io_uring_sqe		*sqes;
+	struct io_uring_cqe		*cqes;
+	void					*sq_ring, *cq_ring;
+	size_t					sq_ring_size, cq_ring_size;
+};
+
+static unsigned uring_entries = 0;			/* 0 until bio_uring_init() succeeds */
+static pthread_key_t uring_key;
+static pthread_once_t uring_key_once = PTHREAD_ONCE_INIT;
+
+static int sys_io_uring_setup(unsigned entries, struct io_uring_params *p) {
+	return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags) {
+	return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static void uring_destroy(void *arg) {
+	struct uring *ring = arg;
+	munmap(ring->sqes, ring->entries * sizeof(struct io_uring_sqe));
+	if (ring->cq_ring != ring->sq_ring) {
+		munmap(ring->cq_ring, ring->cq_ring_size);
+	}
+	munmap(ring->sq_ring, ring->sq_ring_size);
+	close(ring->fd);
+	free(ring);
+}
+
+static void uring_key_init() {
+	pthread_key_create(&uring_key, uring_destroy);
+}
+
+static struct uring *uring_create(unsigned entries) {
+	struct io_uring_params p;
+	struct uring *ring = calloc(1, sizeof(struct uring));
+	if (ring == NULL) {
+		return NULL;
+	}
+
+	memset(&p, 0, sizeof(p));
+	ring->fd = sys_io_uring_setup(entries, &p);
+	if (ring->fd < 0) {
+		free(ring);
+		return NULL;
+	}
+	ring->entries = p.sq_entries;
+	ring->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	ring->cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (ring->cq_ring_size > ring->sq_ring_size) {
+			ring->sq_ring_size = ring->cq_ring_size;
+		}
+		ring->cq_ring_size = ring->sq_ring_size;
+	}
+
+	ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+	if (ring->sq_ring == MAP_FAILED) {
+		close(ring->fd);
+		free(ring);
+		return NULL;
+	}
+	ring->cq_ring = ring->sq_ring;
+	if (!(p.features & IORING_FEAT_SINGLE_MMAP)) {
+		ring->cq_ring = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+	}
+	ring->sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+	if (ring->cq_ring == MAP_FAILED || ring->sqes == MAP_FAILED) {
+		if (ring->cq_ring != MAP_FAILED && ring->cq_ring != ring->sq_ring) {
+			munmap(ring->cq_ring, ring->cq_ring_size);
+		}
+		munmap(ring->sq_ring, ring->sq_ring_size);
+		close(ring->fd);
+		free(ring);
+		return NULL;
+	}
+
+	char *sq = ring->sq_ring, *cq = ring->cq_ring;
+	ring->sq_head = (unsigned *)(sq + p.sq_off.head);
+	ring->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+	ring->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+	ring->sq_array = (unsigned *)(sq + p.sq_off.array);
+	ring->cq_head = (unsigned *)(cq + p.cq_off.head);
+	ring->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+	ring->cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+	ring->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+	return ring;
+}
+
+//Ring of the calling thread, NULL if requests are to be done synchronously
+static struct uring *uring_get() {
+	if (uring_entries == 0 || disk_map != NULL || bio_fd() < 0) {
+		return NULL;
+	}
+	struct uring *ring = pthread_getspecific(uring_key);
+	if (ring == NULL) {
+		ring = uring_create(uring_entries);
+		pthread_setspecific(uring_key, ring);
+	}
+	return ring;
+}
+
+//Use io_uring with up to entries requests in flight per thread, 0 on success
+int bio_uring_init(int entries) {
+	if (entries <= 0 || entries > URING_ENTRIES_MAX) {
+		return -1;
+	}
+	pthread_once(&uring_key_once, uring_key_init);
+	//find out now whether the kernel has io_uring, rather than on first use
+	struct uring *ring = uring_create(entries);
+	if (ring == NULL) {
+		perror("io_uring_setup failed");
+		return -1;
+	}
+	uring_destroy(ring);
+	uring_entries = entries;
+	return 0;
+}
+
+//Go back to synchronous I/O, closing the calling thread's ring; other threads close theirs as they exit
+static void uring_stop() {
+	if (uring_entries == 0) {
+		return;
+	}
+	struct uring *ring = pthread_getspecific(uring_key);
+	if (ring != NULL) {
+		uring_destroy(ring);
+		pthread_setspecific(uring_key, NULL);
+	}
+	uring_entries = 0;
+}
+
+//Hand the queued requests to the kernel, waiting for at least min_complete completions
+static int uring_enter(struct uring *ring, unsigned min_complete) {
+	int ret;
+	do {
+		ret = sys_io_uring_enter(ring->fd, ring->queued, min_complete, min_complete ? IORING_ENTER_GETEVENTS : 0);
+	} while (ret < 0 && errno == EINTR);
+	if (ret < 0) {
+		perror("io_uring_enter failed");
+		return -1;
+	}
+	ring->queued -= ret;
+	ring->inflight += ret;
+	return 0;
+}
+
+//Finish every request the kernel has completed
+static void uring_reap(struct uring *ring) {
+	unsigned head = *ring->cq_head;
+	unsigned tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+	if (head == tail) {
+		return;
+	}
+	pthread_mutex_lock(&cache_lock);
+	for (; head != tail; head++) {
+		struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+		req_finish((struct bio_req *)(uintptr_t)cqe->user_data, cqe->res);
+		ring->inflight--;
+	}
+	pthread_mutex_unlock(&cache_lock);
+	__atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+}
+
+static void uring_queue(struct uring *ring, struct bio_req *req) {
+	//the CQ has room for every request the SQ lets in, so wait once that many are out
+	while (ring->queued + ring->inflight >= ring->entries) {
+		if (uring_enter(ring, 1) < 0) {
+			break;
+		}
+		uring_reap(ring);
+	}
+
+	unsigned tail = *ring->sq_tail;
+	unsigned index = tail & *ring->sq_mask;
+	struct io_uring_sqe *sqe = &ring->sqes[index];
+	memset(sqe, 0, sizeof(struct io_uring_sqe));
+	sqe->fd = backend->fd();
+	if (req->iov != NULL) {
+		sqe->opcode = req->write ? IORING_OP_WRITEV : IORING_OP_READV;
+		sqe->addr = (uintptr_t)req->iov;
+		sqe->len = req->count;
+	} else {
+		sqe->opcode = req->write ? IORING_OP_WRITE : IORING_OP_READ;
+		sqe->addr = (uintptr_t)req->buf;
+		sqe->len = req->count * BLOCK_SIZE;
+	}
+	sqe->off = (off_t)req->block * BLOCK_SIZE;
+	sqe->user_data = (uintptr_t)req;
+	ring->sq_array[index] = index;
+	__atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+	ring->queued++;
+}
+
+//Start n transfers; their buffers must stay put until bio_wait() returns
+int bio_submit(struct bio_req *reqs, const int n) {
+	int i;
+	struct uring *ring = uring_get();
+
+	for (i = 0; i < n; i++) {
+		if (ring == NULL) {
+			req_sync(&reqs[i]);
+			continue;
+		}
+		pthread_mutex_lock(&cache_lock);
+		req_start(&reqs[i]);
+		pthread_mutex_unlock(&cache_lock);
+		uring_queue(ring, &reqs[i]);
+	}
+	if (ring != NULL && ring->queued > 0) {
+		uring_enter(ring, 0);
+	}
+	return 0;
+}
+
+//Wait for n transfers started by bio_submit(), 0 if they all succeeded
+int bio_wait(struct bio_req *reqs, const int n) {
+	int i;
+	int retstat = 0;
+	struct uring *ring = uring_get();
+
+	for (i = 0; i < n; i++) {
+		while (!reqs[i].done) {
+			if (ring == NULL || uring_enter(ring, 1) < 0) {
+				//the ring has failed us; give up on the request
+				pthread_mutex_lock(&cache_lock);
+				req_finish(&reqs[i], -EIO);
+				pthread_mutex_unlock(&cache_lock);
+				break;
+			}
+			uring_reap(ring);
+		}
+		if (reqs[i].result < 0) {
+			retstat = -1;
+		}
+	}
+	return retstat;
+}
+
+/*
+ * Vectored I/O over a list of blocks, each with a buffer of its own.
+ * Entries next to each other in the list that are next to each other on
+ * disk are merged into one request, so a run costs one preadv/pwritev (or
+ * one ring entry) however its buffers are scattered.
+ */
+#define VEC_RUN_MAX	1024			/* iovecs per preadv/pwritev, Linux's IOV_MAX */
+
+static int vec_transfer(const struct bio_vec *vec, const int n, int write) {
+	int i;
+	int nreqs = 0;
+	int retstat = 0;
+
+	if (n <= 0) {
+		return 0;
+	}
+	struct bio_req *reqs = malloc(n * sizeof(struct bio_req));
+	struct iovec *iov = malloc(n * sizeof(struct iovec));
+	if (reqs == NULL || iov == NULL) {
+		free(reqs);
+		free(iov);
+		return -1;
+	}
+	//blocks already cached, which is where readahead leaves them, are read from their frames
+	char *cached = calloc(n, 1);
+	if (!write && nframes > 0 && cached != NULL) {
+		pthread_mutex_lock(&cache_lock);
+		for (i = 0; i < n; i++) {
+			struct cache_frame *frame = cache_lookup_loaded(vec[i].block);
+			if (frame != NULL) {
+				memcpy(vec[i].buf, frame->data, BLOCK_SIZE);
+				frame->referenced = 1;
+				stats.hits++;
+				cached[i] = 1;
+			}
+		}
+		pthread_mutex_unlock(&cache_lock);
+	}
+
+	int niov = 0;
+	for (i = 0; i < n; i++) {
+		if (cached != NULL && cached[i]) {
+			continue;
+		}
+		iov[niov].iov_base = vec[i].buf;
+		iov[niov].iov_len = BLOCK_SIZE;
+		niov++;
+		struct bio_req *last = nreqs > 0 ? &reqs[nreqs - 1] : NULL;
+		if (last != NULL && last->block + last->count == vec[i].block && last->count < VEC_RUN_MAX) {
+			last->count++;
+			continue;
+		}
+		memset(&reqs[nreqs], 0, sizeof(struct bio_req));
+		reqs[nreqs].block = vec[i].block;
+		reqs[nreqs].count = 1;
+		reqs[nreqs].iov = &iov[niov - 1];
+		reqs[nreqs].write = write;
+		nreqs++;
+	}
+	free(cached);
+	bio_submit(reqs, nreqs);
+	retstat = bio_wait(reqs, nreqs);
+	free(reqs);
+	free(iov);
+	return retstat;
+}
+
+int bio_readv(const struct bio_vec *vec, const int n) {
+	return vec_transfer(vec, n, 0);
+}
+
+int bio_writev(const struct bio_vec *vec, const int n) {
+	return vec_transfer(vec, n, 1);
+}
+
+/*
+ * Readahead. bio_readahead() only queues the blocks: a background thread
+ * loads each queued range into cache frames with one preadv, so the
+ * reader that asked is never held up, and a later bio_read/bio_readv of
+ * those blocks is served from the frames (or waits for the load already
+ * under way). Frames loaded ahead start unreferenced, so CLOCK takes them
+ * back first if they go unused. A full queue drops the request; it was
+ * only a hint. Without a cache, or for readers that hand the disk file
+ * itself to libfuse, the kernel is asked to read ahead the disk file
+ * instead.
+ */
+#define RA_QUEUE	64
+
+struct ra_range {
+	int		block;
+	int		count;
+};
+
+static struct ra_range ra_queue[RA_QUEUE];
+static int ra_head = 0;
+static int ra_count = 0;
+static int ra_running = 0;
+static pthread_t ra_thread;
+static pthread_mutex_t ra_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t ra_wakeup = PTHREAD_COND_INITIALIZER;
+
+//Load count blocks from block_num on into cache frames, skipping those already there
+static void cache_prefetch(const int block_num, int count) {
+	int i, n = 0;
+
+	//never let readahead take over more than a quarter of the cache
+	if (count > nframes / 4) {
+		count = nframes / 4;
+	}
+	if (count <= 0) {
+		return;
+	}
+	struct cache_frame **loads = malloc(count * sizeof(struct cache_frame *));
+	struct iovec *iov = malloc(count * sizeof(struct iovec));
+	if (loads == NULL || iov == NULL) {
+		free(loads);
+		free(iov);
+		return;
+	}
+
+	pthread_mutex_lock(&cache_lock);
+	for (i = 0; i < count; i++) {
+		if (cache_lookup(block_num + i) != NULL) {
+			continue;
+		}
+		struct cache_frame *frame = cache_replace(block_num + i);
+		frame->loading = 1;
+		frame->referenced = 0;
+		loads[n] = frame;
+		iov[n].iov_base = frame->data;
+		iov[n].iov_len = BLOCK_SIZE;
+		n++;
+	}
+	pthread_mutex_unlock(&cache_lock);
+
+	//one preadv per run of consecutive blocks
+	int start = 0;
+	int failed = 0;
+	for (i = 1; i <= n; i++) {
+		if (i < n && loads[i]->block == loads[i - 1]->block + 1) {
+			continue;
+		}
+		size_t len = (size_t)(i - start) * BLOCK_SIZE;
+		ssize_t res = backend->read(&iov[start], i - start, (off_t)loads[start]->block * BLOCK_SIZE);
+		if (res < 0) {
+			failed = 1;
+		} else if ((size_t)res < len) {
+			struct bio_req req = { .block = loads[start]->block, .count = i - start, .iov = &iov[start] };
+			req_zero_from(&req, res);
+		}
+		start = i;
+	}
+
+	pthread_mutex_lock(&cache_lock);
+	for (i = 0; i < n; i++) {
+		loads[i]->loading = 0;
+		if (failed) {
+			cache_unhash(loads[i]);
+			loads[i]->block = -1;
+		}
+	}
+	stats.readaheads += failed ? 0 : n;
+	pthread_cond_broadcast(&frame_loaded);
+	pthread_mutex_unlock(&cache_lock);
+	free(loads);
+	free(iov);
+}
+
+static void *ra_worker(void *arg) {
+	pthread_mutex_lock(&ra_lock);
+	for (;;) {
+		while (ra_count == 0 && ra_running) {
+			pthread_cond_wait(&ra_wakeup, &ra_lock);
+		}
+		if (!ra_running) {
+			break;
+		}
+		struct ra_range range = ra_queue[ra_head];
+		ra_head = (ra_head + 1) % RA_QUEUE;
+		ra_count--;
+		pthread_mutex_unlock(&ra_lock);
+		cache_prefetch(range.block, range.count);
+		pthread_mutex_lock(&ra_lock);
+	}
+	pthread_mutex_unlock(&ra_lock);
+	return NULL;
+}
+
+//Stop the readahead thread, dropping whatever is still queued
+static void ra_stop() {
+	pthread_mutex_lock(&ra_lock);
+	if (!ra_running) {
+		pthread_mutex_unlock(&ra_lock);
+		return;
+	}
+	ra_running = 0;
+	ra_count = 0;
+	pthread_cond_signal(&ra_wakeup);
+	pthread_mutex_unlock(&ra_lock);
+	pthread_join(ra_thread, NULL);
+}
+
+//Start reading count blocks from block_num on in the background, into the cache if to_cache
+void bio_readahead(const int block_num, const int count, int to_cache) {
+	off_t off = (off_t)block_num * BLOCK_SIZE;
+	size_t len = (size_t)count * BLOCK_SIZE;
+
+	if (count <= 0 || !dev_opened) {
+		return;
+	}
+	char *addr = map_range(block_num, count);
+	if (addr != NULL) {
+		madvise(addr, len, MADV_WILLNEED);
+		return;
+	}
+	if (!to_cache || nframes == 0) {
+		if (bio_fd() >= 0) {
+			posix_fadvise(bio_fd(), off, len, POSIX_FADV_WILLNEED);
+		}
+		return;
+	}
+
+	pthread_mutex_lock(&ra_lock);
+	if (!ra_running) {
+		if (pthread_create(&ra_thread, NULL, ra_worker, NULL) != 0) {
+			pthread_mutex_unlock(&ra_lock);
+			return;
+		}
+		ra_running = 1;
+	}
+	if (ra_count < RA_QUEUE) {
+		ra_queue[(ra_head + ra_count) % RA_QUEUE].block = block_num;
+		ra_queue[(ra_head + ra_count) % RA_QUEUE].count = count;
+		ra_count++;
+		pthread_cond_signal(&ra_wakeup);
+	}
+	pthread_mutex_unlock(&ra_lock);
+}
+
+/*
+ * Zero-copy I/O hands libfuse the disk file descriptor and an offset to
+ * splice from or into, so the block cache is bypassed: before a splice out
+ * of the disk file its dirty frames in the range must be written back, and
+ * before a splice into it any frames in the range are stale and dropped.
+ * Only the file backend has a descriptor to hand out; for the others
+ * bio_fd() is -1.
+ */
+int bio_fd() {
+	return dev_opened ? backend->fd() : -1;
+}
+
+//Write back dirty cached blocks in the range so the disk file is current
+int bio_sync_range(const int block_num, const int count) {
+	int i;
+	int retstat = 0;
+
+	if (nframes == 0) {
+		return 0;
+	}
+	pthread_mutex_lock(&cache_lock);
+	for (i = 0; i < count; i++) {
+		struct cache_frame *frame = cache_lookup(block_num + i);
+		//a frame still loading holds what is on disk already
+		if (frame == NULL || frame->loading || !frame->dirty) {
+			continue;
+		}
+		if (disk_write(frame->block, frame->data) < 0) {
+			retstat = -1;
+			continue;
+		}
+		frame->dirty = 0;
+		stats.writebacks++;
+		stats.ndirty--;
+	}
+	pthread_mutex_unlock(&cache_lock);
+	return retstat;
+}
+
+//Drop cached copies of blocks that are about to be overwritten on the disk file
+void bio_invalidate_range(const int block_num, const int count) {
+	int i;
+
+	if (nframes == 0) {
+		return;
+	}
+	pthread_mutex_lock(&cache_lock);
+	for (i = 0; i < count; i++) {
+		struct cache_frame *frame = cache_lookup_loaded(block_num + i);
+		if (frame == NULL) {
+			continue;
+		}
+		if (frame->dirty) {
+			frame->dirty = 0;
+			stats.ndirty--;
+		}
+		cache_unhash(frame);
+		frame->block = -1;
+		frame->referenced = 0;
+	}
+	pthread_mutex_unlock(&cache_lock);
+}
+
+static int compare_frames(const void *a, const void *b) {
+	return (*(struct cache_frame **)a)->block - (*(struct cache_frame **)b)->block;
+}
+
+//Write every dirty frame back to the disk file, in block order
+static int cache_flush() {
+	int i;
+	int count = 0;
+	int retstat = 0;
+
+	pthread_mutex_lock(&cache_lock);
+	if (stats.ndirty == 0) {
+		pthread_mutex_unlock(&cache_lock);
+		return 0;
+	}
+	struct cache_frame **dirty = malloc(stats.ndirty * sizeof(struct cache_frame *));
+	for (i = 0; i < nframes; i++) {
+		if (frames[i].dirty) {
+			dirty[count++] = &frames[i];
+		}
+	}
+	qsort(dirty, count, sizeof(struct cache_frame *), compare_frames);
+	for (i = 0; i < count; i++) {
+		if (disk_write(dirty[i]->block, dirty[i]->data) < 0) {
+			retstat = -1;
+			continue;
+		}
+		dirty[i]->dirty = 0;
+		stats.writebacks++;
+		stats.ndirty--;
+	}
+	free(dirty);
+	pthread_mutex_unlock(&cache_lock);
+	return retstat;
+}
+
+//Write every dirty block back, and start the mapping on its way to disk
+int bio_flush() {
+	int retstat = cache_flush();
+	if (disk_map != NULL && backend->sync() < 0) {
+		retstat = -1;
+	}
+	return retstat;
+}
+
+void bio_cache_stats(struct bio_cache_stats *out) {
+	pthread_mutex_lock(&cache_lock);
+	memcpy(out, &stats, sizeof(stats));
+	pthread_mutex_unlock(&cache_lock);
+}
@@ -8,12 +8,66 @@
 #ifndef _BLOCK_H_
 #define _BLOCK_H_
 
-#define BLOCK_SIZE 4096
+#include <stddef.h>
+#include <sys/uio.h>
 
-void dev_init(const char* diskfile_path);
+/* bytes per block, chosen when tfs is built (make BLOCK_SIZE=8192) and recorded by mkfs */
+#ifndef TFS_BLOCK_SIZE
+#define TFS_BLOCK_SIZE 4096
+#endif
+#define BLOCK_SIZE TFS_BLOCK_SIZE
+
+/* counters reported by bio_cache_stats() */
+struct bio_cache_stats {
+	unsigned long	hits;				/* lookups served from the cache */
+	unsigned long	misses;				/* lookups that went to the disk file */
+	unsigned long	writebacks;			/* dirty blocks written to the disk file */
+	unsigned long	evictions;			/* blocks dropped to make room */
+	unsigned long	readaheads;			/* blocks loaded by bio_readahead() */
+	int				nframes;			/* number of cache frames */
+	int				ndirty;				/* frames currently dirty */
+};
+
+/* one transfer of consecutive blocks, for bio_submit() and bio_wait() */
+struct bio_req {
+	int				block;				/* first block */
+	int				count;				/* number of blocks */
+	void			*buf;				/* count * BLOCK_SIZE bytes */
+	struct iovec	*iov;				/* or count BLOCK_SIZE pieces, one per block */
+	int				write;				/* write buf out rather than read into it */
+	int				result;				/* bytes moved or -1, once done */
+	int				done;				/* the transfer has finished */
+	unsigned long	writebacks;			/* cache writebacks when it was started */
+};
+
+/* one block of a vectored transfer, for bio_readv() and bio_writev() */
+struct bio_vec {
+	int				block;				/* block number */
+	void			*buf;				/* BLOCK_SIZE bytes */
+};
+
+int dev_backend(const char* spec);
+void dev_init(const char* diskfile_path, size_t size);
 int dev_open(const char* diskfile_path);
 void dev_close();
+int bio_map();
+void *bio_block_addr(const int block_num);
 int bio_read(const int block_num, void *buf);
 int bio_write(const int block_num, const void *buf);
+int bio_read_range(const int block_num, const int count, void *buf);
+int bio_write_range(const int block_num, const int count, const void *buf);
+int bio_readv(const struct bio_vec *vec, const int n);
+int bio_writev(const struct bio_vec *vec, const int n);
+void bio_readahead(const int block_num, const int count, int to_cache);
+int bio_fd();
+int bio_sync_range(const int block_num, const int count);
+void bio_invalidate_range(const int block_num, const int count);
+int bio_uring_init(int entries);
+int bio_submit(struct bio_req *reqs, const int n);
+int bio_wait(struct bio_req *reqs, const int n);
+
+void bio_cache_init(size_t budget);
+int bio_flush();
+void bio_cache_stats(struct bio_cache_stats *stats);
 
 #endif
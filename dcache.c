@@ -0,0 +1,200 @@
+/*
+ *	Tiny File System
+ *
+ *	File:	dcache.c
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "dcache.h"
+
+/*
+ * Dentry cache
+ *
+ * Remembers the result of looking up a name in a directory, keyed by
+ * (parent ino, name). Entries are either positive (the ino the name
+ * resolved to) or negative (DCACHE_NEGATIVE, the name does not exist).
+ * Entries live in a hash table and on an LRU list; once the cache holds
+ * capacity entries the least recently used one is recycled.
+ */
+struct dentry {
+	uint32_t		parent;				/* ino of the directory holding the name */
+	int				ino;				/* ino the name resolves to, or DCACHE_NEGATIVE */
+	uint32_t		hash;
+	struct dentry	*hash_next;
+	struct dentry	*lru_prev;
+	struct dentry	*lru_next;
+	size_t			name_len;
+	char			name[];
+};
+
+static struct dentry **hash_table = NULL;
+static uint32_t hash_mask = 0;
+static struct dentry lru = { .lru_prev = &lru, .lru_next = &lru };
+static int count = 0;
+static int max_entries = 0;
+static pthread_mutex_t dcache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static uint32_t dentry_hash(uint32_t parent, const char *name, size_t name_len) {
+	//FNV-1a over the parent ino and the name
+	uint32_t hash = 2166136261u ^ parent;
+	size_t i;
+	for (i = 0; i < name_len; i++) {
+		hash = (hash ^ (unsigned char)name[i]) * 16777619u;
+	}
+	return hash;
+}
+
+static void lru_unlink(struct dentry *d) {
+	d->lru_prev->lru_next = d->lru_next;
+	d->lru_next->lru_prev = d->lru_prev;
+}
+
+static void lru_push_front(struct dentry *d) {
+	d->lru_next = lru.lru_next;
+	d->lru_prev = &lru;
+	lru.lru_next->lru_prev = d;
+	lru.lru_next = d;
+}
+
+static struct dentry **find_link(uint32_t parent, const char *name, size_t name_len, uint32_t hash) {
+	struct dentry **link = &hash_table[hash & hash_mask];
+	while (*link != NULL) {
+		struct dentry *d = *link;
+		if (d->hash == hash && d->parent == parent && d->name_len == name_len
+				&& memcmp(d->name, name, name_len) == 0) {
+			break;
+		}
+		link = &d->hash_next;
+	}
+	return link;
+}
+
+static void free_dentry(struct dentry **link) {
+	struct dentry *d = *link;
+	*link = d->hash_next;
+	lru_unlink(d);
+	free(d);
+	count--;
+}
+
+void dcache_init(int capacity) {
+	pthread_mutex_lock(&dcache_lock);
+	if (hash_table != NULL || capacity <= 0) {
+		pthread_mutex_unlock(&dcache_lock);
+		return;
+	}
+	uint32_t buckets = 1;
+	while (buckets < (uint32_t)capacity) {
+		buckets <<= 1;
+	}
+	hash_table = calloc(buckets, sizeof(struct dentry *));
+	if (hash_table != NULL) {
+		hash_mask = buckets - 1;
+		max_entries = capacity;
+	}
+	pthread_mutex_unlock(&dcache_lock);
+}
+
+void dcache_destroy() {
+	pthread_mutex_lock(&dcache_lock);
+	while (lru.lru_next != &lru) {
+		struct dentry *d = lru.lru_next;
+		lru_unlink(d);
+		free(d);
+	}
+	free(hash_table);
+	hash_table = NULL;
+	count = 0;
+	max_entries = 0;
+	pthread_mutex_unlock(&dcache_lock);
+}
+
+//Returns 1 and sets *ino on a hit (DCACHE_NEGATIVE for a cached miss), 0 if the name is not cached
+int dcache_lookup(uint32_t parent, const char *name, size_t name_len, int *ino) {
+	int found = 0;
+	pthread_mutex_lock(&dcache_lock);
+	if (hash_table != NULL) {
+		struct dentry *d = *find_link(parent, name, name_len, dentry_hash(parent, name, name_len));
+		if (d != NULL) {
+			*ino = d->ino;
+			lru_unlink(d);
+			lru_push_front(d);
+			found = 1;
+		}
+	}
+	pthread_mutex_unlock(&dcache_lock);
+	return found;
+}
+
+//Record that name in parent resolves to ino, or to nothing if ino is DCACHE_NEGATIVE
+void dcache_add(uint32_t parent, const char *name, size_t name_len, int ino) {
+	pthread_mutex_lock(&dcache_lock);
+	if (hash_table == NULL) {
+		pthread_mutex_unlock(&dcache_lock);
+		return;
+	}
+	uint32_t hash = dentry_hash(parent, name, name_len);
+	struct dentry **link = find_link(parent, name, name_len, hash);
+	if (*link != NULL) {
+		(*link)->ino = ino;
+		lru_unlink(*link);
+		lru_push_front(*link);
+		pthread_mutex_unlock(&dcache_lock);
+		return;
+	}
+
+	if (count >= max_entries) {
+		struct dentry *victim = lru.lru_prev;
+		free_dentry(find_link(victim->parent, victim->name, victim->name_len, victim->hash));
+	}
+
+	struct dentry *d = malloc(sizeof(struct dentry) + name_len);
+	if (d == NULL) {
+		pthread_mutex_unlock(&dcache_lock);
+		return;
+	}
+	d->parent = parent;
+	d->ino = ino;
+	d->hash = hash;
+	d->name_len = name_len;
+	memcpy(d->name, name, name_len);
+	d->hash_next = hash_table[hash & hash_mask];
+	hash_table[hash & hash_mask] = d;
+	lru_push_front(d);
+	count++;
+	pthread_mutex_unlock(&dcache_lock);
+}
+
+void dcache_remove(uint32_t parent, const char *name, size_t name_len) {
+	pthread_mutex_lock(&dcache_lock);
+	if (hash_table != NULL) {
+		struct dentry **link = find_link(parent, name, name_len, dentry_hash(parent, name, name_len));
+		if (*link != NULL) {
+			free_dentry(link);
+		}
+	}
+	pthread_mutex_unlock(&dcache_lock);
+}
+
+//Forget every name cached under parent, used when the directory itself goes away
+void dcache_remove_dir(uint32_t parent) {
+	uint32_t i;
+	pthread_mutex_lock(&dcache_lock);
+	if (hash_table != NULL) {
+		for (i = 0; i <= hash_mask; i++) {
+			struct dentry **link = &hash_table[i];
+			while (*link != NULL) {
+				if ((*link)->parent == parent) {
+					free_dentry(link);
+				} else {
+					link = &(*link)->hash_next;
+				}
+			}
+		}
+	}
+	pthread_mutex_unlock(&dcache_lock);
+}
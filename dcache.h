@@ -0,0 +1,22 @@
+/*
+ *	Tiny File System
+ *	File:	dcache.h
+ *
+ */
+
+#ifndef _DCACHE_H_
+#define _DCACHE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define DCACHE_NEGATIVE -1
+
+void dcache_init(int capacity);
+void dcache_destroy();
+int dcache_lookup(uint32_t parent, const char *name, size_t name_len, int *ino);
+void dcache_add(uint32_t parent, const char *name, size_t name_len, int ino);
+void dcache_remove(uint32_t parent, const char *name, size_t name_len);
+void dcache_remove_dir(uint32_t parent);
+
+#endif
@@ -0,0 +1,73 @@
+/*
+ *	Tiny File System
+ *	File:	libtfs.h
+ *
+ */
+
+#ifndef _LIBTFS_H_
+#define _LIBTFS_H_
+
+#include <stddef.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <time.h>
+
+/*
+ * libtfs: the file system without FUSE, on one disk file per process.
+ *
+ * Calls return 0 (or a byte count) on success and a negative errno on
+ * failure, as FUSE handlers do. Paths are absolute within the file system.
+ * Every call may be made from any number of threads at once, between
+ * tfs_mount() and tfs_unmount(). tfs_mount() makes a file system, as the
+ * mkfs options describe, when there is none on the disk file yet.
+ */
+struct tfs_options {
+	unsigned long	cache_mb;			/* block cache budget in MiB, 0 disables it */
+	int				dcache_entries;		/* dentry cache capacity, 0 disables it */
+	int				extents;			/* mkfs: map regular files with extents */
+	int				mmap;				/* map the disk file and use metadata in place */
+	int				uring;				/* io_uring depth per thread, 0 for synchronous I/O */
+	int				readahead_kb;		/* largest readahead window, 0 disables readahead */
+	int				nostats;			/* do not time locks and block I/O for the stats files */
+	const char		*backend;			/* what the disk is kept on, see backend.h; NULL for the file */
+	int				format;				/* mkfs even if diskfile holds a file system */
+	unsigned long	disk_mb;			/* mkfs: size of the volume in MiB */
+	unsigned long	inodes;				/* mkfs: number of inodes, 0 for one per 32 KiB of volume */
+	unsigned		block_size;			/* mkfs: bytes per block, 0 for what tfs was built with */
+};
+
+/* an open file, from tfs_create() or tfs_open() until tfs_release() */
+struct tfs_file;
+
+/* called by tfs_readdir() for each entry, as fuse_fill_dir_t is */
+typedef int (*tfs_fill_dir_t)(void *buf, const char *name, const struct stat *stbuf, off_t off);
+
+void tfs_options_init(struct tfs_options *opts);
+int tfs_mount(const char *diskfile, const struct tfs_options *opts);
+void tfs_unmount();
+
+int tfs_getattr(const char *path, struct stat *stbuf);
+int tfs_utimens(const char *path, const struct timespec tv[2]);
+int tfs_truncate(const char *path, off_t size);
+
+int tfs_opendir(const char *path);
+int tfs_readdir(const char *path, void *buffer, tfs_fill_dir_t filler);
+int tfs_mkdir(const char *path, mode_t mode, uid_t uid, gid_t gid);
+int tfs_rmdir(const char *path);
+int tfs_unlink(const char *path);
+
+int tfs_create(const char *path, mode_t mode, uid_t uid, gid_t gid, struct tfs_file **filep);
+int tfs_open(const char *path, int flags, struct tfs_file **filep);
+int tfs_read(struct tfs_file *file, char *buffer, size_t size, off_t offset);
+int tfs_write(struct tfs_file *file, const char *buffer, size_t size, off_t offset);
+int tfs_flush(struct tfs_file *file);
+void tfs_release(struct tfs_file *file);
+int tfs_direct_io(struct tfs_file *file);
+
+#ifdef FUSE_USE_VERSION
+/* zero-copy data path for the FUSE front end: pieces of the disk file are spliced, not copied */
+int tfs_read_buf(struct tfs_file *file, struct fuse_bufvec **bufp, size_t size, off_t offset);
+int tfs_write_buf(struct tfs_file *file, struct fuse_bufvec *buf, off_t offset);
+#endif
+
+#endif
@@ -0,0 +1,69 @@
+/*
+ *	Tiny File System
+ *	File:	mkfs_tfs.c
+ *
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "libtfs.h"
+
+/*
+ * Make a new file system on a disk file, replacing whatever it held, with
+ * the volume size, inode count and block size given. tfs itself only
+ * makes one, of the default size, on a disk file that is not there.
+ *
+ *	./mkfs.tfs DISKFILE
+ *	./mkfs.tfs -s 64g -i 4000000 -x DISKFILE
+ */
+static unsigned long parse_mb(const char *s) {
+	char *end;
+	unsigned long n = strtoul(s, &end, 10);
+	if (*end == 'g' || *end == 'G') {
+		n <<= 10;
+	} else if (*end == 't' || *end == 'T') {
+		n <<= 20;
+	}
+	return n;
+}
+
+static void usage(const char *prog) {
+	fprintf(stderr,
+		"usage: %s [options] diskfile\n"
+		"  -s size        volume size in MiB, or with g or t in GiB or TiB (32)\n"
+		"  -i inodes      number of inodes (one per 32 KiB of volume)\n"
+		"  -b bytes       block size, which has to be the one tfs was built with\n"
+		"  -x             map regular files with extents\n",
+		prog);
+	exit(1);
+}
+
+int main(int argc, char **argv) {
+	struct tfs_options opts;
+	int opt, retval;
+
+	tfs_options_init(&opts);
+	opts.format = 1;
+	opts.nostats = 1;
+	while ((opt = getopt(argc, argv, "s:i:b:x")) != -1) {
+		switch (opt) {
+		case 's': opts.disk_mb = parse_mb(optarg); break;
+		case 'i': opts.inodes = strtoul(optarg, NULL, 10); break;
+		case 'b': opts.block_size = strtoul(optarg, NULL, 10); break;
+		case 'x': opts.extents = 1; break;
+		default: usage(argv[0]);
+		}
+	}
+	if (optind != argc - 1 || opts.disk_mb == 0) {
+		usage(argv[0]);
+	}
+
+	if ((retval = tfs_mount(argv[optind], &opts)) < 0) {
+		fprintf(stderr, "%s: %s\n", argv[optind], strerror(-retval));
+		return 1;
+	}
+	tfs_unmount();
+	return 0;
+}
@@ -0,0 +1,301 @@
+/*
+ *	Tiny File System
+ *
+ *	File:	stats.c
+ *
+ */
+
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "block.h"
+#include "stats.h"
+
+/*
+ * Operation and lock statistics
+ *
+ * Every thread counts into a struct thread_stats of its own, so keeping
+ * them costs two clock reads and a few stores to memory no other thread
+ * writes. The report adds up all of them: the set is only ever added to,
+ * and a thread that exits leaves its counts behind for the next new one
+ * to carry on from, so nothing counted is lost and the set stays as big
+ * as the most threads that were ever running at once.
+ *
+ * Counters are stored and loaded relaxed: a report taken while requests
+ * run may be a few counts behind, never torn.
+ */
+struct latency {
+	uint64_t	count;
+	uint64_t	total_ns;
+	uint64_t	hist[STATS_BUCKETS];
+};
+
+struct op_stats {
+	struct latency	time;
+	uint64_t		errors;				/* calls that returned an error */
+	uint64_t		bytes;				/* data moved by the calls that succeeded */
+};
+
+struct lock_stats {
+	struct latency	wait;				/* from asking for the lock to having it */
+	struct latency	hold;				/* from having it to letting it go */
+};
+
+struct thread_stats {
+	struct op_stats		ops[STATS_NOPS];
+	struct lock_stats	locks[STATS_NLOCKS];
+	struct thread_stats	*next;			/* every thread_stats there is */
+	struct thread_stats	*free_next;		/* left by a thread that exited */
+};
+
+static const char *op_names[STATS_NOPS] = {
+	"getattr", "readdir", "opendir", "releasedir", "mkdir", "rmdir",
+	"create", "open", "read", "write", "read_buf", "write_buf", "unlink",
+	"truncate", "flush", "utimens", "release", "bio_read", "bio_write",
+};
+
+static const char *lock_names[STATS_NLOCKS] = {
+	"inode_shared", "inode_excl", "alloc_lock", "itable_lock",
+};
+
+static int enabled = 1;
+static struct thread_stats *all_stats = NULL;
+static struct thread_stats *free_stats = NULL;
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t stats_key;
+static pthread_once_t stats_once = PTHREAD_ONCE_INIT;
+static __thread struct thread_stats *mine = NULL;
+static __thread uint64_t held_since[STATS_NLOCKS];
+
+#define STAT_ADD(field, v)	__atomic_store_n(&(field), (field) + (v), __ATOMIC_RELAXED)
+#define STAT_GET(field)		__atomic_load_n(&(field), __ATOMIC_RELAXED)
+
+//A thread's counters go back on the free list when it exits
+static void thread_exit(void *arg) {
+	struct thread_stats *ts = arg;
+	pthread_mutex_lock(&stats_lock);
+	ts->free_next = free_stats;
+	free_stats = ts;
+	pthread_mutex_unlock(&stats_lock);
+}
+
+static void key_init() {
+	pthread_key_create(&stats_key, thread_exit);
+}
+
+//This thread's counters, found the first time it counts something
+static struct thread_stats *thread_stats() {
+	if (mine != NULL) {
+		return mine;
+	}
+	pthread_once(&stats_once, key_init);
+	pthread_mutex_lock(&stats_lock);
+	struct thread_stats *ts = free_stats;
+	if (ts != NULL) {
+		free_stats = ts->free_next;
+	} else if ((ts = calloc(1, sizeof(struct thread_stats))) != NULL) {
+		ts->next = all_stats;
+		__atomic_store_n(&all_stats, ts, __ATOMIC_RELEASE);
+	}
+	pthread_mutex_unlock(&stats_lock);
+	if (ts != NULL) {
+		pthread_setspecific(stats_key, ts);
+	}
+	mine = ts;
+	return ts;
+}
+
+static int bucket(uint64_t ns) {
+	int b = ns > 1 ? 63 - __builtin_clzll(ns) : 0;
+	return b < STATS_BUCKETS ? b : STATS_BUCKETS - 1;
+}
+
+static void latency_add(struct latency *lat, uint64_t ns) {
+	STAT_ADD(lat->count, 1);
+	STAT_ADD(lat->total_ns, ns);
+	STAT_ADD(lat->hist[bucket(ns)], 1);
+}
+
+//Turn counting on or off, it is on unless mounted with -o nostats
+void stats_enable(int on) {
+	enabled = on;
+}
+
+//A timestamp in ns to pass to the calls below, 0 while counting is off
+uint64_t stats_now() {
+	struct timespec ts;
+	if (!enabled) {
+		return 0;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec + 1;
+}
+
+//Count a call to op that started at start, and either failed or moved bytes
+void stats_op_done(enum stats_op op, uint64_t start, int failed, size_t bytes) {
+	struct thread_stats *ts;
+	if (start == 0 || (ts = thread_stats()) == NULL) {
+		return;
+	}
+	latency_add(&ts->ops[op].time, stats_now() - start);
+	if (failed) {
+		STAT_ADD(ts->ops[op].errors, 1);
+	} else {
+		STAT_ADD(ts->ops[op].bytes, bytes);
+	}
+}
+
+//Count a wait for lock that started at start, returns when it ended for stats_lock_held()
+uint64_t stats_lock_waited(enum stats_lock lock, uint64_t start) {
+	struct thread_stats *ts;
+	if (start == 0 || (ts = thread_stats()) == NULL) {
+		return 0;
+	}
+	uint64_t now = stats_now();
+	latency_add(&ts->locks[lock].wait, now - start);
+	return now;
+}
+
+//Count lock having been held since since, as returned by stats_lock_waited()
+void stats_lock_held(enum stats_lock lock, uint64_t since) {
+	struct thread_stats *ts;
+	if (since == 0 || (ts = thread_stats()) == NULL) {
+		return;
+	}
+	latency_add(&ts->locks[lock].hold, stats_now() - since);
+}
+
+void stats_mutex_lock(pthread_mutex_t *mutex, enum stats_lock lock) {
+	uint64_t start = stats_now();
+	pthread_mutex_lock(mutex);
+	held_since[lock] = stats_lock_waited(lock, start);
+}
+
+void stats_mutex_unlock(pthread_mutex_t *mutex, enum stats_lock lock) {
+	uint64_t since = held_since[lock];
+	held_since[lock] = 0;
+	pthread_mutex_unlock(mutex);
+	stats_lock_held(lock, since);
+}
+
+/*
+ * Report
+ */
+static void latency_sum(struct latency *sum, struct latency *lat) {
+	int i;
+	sum->count += STAT_GET(lat->count);
+	sum->total_ns += STAT_GET(lat->total_ns);
+	for (i = 0; i < STATS_BUCKETS; i++) {
+		sum->hist[i] += STAT_GET(lat->hist[i]);
+	}
+}
+
+//Upper bound in ns of the bucket holding the given fraction of the times
+static uint64_t percentile(struct latency *lat, double fraction) {
+	uint64_t want = lat->count * fraction, seen = 0;
+	int i;
+	if (lat->count == 0) {
+		return 0;
+	}
+	for (i = 0; i < STATS_BUCKETS - 1; i++) {
+		seen += lat->hist[i];
+		if (seen > want) {
+			break;
+		}
+	}
+	return 2ULL << i;
+}
+
+static double avg_us(struct latency *lat) {
+	return lat->count ? lat->total_ns / 1000.0 / lat->count : 0;
+}
+
+static void json_latency(FILE *f, const char *name, struct latency *lat) {
+	int i;
+	fprintf(f, "\"%s\": {\"count\": %llu, \"total_ns\": %llu, \"p50_ns\": %llu, \"p99_ns\": %llu, \"hist\": [",
+		name, (unsigned long long)lat->count, (unsigned long long)lat->total_ns,
+		(unsigned long long)percentile(lat, 0.5), (unsigned long long)percentile(lat, 0.99));
+	for (i = 0; i < STATS_BUCKETS; i++) {
+		fprintf(f, "%s%llu", i ? ", " : "", (unsigned long long)lat->hist[i]);
+	}
+	fprintf(f, "]}");
+}
+
+//What has been counted so far, as text or JSON, malloc'd; its length goes in len
+char *stats_report(int json, size_t *len) {
+	struct op_stats ops[STATS_NOPS];
+	struct lock_stats locks[STATS_NLOCKS];
+	struct bio_cache_stats cache;
+	struct thread_stats *ts;
+	char *out = NULL;
+	int i;
+
+	memset(ops, 0, sizeof(ops));
+	memset(locks, 0, sizeof(locks));
+	for (ts = __atomic_load_n(&all_stats, __ATOMIC_ACQUIRE); ts != NULL; ts = ts->next) {
+		for (i = 0; i < STATS_NOPS; i++) {
+			latency_sum(&ops[i].time, &ts->ops[i].time);
+			ops[i].errors += STAT_GET(ts->ops[i].errors);
+			ops[i].bytes += STAT_GET(ts->ops[i].bytes);
+		}
+		for (i = 0; i < STATS_NLOCKS; i++) {
+			latency_sum(&locks[i].wait, &ts->locks[i].wait);
+			latency_sum(&locks[i].hold, &ts->locks[i].hold);
+		}
+	}
+	bio_cache_stats(&cache);
+
+	FILE *f = open_memstream(&out, len);
+	if (f == NULL) {
+		return NULL;
+	}
+	if (json) {
+		fprintf(f, "{\n\"ops\": {\n");
+		for (i = 0; i < STATS_NOPS; i++) {
+			fprintf(f, "  \"%s\": {\"calls\": %llu, \"errors\": %llu, \"bytes\": %llu, ", op_names[i],
+				(unsigned long long)ops[i].time.count, (unsigned long long)ops[i].errors,
+				(unsigned long long)ops[i].bytes);
+			json_latency(f, "latency", &ops[i].time);
+			fprintf(f, "}%s\n", i < STATS_NOPS - 1 ? "," : "");
+		}
+		fprintf(f, "},\n\"locks\": {\n");
+		for (i = 0; i < STATS_NLOCKS; i++) {
+			fprintf(f, "  \"%s\": {", lock_names[i]);
+			json_latency(f, "wait", &locks[i].wait);
+			fprintf(f, ", ");
+			json_latency(f, "hold", &locks[i].hold);
+			fprintf(f, "}%s\n", i < STATS_NLOCKS - 1 ? "," : "");
+		}
+		fprintf(f, "},\n\"cache\": {\"hits\": %lu, \"misses\": %lu, \"writebacks\": %lu, "
+			"\"evictions\": %lu, \"readaheads\": %lu, \"frames\": %d, \"dirty\": %d}\n}\n",
+			cache.hits, cache.misses, cache.writebacks, cache.evictions, cache.readaheads,
+			cache.nframes, cache.ndirty);
+	} else {
+		fprintf(f, "%-12s %10s %8s %14s %10s %10s %10s\n",
+			"op", "calls", "errors", "bytes", "avg_us", "p50_us", "p99_us");
+		for (i = 0; i < STATS_NOPS; i++) {
+			fprintf(f, "%-12s %10llu %8llu %14llu %10.1f %10.1f %10.1f\n", op_names[i],
+				(unsigned long long)ops[i].time.count, (unsigned long long)ops[i].errors,
+				(unsigned long long)ops[i].bytes, avg_us(&ops[i].time),
+				percentile(&ops[i].time, 0.5) / 1000.0, percentile(&ops[i].time, 0.99) / 1000.0);
+		}
+		fprintf(f, "\n%-12s %10s %12s %12s %12s %12s\n",
+			"lock", "acquired", "avg_wait_us", "p99_wait_us", "avg_hold_us", "p99_hold_us");
+		for (i = 0; i < STATS_NLOCKS; i++) {
+			fprintf(f, "%-12s %10llu %12.1f %12.1f %12.1f %12.1f\n", lock_names[i],
+				(unsigned long long)locks[i].wait.count, avg_us(&locks[i].wait),
+				percentile(&locks[i].wait, 0.99) / 1000.0, avg_us(&locks[i].hold),
+				percentile(&locks[i].hold, 0.99) / 1000.0);
+		}
+		fprintf(f, "\ncache: %lu hits, %lu misses, %lu writebacks, %lu evictions, %lu readaheads, "
+			"%d frames, %d dirty\n", cache.hits, cache.misses, cache.writebacks, cache.evictions,
+			cache.readaheads, cache.nframes, cache.ndirty);
+	}
+	fclose(f);
+	return out;
+}
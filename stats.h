@@ -0,0 +1,59 @@
+/*
+ *	Tiny File System
+ *	File:	stats.h
+ *
+ */
+
+#ifndef _STATS_H_
+#define _STATS_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+
+/* timed operations: every tfs_ope handler, and block reads and writes */
+enum stats_op {
+	STATS_GETATTR,
+	STATS_READDIR,
+	STATS_OPENDIR,
+	STATS_RELEASEDIR,
+	STATS_MKDIR,
+	STATS_RMDIR,
+	STATS_CREATE,
+	STATS_OPEN,
+	STATS_READ,
+	STATS_WRITE,
+	STATS_READ_BUF,
+	STATS_WRITE_BUF,
+	STATS_UNLINK,
+	STATS_TRUNCATE,
+	STATS_FLUSH,
+	STATS_UTIMENS,
+	STATS_RELEASE,
+	STATS_BIO_READ,
+	STATS_BIO_WRITE,
+	STATS_NOPS
+};
+
+/* shared locks whose wait and hold times are kept */
+enum stats_lock {
+	STATS_LOCK_INODE_SHARED,			/* inode locks taken shared, waits only */
+	STATS_LOCK_INODE_EXCL,				/* inode locks taken exclusive */
+	STATS_LOCK_ALLOC,					/* alloc_lock */
+	STATS_LOCK_ITABLE,					/* itable_lock */
+	STATS_NLOCKS
+};
+
+/* latency buckets: bucket i counts times in [2^i, 2^(i+1)) ns, the last one everything longer */
+#define STATS_BUCKETS 32
+
+void stats_enable(int on);
+uint64_t stats_now();
+void stats_op_done(enum stats_op op, uint64_t start, int failed, size_t bytes);
+uint64_t stats_lock_waited(enum stats_lock lock, uint64_t start);
+void stats_lock_held(enum stats_lock lock, uint64_t since);
+void stats_mutex_lock(pthread_mutex_t *mutex, enum stats_lock lock);
+void stats_mutex_unlock(pthread_mutex_t *mutex, enum stats_lock lock);
+char *stats_report(int json, size_t *len);
+
+#endif
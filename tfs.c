@@ -19,42 +19,382 @@
 #include <sys/time.h>
 #include <libgen.h>
 #include <limits.h>
+#include <stddef.h>
+#include <endian.h>
 
 #include "block.h"
+#include "dcache.h"
+#include "stats.h"
 #include "tfs.h"
+#include "libtfs.h"
 
-char diskfile_path[PATH_MAX];
+/*
+ * This file is libtfs, the file system itself; tfs_fuse.c puts it behind
+ * FUSE. The disk file and options are the ones given to tfs_mount().
+ */
+static char diskfile_path[PATH_MAX];
+static struct tfs_options config;
+
+//Options as tfs is mounted with when none are given
+void tfs_options_init(struct tfs_options *opts) {
+	memset(opts, 0, sizeof(*opts));
+	opts->cache_mb = 8;
+	opts->dcache_entries = 16384;
+	opts->readahead_kb = 512;
+	opts->disk_mb = TFS_DISK_MB;
+}
+
+/*
+ * bitmap operations
+ */
+typedef unsigned char* bitmap_t;
+
+static void set_bitmap(bitmap_t b, int i) {
+	b[i / 8] |= 1 << (i & 7);
+}
+
+static void unset_bitmap(bitmap_t b, int i) {
+	b[i / 8] &= ~(1 << (i & 7));
+}
+
+static uint8_t get_bitmap(bitmap_t b, int i) {
+	return b[i / 8] & (1 << (i & 7)) ? 1 : 0;
+}
 
 // Declare your in-memory data structures here
 
-unsigned char* inode_bitmap = NULL;
-unsigned char* data_region_bitmap = NULL;
 struct superblock* superblock;
-pthread_mutex_t lock;
 
+/*
+ * With -o mmap DISKFILE is mapped, and the superblock, bitmaps and inode
+ * table are used in place in the mapping: writing them back is then a
+ * no-op rather than a pwrite per block. Without it they are copies.
+ */
+static int metadata_mapped = 0;
+
+static void map_disk() {
+	if (config.mmap && bio_map() == 0) {
+		metadata_mapped = 1;
+	}
+}
+
+static void* meta_alloc(int block, size_t size) {
+	if (metadata_mapped) {
+		return bio_block_addr(block);
+	}
+	return calloc(1, size);
+}
+
+static void meta_free(void* buf) {
+	if (!metadata_mapped) {
+		free(buf);
+	}
+}
+
+/*
+ * Locking
+ *
+ * Every inode has a reader/writer lock. Reading a file or directory takes
+ * it shared; changing its data, size or entries takes it exclusive. The
+ * bitmaps and allocation counters are under alloc_lock, the resident inode
+ * table under itable_lock and each mapping cursor under its own mutex; the
+ * block cache and dentry cache lock themselves.
+ *
+ * Lock order: a directory's inode lock comes before the lock of anything
+ * in it, so mkdir, rmdir and unlink lock the parent first, then the child.
+ * Path walks hold at most one inode lock at a time. Inode locks come before
+ * cursor locks, then alloc_lock, then itable_lock, then the caches' locks.
+ *
+ * Waits for all of these are timed for the stats file, and so are holds
+ * of the mutexes and of inode locks taken exclusive. Only the exclusive
+ * holder ever sets held_since, which is how inode_unlock() tells its hold
+ * from a shared one.
+ */
+struct inode_lock {
+	pthread_rwlock_t	lock;
+	uint64_t			held_since;
+};
+
+/*
+ * Inode locks are made a chunk at a time, the first time an inode in the
+ * chunk is locked, so a volume with millions of inodes only has locks for
+ * the ones in use. A chunk is never freed before unmount, so once its
+ * pointer is seen it can be used without inode_lock_alloc.
+ */
+#define INODE_LOCK_CHUNK	1024
+
+struct inode_lock** inode_locks = NULL;
+int inode_lock_chunks = 0;
+pthread_mutex_t inode_lock_alloc = PTHREAD_MUTEX_INITIALIZER;
+pthread_mutex_t alloc_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_mutex_t itable_lock = PTHREAD_MUTEX_INITIALIZER;
+
+//Called once the superblock is known, which has the number of inodes
+void inode_locks_init() {
+	inode_lock_chunks = (superblock->inodes + INODE_LOCK_CHUNK - 1) / INODE_LOCK_CHUNK;
+	inode_locks = calloc(inode_lock_chunks, sizeof(struct inode_lock *));
+}
+
+void inode_locks_destroy() {
+	int i, j;
+	for (i = 0; i < inode_lock_chunks; i++) {
+		if (inode_locks[i] == NULL) {
+			continue;
+		}
+		for (j = 0; j < INODE_LOCK_CHUNK; j++) {
+			pthread_rwlock_destroy(&inode_locks[i][j].lock);
+		}
+		free(inode_locks[i]);
+	}
+	free(inode_locks);
+	inode_locks = NULL;
+	inode_lock_chunks = 0;
+}
+
+static struct inode_lock* inode_lock_get(uint32_t ino) {
+	struct inode_lock* chunk = __atomic_load_n(&inode_locks[ino / INODE_LOCK_CHUNK], __ATOMIC_ACQUIRE);
+	if (chunk == NULL) {
+		int j;
+		pthread_mutex_lock(&inode_lock_alloc);
+		chunk = inode_locks[ino / INODE_LOCK_CHUNK];
+		if (chunk == NULL) {
+			chunk = calloc(INODE_LOCK_CHUNK, sizeof(struct inode_lock));
+			for (j = 0; j < INODE_LOCK_CHUNK; j++) {
+				pthread_rwlock_init(&chunk[j].lock, NULL);
+			}
+			__atomic_store_n(&inode_locks[ino / INODE_LOCK_CHUNK], chunk, __ATOMIC_RELEASE);
+		}
+		pthread_mutex_unlock(&inode_lock_alloc);
+	}
+	return &chunk[ino % INODE_LOCK_CHUNK];
+}
+
+static void inode_lock_shared(uint32_t ino) {
+	struct inode_lock* il = inode_lock_get(ino);
+	uint64_t start = stats_now();
+	pthread_rwlock_rdlock(&il->lock);
+	stats_lock_waited(STATS_LOCK_INODE_SHARED, start);
+}
+
+static void inode_lock_excl(uint32_t ino) {
+	struct inode_lock* il = inode_lock_get(ino);
+	uint64_t start = stats_now();
+	pthread_rwlock_wrlock(&il->lock);
+	il->held_since = stats_lock_waited(STATS_LOCK_INODE_EXCL, start);
+}
+
+static void inode_unlock(uint32_t ino) {
+	struct inode_lock* il = inode_lock_get(ino);
+	uint64_t since = il->held_since;
+	if (since != 0) {
+		il->held_since = 0;
+	}
+	pthread_rwlock_unlock(&il->lock);
+	stats_lock_held(STATS_LOCK_INODE_EXCL, since);
+}
+
+
+
+/*
+ * Allocation state. A bitmap takes as many blocks as its bits need, and
+ * each block keeps a count of its clear bits, so a search skips full
+ * blocks without looking at them, and a dirty bit, so only the blocks
+ * changed are written back. Within a block, bits are scanned a 64-bit
+ * word at a time starting from a next-fit hint just past the previous
+ * allocation, and the free counters let an allocation on a full bitmap
+ * fail without scanning.
+ */
+#define BITS_PER_BLOCK	(BLOCK_SIZE * 8)
+
+struct alloc_bitmap {
+	bitmap_t		bits;
+	int				nbits;				/* bits in use, a multiple of 64 */
+	int				start_blk;			/* where the bitmap is on disk */
+	int				nblocks;
+	int				*free;				/* clear bits per block */
+	unsigned char	*dirty;				/* one bit per block changed since written back */
+	int				ndirty;
+	int				nfree;
+	int				hint;				/* where the next search starts */
+};
+
+struct alloc_bitmap inode_bitmap;
+struct alloc_bitmap data_region_bitmap;
+
+//Blocks a bitmap of nbits takes on disk
+static int bitmap_blocks(int64_t nbits) {
+	return (nbits + BITS_PER_BLOCK - 1) / BITS_PER_BLOCK;
+}
+
+//Word w of a bitmap, bit k of the word being bitmap index w * 64 + k
+static uint64_t bitmap_word(bitmap_t b, int w) {
+	uint64_t word;
+	memcpy(&word, b + (size_t)w * sizeof(uint64_t), sizeof(uint64_t));
+	return le64toh(word);
+}
+
+//First clear bit from bit from up to bit to (a multiple of 64), -1 if all are set
+static int bitmap_scan(bitmap_t b, int from, int to) {
+	int w = from / 64;
+	uint64_t used = bitmap_word(b, w) | ((1ULL << (from % 64)) - 1);
+	for (;;) {
+		if (~used != 0) {
+			return w * 64 + __builtin_ctzll(~used);
+		}
+		if (++w >= to / 64) {
+			return -1;
+		}
+		used = bitmap_word(b, w);
+	}
+}
+
+//First clear bit at or after start, wrapping around, -1 if all are set
+static int bitmap_find_free(struct alloc_bitmap *bm, int start) {
+	int blk = start / BITS_PER_BLOCK;
+	int i;
+	//bits before start in its block count as used the first time round, the last iteration revisits them
+	for (i = 0; i <= bm->nblocks; i++) {
+		int first = blk * BITS_PER_BLOCK;
+		int last = bm->nbits - first < BITS_PER_BLOCK ? bm->nbits : first + BITS_PER_BLOCK;
+		if (bm->free[blk] > 0) {
+			int found = bitmap_scan(bm->bits, i == 0 ? start : first, last);
+			if (found >= 0) {
+				return found;
+			}
+		}
+		blk = (blk + 1) % bm->nblocks;
+	}
+	return -1;
+}
+
+static void bitmap_dirty(struct alloc_bitmap *bm, int i) {
+	if (!get_bitmap(bm->dirty, i / BITS_PER_BLOCK)) {
+		set_bitmap(bm->dirty, i / BITS_PER_BLOCK);
+		bm->ndirty++;
+	}
+}
+
+static void bitmap_take(struct alloc_bitmap *bm, int i) {
+	set_bitmap(bm->bits, i);
+	bm->free[i / BITS_PER_BLOCK]--;
+	bm->nfree--;
+	bitmap_dirty(bm, i);
+}
+
+static void bitmap_give(struct alloc_bitmap *bm, int i) {
+	unset_bitmap(bm->bits, i);
+	bm->free[i / BITS_PER_BLOCK]++;
+	bm->nfree++;
+	bitmap_dirty(bm, i);
+}
+
+//Set up the bitmap of nbits at start_blk, read from disk, or all clear and still to be written for a new file system
+static void bitmap_load(struct alloc_bitmap *bm, int start_blk, int nbits, int fresh) {
+	int b, w;
+	bm->nbits = nbits;
+	bm->start_blk = start_blk;
+	bm->nblocks = bitmap_blocks(nbits);
+	bm->bits = meta_alloc(start_blk, (size_t)bm->nblocks * BLOCK_SIZE);
+	bm->free = malloc(bm->nblocks * sizeof(int));
+	bm->dirty = calloc(1, (bm->nblocks + 7) / 8);
+	bm->ndirty = 0;
+	if (fresh) {
+		memset(bm->bits, 0, (size_t)bm->nblocks * BLOCK_SIZE);
+		for (b = 0; b < bm->nblocks; b++) {
+			bitmap_dirty(bm, b * BITS_PER_BLOCK);
+		}
+	} else if (!metadata_mapped) {
+		bio_read_range(start_blk, bm->nblocks, bm->bits);
+	}
+
+	//bits past nbits in the last block are not part of the bitmap
+	bm->nfree = 0;
+	for (b = 0; b < bm->nblocks; b++) {
+		int first = b * (BITS_PER_BLOCK / 64);
+		int last = b == bm->nblocks - 1 ? nbits / 64 : first + BITS_PER_BLOCK / 64;
+		bm->free[b] = (last - first) * 64;
+		for (w = first; w < last; w++) {
+			bm->free[b] -= __builtin_popcountll(bitmap_word(bm->bits, w));
+		}
+		bm->nfree += bm->free[b];
+	}
+	bm->hint = 0;
+}
+
+static void bitmap_unload(struct alloc_bitmap *bm) {
+	meta_free(bm->bits);
+	free(bm->free);
+	free(bm->dirty);
+	memset(bm, 0, sizeof(*bm));
+}
+
+//Write back the blocks of a bitmap changed since the last call
+static void bitmap_flush(struct alloc_bitmap *bm) {
+	int b;
+	for (b = 0; b < bm->nblocks && bm->ndirty > 0; b++) {
+		if (get_bitmap(bm->dirty, b)) {
+			unset_bitmap(bm->dirty, b);
+			bm->ndirty--;
+			bio_write(bm->start_blk + b, bm->bits + (size_t)b * BLOCK_SIZE);
+		}
+	}
+}
+
+//Set up both bitmaps and their free counters once the superblock is known
+void alloc_init(int fresh) {
+	bitmap_load(&inode_bitmap, superblock->i_bitmap_blk, superblock->inodes, fresh);
+	bitmap_load(&data_region_bitmap, superblock->d_bitmap_blk, superblock->data_blocks, fresh);
+}
 
+void alloc_destroy() {
+	bitmap_unload(&inode_bitmap);
+	bitmap_unload(&data_region_bitmap);
+}
 
 /* 
  * Get available inode number from bitmap
  */
 int get_avail_ino() {
-	// Step 1: Read inode bitmap from disk
-	// Step 2: Traverse inode bitmap to find an available slot
-	int avail = -1;
-	int i;
-	for(i = 0; i < MAX_INUM; i++){
-		if(get_bitmap(inode_bitmap, i) != 1){
-			avail = i;
-			break;
-		}
+	stats_mutex_lock(&alloc_lock, STATS_LOCK_ALLOC);
+	int avail = inode_bitmap.nfree > 0 ? bitmap_find_free(&inode_bitmap, inode_bitmap.hint) : -1;
+	if (avail == -1) {
+		stats_mutex_unlock(&alloc_lock, STATS_LOCK_ALLOC);
+		return -1;
+	}
+
+	// Update inode bitmap, it is written back by flush_bitmaps()
+	bitmap_take(&inode_bitmap, avail);
+	inode_bitmap.hint = (avail + 1) % inode_bitmap.nbits;
+	stats_mutex_unlock(&alloc_lock, STATS_LOCK_ALLOC);
+	return avail;
+}
+
+/* 
+ * Reserve up to count data blocks in one go, starting at goal if it is free.
+ * The blocks reserved are contiguous: the first is returned and *got is
+ * set to how many there are, so callers wanting more call again.
+ */
+int get_avail_blknos(int goal, int count, int *got) {
+	stats_mutex_lock(&alloc_lock, STATS_LOCK_ALLOC);
+	int avail = goal;
+	if (data_region_bitmap.nfree == 0) {
+		avail = -1;
+	} else if (goal < 0 || goal >= data_region_bitmap.nbits || get_bitmap(data_region_bitmap.bits, goal) == 1) {
+		avail = bitmap_find_free(&data_region_bitmap, data_region_bitmap.hint);
 	}
-	if(avail == -1){
+	if (avail == -1) {
+		stats_mutex_unlock(&alloc_lock, STATS_LOCK_ALLOC);
 		return -1;
 	}
 
-	// Step 3: Update inode bitmap and write to disk 
-	set_bitmap(inode_bitmap, avail);
-	bio_write(superblock->i_bitmap_blk, inode_bitmap);
+	int n = 0;
+	while (n < count && avail + n < data_region_bitmap.nbits && get_bitmap(data_region_bitmap.bits, avail + n) != 1) {
+		bitmap_take(&data_region_bitmap, avail + n);
+		n++;
+	}
+	data_region_bitmap.hint = (avail + n) % data_region_bitmap.nbits;
+	stats_mutex_unlock(&alloc_lock, STATS_LOCK_ALLOC);
+	*got = n;
 	return avail;
 }
 
@@ -62,639 +402,1997 @@ int get_avail_ino() {
  * Get available data block number from bitmap
  */
 int get_avail_blkno() {
-	// Step 1: Read data block bitmap from disk
-	// Step 2: Traverse data block bitmap to find an available slot
+	int got;
+	return get_avail_blknos(-1, 1, &got);
+}
 
-	int avail = -1;
-	int i;
-	for (i = 0; i < MAX_DNUM; i++){
-		if (get_bitmap(data_region_bitmap, i) != 1) {
-			avail = i;
-			break;
-		} 
+/* 
+ * Get data block goal if it is free, so a file's blocks stay contiguous, or any available one
+ */
+int get_blkno_near(int goal) {
+	int got;
+	return get_avail_blknos(goal, 1, &got);
+}
+
+/* 
+ * Return an inode number or data block to its bitmap, the caller writes the bitmap
+ */
+void release_ino(int ino) {
+	stats_mutex_lock(&alloc_lock, STATS_LOCK_ALLOC);
+	if (get_bitmap(inode_bitmap.bits, ino)) {
+		bitmap_give(&inode_bitmap, ino);
 	}
-	if (avail == -1){
-		return avail;
+	stats_mutex_unlock(&alloc_lock, STATS_LOCK_ALLOC);
+}
+
+void release_blkno(int blkno) {
+	stats_mutex_lock(&alloc_lock, STATS_LOCK_ALLOC);
+	if (get_bitmap(data_region_bitmap.bits, blkno)) {
+		bitmap_give(&data_region_bitmap, blkno);
 	}
-	
-	// Step 3: Update data block bitmap and write to disk 
-	set_bitmap(data_region_bitmap, avail);
-	bio_write(superblock->d_bitmap_blk, data_region_bitmap);
-	return avail;
+	stats_mutex_unlock(&alloc_lock, STATS_LOCK_ALLOC);
+}
+
+/*
+ * Write back the bitmaps changed since the last call. Allocations only mark
+ * them dirty, so each FUSE operation writes them once however many blocks
+ * it allocated or freed.
+ */
+void flush_bitmaps() {
+	stats_mutex_lock(&alloc_lock, STATS_LOCK_ALLOC);
+	bitmap_flush(&inode_bitmap);
+	bitmap_flush(&data_region_bitmap);
+	stats_mutex_unlock(&alloc_lock, STATS_LOCK_ALLOC);
+}
+
+//Count an inode in or out of the superblock's orphans, so mount only looks for them when there are any
+static void orphans_count(int delta) {
+	stats_mutex_lock(&alloc_lock, STATS_LOCK_ALLOC);
+	superblock->orphans += delta;
+	bio_write(0, superblock);
+	stats_mutex_unlock(&alloc_lock, STATS_LOCK_ALLOC);
 }
 
 /* 
  * inode operations
  */
-int readi(uint16_t ino, struct inode *inode) {
-	//printf("----------------------------\n");
-	//printf("entered readi for ino: %d\n", ino);
-  // Step 1: Get the inode's on-disk block number
-  int inodes_per_block = BLOCK_SIZE / sizeof(struct inode);
-  //printf("number of inodes per block: %d\n", inodes_per_block);
-  int inode_block_index = superblock->i_start_blk + ino / inodes_per_block;
-	//printf("block number: %d\n", inode_block_index);
-
-  
-  // Step 2: Get offset of the inode in the inode on-disk block
-  int offset = ino % inodes_per_block;
-  //printf("offset = %d from %d mod %d\n", offset, ino, inodes_per_block);
-  void* buffer = malloc(BLOCK_SIZE);
-  // Step 3: Read the block from disk and then copy into inode structure
-  bio_read(inode_block_index, buffer);
-  memcpy(inode, buffer+(offset*sizeof(struct inode)), sizeof(struct inode));
-  //printf("readi finished\n");
-  //printf("-------------\n");
-  return 0;
-}
-
-int writei(uint16_t ino, struct inode *inode) {
-	//printf("----------------------------\n");
-	//printf("entered writei\n");
-	// Step 1: Get the block number where this inode resides on disk
-	int inodes_per_block = BLOCK_SIZE / sizeof(struct inode);
-	//printf("number of inodes per block: %d\n", inodes_per_block);
-	int inode_block_index = superblock->i_start_blk + ino / inodes_per_block;
-	//printf("block number: %d\n", inode_block_index);
-
-	// Step 2: Get the offset in the block where this inode resides on disk
-	int offset = ino % inodes_per_block;
-	//printf("offset = %d from %d mod %d\n", offset, ino, inodes_per_block);
-
-	void* buffer = malloc(BLOCK_SIZE);
-	bio_read(inode_block_index, buffer);
-
-	//struct inode *before = buffer + (offset*sizeof(struct inode));
-	//printf("block buffer before memcpy: %d\n", before->ino);
-
-	//update buffer at offset with our inode
-	memcpy(buffer + (offset*sizeof(struct inode)), inode, sizeof(struct inode));
-	
-	//struct inode *after = buffer + (offset*sizeof(struct inode));
-	//printf("block buffer after memcpy: %d\n", after->ino);
+#define INODES_PER_BLOCK	(BLOCK_SIZE / sizeof(struct inode))
+#define INODE_BLOCKS		((superblock->inodes + INODES_PER_BLOCK - 1) / INODES_PER_BLOCK)
+
+_Static_assert(sizeof(struct inode) == 128, "struct inode is part of the on-disk format");
+//with smaller blocks an extent tree of depth 1 holds too few extents for a fragmented file
+_Static_assert(BLOCK_SIZE >= 4096 && BLOCK_SIZE <= 65536 && (BLOCK_SIZE & (BLOCK_SIZE - 1)) == 0,
+	"BLOCK_SIZE has to be a power of two from 4096 to 65536");
+
+static int64_t now_ns() {
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static struct timespec ns_to_timespec(int64_t ns) {
+	struct timespec ts;
+	ts.tv_sec = ns / 1000000000;
+	ts.tv_nsec = ns % 1000000000;
+	if (ts.tv_nsec < 0) {
+		ts.tv_sec--;
+		ts.tv_nsec += 1000000000;
+	}
+	return ts;
+}
+
+//Fill in a new inode's mode and owner, with every time set to now
+static void inode_stamp(struct inode *inode, uint32_t mode, uint32_t uid, uint32_t gid) {
+	inode->mode = mode;
+	inode->uid = uid;
+	inode->gid = gid;
+	inode->atime = inode->mtime = inode->ctime = now_ns();
+}
+
+/*
+ * In-memory inode table: every inode block is read from disk once, the
+ * first time one of its inodes is needed, and afterwards readi/writei only
+ * touch memory. Blocks get their memory as they are loaded, so only the
+ * part of a large table in use takes any. Blocks holding dirty inodes are
+ * listed as they are dirtied and written back by flush_inodes().
+ */
+struct inode** inode_blocks = NULL;			/* each inode table block, NULL until loaded */
+int* inode_dirty = NULL;					/* inode table blocks to write back */
+int inode_ndirty = 0;
+unsigned char* inode_block_dirty = NULL;	/* one bit per inode table block, set while it is listed */
+uint16_t* inode_opens = NULL;				/* open files per inode, which pin it */
+
+//Called once the superblock is known, which sizes the table and places it when it is mapped
+void inode_cache_init() {
+	inode_blocks = calloc(INODE_BLOCKS, sizeof(struct inode *));
+	inode_dirty = malloc(INODE_BLOCKS * sizeof(int));
+	inode_ndirty = 0;
+	inode_block_dirty = calloc(1, (INODE_BLOCKS + 7) / 8);
+	inode_opens = calloc(superblock->inodes, sizeof(uint16_t));
+}
+
+void inode_cache_destroy() {
+	int block;
+	for (block = 0; block < INODE_BLOCKS; block++) {
+		if (inode_blocks[block] != NULL) {
+			meta_free(inode_blocks[block]);
+		}
+	}
+	free(inode_blocks);
+	free(inode_dirty);
+	free(inode_block_dirty);
+	free(inode_opens);
+	inode_blocks = NULL;
+	inode_dirty = NULL;
+	inode_ndirty = 0;
+	inode_block_dirty = NULL;
+	inode_opens = NULL;
+}
+
+//Make sure the inode block holding ino is resident, and return where ino is in it
+static struct inode* load_inode_block(uint32_t ino) {
+	int block = ino / INODES_PER_BLOCK;
+	if (inode_blocks[block] == NULL) {
+		inode_blocks[block] = meta_alloc(superblock->i_start_blk + block, BLOCK_SIZE);
+		bio_read(superblock->i_start_blk + block, inode_blocks[block]);
+	}
+	return &inode_blocks[block][ino % INODES_PER_BLOCK];
+}
+
+int readi(uint32_t ino, struct inode *inode) {
+	if (ino >= superblock->inodes) {
+		return -1;
+	}
+	stats_mutex_lock(&itable_lock, STATS_LOCK_ITABLE);
+	memcpy(inode, load_inode_block(ino), sizeof(struct inode));
+	stats_mutex_unlock(&itable_lock, STATS_LOCK_ITABLE);
+	return 0;
+}
+
+int writei(uint32_t ino, struct inode *inode) {
+	if (ino >= superblock->inodes) {
+		return -1;
+	}
+	// The rest of the block is written back along with this inode, so it has to be resident too
+	int block = ino / INODES_PER_BLOCK;
+	stats_mutex_lock(&itable_lock, STATS_LOCK_ITABLE);
+	memcpy(load_inode_block(ino), inode, sizeof(struct inode));
+	if (!get_bitmap(inode_block_dirty, block)) {
+		set_bitmap(inode_block_dirty, block);
+		inode_dirty[inode_ndirty++] = block;
+	}
+	stats_mutex_unlock(&itable_lock, STATS_LOCK_ITABLE);
+	return 0;
+}
+
+/*
+ * An open file pins its inode: unlink leaves a pinned inode and its blocks
+ * alone and marks it TFS_ORPHAN_FL, and the release that unpins it last
+ * frees it. Pins are taken and checked with the inode lock held.
+ */
+static void inode_pin(uint32_t ino) {
+	stats_mutex_lock(&itable_lock, STATS_LOCK_ITABLE);
+	inode_opens[ino]++;
+	stats_mutex_unlock(&itable_lock, STATS_LOCK_ITABLE);
+}
+
+//Returns how many pins are left
+static int inode_unpin(uint32_t ino) {
+	stats_mutex_lock(&itable_lock, STATS_LOCK_ITABLE);
+	int opens = --inode_opens[ino];
+	stats_mutex_unlock(&itable_lock, STATS_LOCK_ITABLE);
+	return opens;
+}
+
+static int inode_pinned(uint32_t ino) {
+	stats_mutex_lock(&itable_lock, STATS_LOCK_ITABLE);
+	int opens = inode_opens[ino];
+	stats_mutex_unlock(&itable_lock, STATS_LOCK_ITABLE);
+	return opens > 0;
+}
+
+//Write every inode block holding a dirty inode back to disk, once per block
+int flush_inodes() {
+	int i;
+	stats_mutex_lock(&itable_lock, STATS_LOCK_ITABLE);
+	for (i = 0; i < inode_ndirty; i++) {
+		int block = inode_dirty[i];
+		unset_bitmap(inode_block_dirty, block);
+		bio_write(superblock->i_start_blk + block, inode_blocks[block]);
+	}
+	inode_ndirty = 0;
+	stats_mutex_unlock(&itable_lock, STATS_LOCK_ITABLE);
+	return 0;
+}
+
+
+/* 
+ * block mapping
+ */
+#define NUM_DIRECT		16
+#define PTRS_PER_BLOCK	(BLOCK_SIZE / sizeof(int))
+#define MAX_FILE_BLOCKS	(NUM_DIRECT + PTRS_PER_BLOCK + PTRS_PER_BLOCK * PTRS_PER_BLOCK)
+#define BMAP_CURSORS	64
+
+/*
+ * Mapping cursors keep the indirect blocks the last lookups of an inode went
+ * through: level 0 holds the double indirect block, level 1 the single
+ * indirect block pointing at data. Sequential lookups then only read an
+ * indirect block when they cross into the next one, and pointers set while
+ * allocating are written back once by bmap_sync() rather than per block.
+ * Cursors are a small direct-mapped table indexed by ino; the lock of a
+ * cursor is held while anything maps through it, and is recursive so the
+ * mapping functions can call each other.
+ */
+struct bmap_cursor {
+	pthread_mutex_t	lock;
+	int		ino;						/* inode the cursor belongs to, -1 if unused */
+	int		blkno[2];					/* data region block held at each level, -1 if none */
+	int		dirty[2];
+	int		ptrs[2][PTRS_PER_BLOCK];
+};
+
+struct bmap_cursor* bmap_cursors = NULL;
+
+void bmap_init() {
+	int i;
+	pthread_mutexattr_t attr;
+	pthread_mutexattr_init(&attr);
+	pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+	bmap_cursors = malloc(BMAP_CURSORS * sizeof(struct bmap_cursor));
+	for (i = 0; i < BMAP_CURSORS; i++) {
+		pthread_mutex_init(&bmap_cursors[i].lock, &attr);
+		bmap_cursors[i].ino = -1;
+		bmap_cursors[i].blkno[0] = bmap_cursors[i].blkno[1] = -1;
+		bmap_cursors[i].dirty[0] = bmap_cursors[i].dirty[1] = 0;
+	}
+	pthread_mutexattr_destroy(&attr);
+}
+
+static struct bmap_cursor* cursor_lock(uint32_t ino) {
+	struct bmap_cursor* cursor = &bmap_cursors[ino % BMAP_CURSORS];
+	pthread_mutex_lock(&cursor->lock);
+	return cursor;
+}
+
+static void cursor_unlock(struct bmap_cursor *cursor) {
+	pthread_mutex_unlock(&cursor->lock);
+}
+
+static void cursor_writeback(struct bmap_cursor *cursor, int level) {
+	if (cursor->dirty[level]) {
+		bio_write(superblock->d_start_blk + cursor->blkno[level], cursor->ptrs[level]);
+		cursor->dirty[level] = 0;
+	}
+}
+
+//Write back the pointers set through ino's cursor
+void bmap_sync(uint32_t ino) {
+	struct bmap_cursor* cursor = cursor_lock(ino);
+	if (cursor->ino == ino) {
+		cursor_writeback(cursor, 0);
+		cursor_writeback(cursor, 1);
+	}
+	cursor_unlock(cursor);
+}
+
+//Drop ino's cursor without writing it back, used once its blocks are freed
+static void bmap_forget(uint32_t ino) {
+	struct bmap_cursor* cursor = cursor_lock(ino);
+	if (cursor->ino == ino) {
+		cursor->ino = -1;
+		cursor->blkno[0] = cursor->blkno[1] = -1;
+		cursor->dirty[0] = cursor->dirty[1] = 0;
+	}
+	cursor_unlock(cursor);
+}
+
+void bmap_destroy() {
+	int i;
+	for (i = 0; i < BMAP_CURSORS; i++) {
+		if (bmap_cursors[i].ino != -1) {
+			bmap_sync(bmap_cursors[i].ino);
+		}
+		pthread_mutex_destroy(&bmap_cursors[i].lock);
+	}
+	free(bmap_cursors);
+	bmap_cursors = NULL;
+}
+
+static struct bmap_cursor* get_cursor(uint32_t ino) {
+	struct bmap_cursor* cursor = &bmap_cursors[ino % BMAP_CURSORS];
+	if (cursor->ino != ino) {
+		if (cursor->ino != -1) {
+			bmap_sync(cursor->ino);
+		}
+		cursor->ino = ino;
+		cursor->blkno[0] = cursor->blkno[1] = -1;
+	}
+	return cursor;
+}
+
+//Pointers of indirect block blkno at the given cursor level, read only if the cursor holds another block
+static int* cursor_load(struct bmap_cursor *cursor, int level, int blkno) {
+	if (cursor->blkno[level] != blkno) {
+		cursor_writeback(cursor, level);
+		bio_read(superblock->d_start_blk + blkno, cursor->ptrs[level]);
+		cursor->blkno[level] = blkno;
+	}
+	return cursor->ptrs[level];
+}
+
+//Allocate an empty indirect block straight into the cursor, it reaches the disk on writeback
+static int cursor_alloc(struct bmap_cursor *cursor, int level) {
+	int blkno = get_avail_blkno();
+	if (blkno < 0) {
+		return -1;
+	}
+	cursor_writeback(cursor, level);
+	memset(cursor->ptrs[level], -1, BLOCK_SIZE);
+	cursor->blkno[level] = blkno;
+	cursor->dirty[level] = 1;
+	return blkno;
+}
+
+//Inodes written before indirect blocks were used can hold garbage in indirect_ptr[]
+static void init_indirect(struct inode *inode) {
+	if (!(inode->flags & TFS_INDIRECT_FL)) {
+		memset(inode->indirect_ptr, -1, sizeof(inode->indirect_ptr));
+		inode->flags |= TFS_INDIRECT_FL;
+	}
+}
+
+/* 
+ * extent mapping
+ */
+#define EXT_ROOT_MAX	((sizeof(((struct inode *)0)->extent_root) - sizeof(struct extent_header)) / sizeof(struct extent))
+//leaves and index blocks alike, an extent_idx being the size of an extent
+#define EXT_BLOCK_MAX	((BLOCK_SIZE - sizeof(struct extent_header)) / sizeof(struct extent))
+#define EXT_DEPTH_MAX	3
+#define EXT_FIRST(hdr)	((struct extent *)((struct extent_header *)(hdr) + 1))
+
+_Static_assert(sizeof(struct extent_idx) == sizeof(struct extent), "index entries and extents share a node layout");
+//splits leave nodes at least half full, so a file runs out of blocks long before its tree runs out of depth
+_Static_assert(EXT_ROOT_MAX * (EXT_BLOCK_MAX / 2) * (EXT_BLOCK_MAX / 2) * (EXT_BLOCK_MAX / 2) >= MAX_FILE_BLOCKS,
+	"EXT_DEPTH_MAX levels can not map every block of a file");
+
+//Give inode an empty extent tree, its old block pointers are overwritten
+void ext_init(struct inode *inode) {
+	struct extent_header* root = (struct extent_header *)inode->extent_root;
+	memset(inode->extent_root, 0, sizeof(inode->extent_root));
+	root->magic = EXT_MAGIC;
+	root->max = EXT_ROOT_MAX;
+	root->depth = 0;
+	inode->flags |= TFS_EXTENTS_FL;
+}
+
+//Position of the last entry starting at or before lblk, -1 if lblk lies before all of them
+static int ext_search(struct extent *entries, int count, uint32_t lblk) {
+	int low = 0, high = count - 1;
+	while (low <= high) {
+		int mid = (low + high) / 2;
+		if (entries[mid].lblk <= lblk) {
+			low = mid + 1;
+		} else {
+			high = mid - 1;
+		}
+	}
+	return high;
+}
+
+/*
+ * The nodes a lookup went through, indexed by depth: node[0] is the leaf
+ * and node[root depth] the root. The leaf is loaded into level 1 of the
+ * inode's mapping cursor, index blocks between it and the root are read
+ * into buf, which ext_path_release() frees.
+ */
+struct ext_path {
+	struct extent_header*	node[EXT_DEPTH_MAX + 1];
+	int						blkno[EXT_DEPTH_MAX + 1];	/* data region block of each node, -1 for the root */
+	int						pos[EXT_DEPTH_MAX + 1];		/* index entry taken at each depth above 0 */
+	uint32_t				end;						/* first lblk past what the leaf covers */
+	struct bmap_cursor*		cursor;						/* NULL while the root is the leaf */
+	char*					buf;
+};
+
+//Walk from the root to the leaf lblk belongs in, which is returned
+static struct extent_header* ext_find(struct inode *inode, uint32_t lblk, struct ext_path *path) {
+	struct extent_header* node = (struct extent_header *)inode->extent_root;
+	int depth = node->depth;
+	path->node[depth] = node;
+	path->blkno[depth] = -1;
+	path->end = MAX_FILE_BLOCKS;
+	path->cursor = NULL;
+	path->buf = depth > 1 ? malloc((size_t)(depth - 1) * BLOCK_SIZE) : NULL;
+	while (depth > 0) {
+		struct extent_idx* idx = (struct extent_idx *)EXT_FIRST(node);
+		int pos = ext_search(EXT_FIRST(node), node->entries, lblk);
+		if (pos < 0) {
+			pos = 0;
+		}
+		//the bound one level down is never past the one above
+		if (pos + 1 < node->entries) {
+			path->end = idx[pos + 1].lblk;
+		}
+		path->pos[depth] = pos;
+		depth--;
+		if (depth == 0) {
+			path->cursor = get_cursor(inode->ino);
+			node = (struct extent_header *)cursor_load(path->cursor, 1, idx[pos].child);
+		} else {
+			node = (struct extent_header *)(path->buf + (size_t)(depth - 1) * BLOCK_SIZE);
+			bio_read(superblock->d_start_blk + idx[pos].child, node);
+		}
+		path->node[depth] = node;
+		path->blkno[depth] = idx[pos].child;
+	}
+	return node;
+}
+
+static void ext_path_release(struct ext_path *path) {
+	free(path->buf);
+}
+
+//Node at depth of path has changed: the leaf is written back with the cursor, index blocks now, the root with the inode
+static void ext_dirty(struct ext_path *path, int depth) {
+	if (path->blkno[depth] == -1) {
+		return;
+	}
+	if (depth == 0) {
+		path->cursor->dirty[1] = 1;
+	} else {
+		bio_write(superblock->d_start_blk + path->blkno[depth], path->node[depth]);
+	}
+}
+
+/*
+ * Push the root's entries, extents or index entries, down into a new
+ * block and make the root index just that block, one level deeper. New
+ * blocks are built in level 0 of the cursor, unused by extent inodes.
+ */
+static int ext_grow(struct inode *inode) {
+	struct extent_header* root = (struct extent_header *)inode->extent_root;
+	if (root->depth == EXT_DEPTH_MAX) {
+		return -1;
+	}
+	struct bmap_cursor* cursor = get_cursor(inode->ino);
+	int blkno = cursor_alloc(cursor, 0);
+	if (blkno < 0) {
+		return -1;
+	}
+	struct extent_header* node = (struct extent_header *)cursor->ptrs[0];
+	memcpy(node, root, sizeof(struct extent_header) + root->entries * sizeof(struct extent));
+	node->max = EXT_BLOCK_MAX;
+	cursor_writeback(cursor, 0);
+	cursor->blkno[0] = -1;
+
+	struct extent_idx* idx = (struct extent_idx *)EXT_FIRST(root);
+	root->depth++;
+	root->entries = 1;
+	idx[0].lblk = 0;
+	idx[0].child = blkno;
+	idx[0].unused = 0;
+	return 0;
+}
+
+/*
+ * Make room next to the full node at depth of path, whose parent has room
+ * for one more entry. Appending past the end of the file starts an empty
+ * leaf at lblk, or an index block with just the last entry, so files
+ * written sequentially fill their nodes; otherwise the upper half of the
+ * node moves to the new one.
+ */
+static int ext_split(struct inode *inode, struct ext_path *path, int depth, uint32_t lblk, int append) {
+	struct extent_header* node = path->node[depth];
+	struct extent_header* parent = path->node[depth + 1];
+	struct extent_idx* idx = (struct extent_idx *)EXT_FIRST(parent);
+	int ipos = path->pos[depth + 1];
+	struct bmap_cursor* cursor = get_cursor(inode->ino);
+	int blkno = cursor_alloc(cursor, 0);
+	if (blkno < 0) {
+		return -1;
+	}
+	struct extent_header* next = (struct extent_header *)cursor->ptrs[0];
+	next->magic = EXT_MAGIC;
+	next->max = EXT_BLOCK_MAX;
+	next->depth = depth;
+	int keep = append ? node->entries - (depth > 0) : node->entries / 2;
+	next->entries = node->entries - keep;
+	if (next->entries > 0) {
+		memcpy(EXT_FIRST(next), EXT_FIRST(node) + keep, next->entries * sizeof(struct extent));
+		node->entries = keep;
+		lblk = EXT_FIRST(next)[0].lblk;
+		ext_dirty(path, depth);
+	}
+	cursor_writeback(cursor, 0);
+	cursor->blkno[0] = -1;
+
+	memmove(&idx[ipos + 2], &idx[ipos + 1], (parent->entries - ipos - 1) * sizeof(struct extent_idx));
+	idx[ipos + 1].lblk = lblk;
+	idx[ipos + 1].child = blkno;
+	idx[ipos + 1].unused = 0;
+	parent->entries++;
+	ext_dirty(path, depth + 1);
+	return 0;
+}
+
+/*
+ * Add the extent lblk -> pblk of len blocks. When its leaf is full, the
+ * full node below the lowest ancestor with room is split, or the root
+ * pushed down if every node on the way is full, and the walk is retried.
+ */
+static int ext_insert(struct inode *inode, uint32_t lblk, uint32_t pblk, uint32_t len) {
+	struct extent_header* root = (struct extent_header *)inode->extent_root;
+	for (;;) {
+		struct ext_path path;
+		struct extent_header* leaf = ext_find(inode, lblk, &path);
+		struct extent* ext = EXT_FIRST(leaf);
+		int pos = ext_search(ext, leaf->entries, lblk) + 1;
+
+		if (leaf->entries < leaf->max) {
+			memmove(&ext[pos + 1], &ext[pos], (leaf->entries - pos) * sizeof(struct extent));
+			ext[pos].lblk = lblk;
+			ext[pos].pblk = pblk;
+			ext[pos].len = len;
+			leaf->entries++;
+			ext_dirty(&path, 0);
+			ext_path_release(&path);
+			return 0;
+		}
+		int depth = 0;
+		while (depth < root->depth && path.node[depth + 1]->entries == path.node[depth + 1]->max) {
+			depth++;
+		}
+		int append = pos == leaf->entries && path.end == MAX_FILE_BLOCKS;
+		int ret = depth == root->depth ? ext_grow(inode) : ext_split(inode, &path, depth, lblk, append);
+		ext_path_release(&path);
+		if (ret < 0) {
+			return -1;
+		}
+	}
+}
+
+/*
+ * Extent counterpart of map_block(). With run non-NULL, *run is set to the
+ * number of blocks from lblk on that are mapped contiguously, or for a hole
+ * the number that are unmapped. If lblk is in a hole, up to create blocks
+ * of it are allocated at once, asking for the blocks after the preceding
+ * extent so that it can simply grow.
+ */
+static int ext_map(struct inode *inode, int lblk, int create, int *run) {
+	struct ext_path path;
+	struct extent_header* leaf = ext_find(inode, lblk, &path);
+	struct extent* ext = EXT_FIRST(leaf);
+	int pos = ext_search(ext, leaf->entries, lblk);
+
+	if (pos >= 0 && lblk < ext[pos].lblk + ext[pos].len) {
+		if (run != NULL) {
+			*run = ext[pos].lblk + ext[pos].len - lblk;
+		}
+		ext_path_release(&path);
+		return ext[pos].pblk + (lblk - ext[pos].lblk);
+	}
+
+	int hole = (pos + 1 < leaf->entries ? ext[pos + 1].lblk : path.end) - lblk;
+	if (run != NULL) {
+		*run = hole;
+	}
+	if (!create) {
+		ext_path_release(&path);
+		return -1;
+	}
+
+	int goal = pos >= 0 ? (int)(ext[pos].pblk + ext[pos].len) : -1;
+	int got;
+	int blkno = get_avail_blknos(goal, create < hole ? create : hole, &got);
+	if (blkno >= 0 && pos >= 0 && ext[pos].lblk + ext[pos].len == (uint32_t)lblk && blkno == goal) {
+		ext[pos].len += got;
+		ext_dirty(&path, 0);
+		ext_path_release(&path);
+	} else {
+		ext_path_release(&path);
+		if (blkno < 0) {
+			return -1;
+		}
+		if (ext_insert(inode, lblk, blkno, got) < 0) {
+			while (got > 0) {
+				release_blkno(blkno + --got);
+			}
+			return -1;
+		}
+	}
+	if (run != NULL) {
+		*run = got;
+	}
+	return blkno;
+}
+
+//Release every block mapped under node, and the tree blocks below it
+static void ext_free_node(struct extent_header *node) {
+	int i;
+	uint32_t k;
+	if (node->depth == 0) {
+		struct extent* ext = EXT_FIRST(node);
+		for (i = 0; i < node->entries; i++) {
+			for (k = 0; k < ext[i].len; k++) {
+				release_blkno(ext[i].pblk + k);
+			}
+		}
+		return;
+	}
+	struct extent_idx* idx = (struct extent_idx *)EXT_FIRST(node);
+	struct extent_header* child = malloc(BLOCK_SIZE);
+	for (i = 0; i < node->entries; i++) {
+		bio_read(superblock->d_start_blk + idx[i].child, child);
+		ext_free_node(child);
+		release_blkno(idx[i].child);
+	}
+	free(child);
+}
+
+static void ext_free(struct inode *inode) {
+	ext_free_node((struct extent_header *)inode->extent_root);
+	ext_init(inode);
+}
+
+/*
+ * Map logical block lblk of inode to a data region block number, or -1 if
+ * it has none. Blocks 0-15 come from direct_ptr[], the next PTRS_PER_BLOCK
+ * from the single indirect block in indirect_ptr[0] and the rest from the
+ * double indirect block in indirect_ptr[1]. With create set the missing
+ * blocks are allocated; the caller writes the inode back and calls
+ * bmap_sync() when done. The inode's cursor lock must be held.
+ */
+static int cursor_map(struct inode *inode, int lblk, int create) {
+	if (lblk < 0 || lblk >= MAX_FILE_BLOCKS) {
+		return -1;
+	}
+	if (inode->flags & TFS_EXTENTS_FL) {
+		return ext_map(inode, lblk, create, NULL);
+	}
+	if (lblk < NUM_DIRECT) {
+		if (inode->direct_ptr[lblk] == -1 && create) {
+			inode->direct_ptr[lblk] = get_avail_blkno();
+		}
+		return inode->direct_ptr[lblk];
+	}
+
+	init_indirect(inode);
+	struct bmap_cursor* cursor = get_cursor(inode->ino);
+	int* ptrs;
+	lblk -= NUM_DIRECT;
+	if (lblk < PTRS_PER_BLOCK) {
+		if (inode->indirect_ptr[0] == -1) {
+			if (!create || (inode->indirect_ptr[0] = cursor_alloc(cursor, 1)) == -1) {
+				return -1;
+			}
+		}
+		ptrs = cursor_load(cursor, 1, inode->indirect_ptr[0]);
+	} else {
+		lblk -= PTRS_PER_BLOCK;
+		if (inode->indirect_ptr[1] == -1) {
+			if (!create || (inode->indirect_ptr[1] = cursor_alloc(cursor, 0)) == -1) {
+				return -1;
+			}
+		}
+		int* top = cursor_load(cursor, 0, inode->indirect_ptr[1]);
+		int index = lblk / PTRS_PER_BLOCK;
+		lblk %= PTRS_PER_BLOCK;
+		if (top[index] == -1) {
+			if (!create || (top[index] = cursor_alloc(cursor, 1)) == -1) {
+				return -1;
+			}
+			cursor->dirty[0] = 1;
+		}
+		ptrs = cursor_load(cursor, 1, top[index]);
+	}
+
+	if (ptrs[lblk] == -1 && create) {
+		ptrs[lblk] = get_avail_blkno();
+		if (ptrs[lblk] != -1) {
+			cursor->dirty[1] = 1;
+		}
+	}
+	return ptrs[lblk];
+}
+
+static int map_block(struct inode *inode, int lblk, int create) {
+	struct bmap_cursor* cursor = cursor_lock(inode->ino);
+	int blkno = cursor_map(inode, lblk, create);
+	cursor_unlock(cursor);
+	return blkno;
+}
+
+/*
+ * Map lblk like map_block() and set *run to how many blocks from lblk on,
+ * at most count, follow it contiguously on disk (for a hole, how many are
+ * unmapped), so callers can move them with one bio_read_range() or
+ * bio_write_range(). With create set the whole run is allocated.
+ */
+static int map_run(struct inode *inode, int lblk, int count, int create, int *run) {
+	int blkno, n;
+	struct bmap_cursor* cursor = cursor_lock(inode->ino);
+	if ((inode->flags & TFS_EXTENTS_FL) && lblk >= 0 && lblk < MAX_FILE_BLOCKS) {
+		//a hole gets the rest of the run reserved with one allocation
+		blkno = ext_map(inode, lblk, create ? count : 0, run);
+		if (*run > count) {
+			*run = count;
+		}
+		cursor_unlock(cursor);
+		return blkno;
+	}
+	blkno = cursor_map(inode, lblk, create);
+	for (n = 1; n < count; n++) {
+		if (blkno == -1 && create) {
+			break;
+		}
+		int next = cursor_map(inode, lblk + n, create);
+		if (blkno == -1 ? next != -1 : next != blkno + n) {
+			break;
+		}
+	}
+	cursor_unlock(cursor);
+	*run = n;
+	return blkno;
+}
+
+/*
+ * Map lblk for a write, allocating it if need be. *fresh is set when it
+ * had to be allocated: whatever the block held belonged to some earlier
+ * file, so the caller zero-fills around its data rather than reading it.
+ */
+static int map_write_block(struct inode *inode, int lblk, int *fresh) {
+	*fresh = map_block(inode, lblk, 0) == -1;
+	return map_block(inode, lblk, 1);
+}
+
+//Give a regular file with no blocks the block map it gets at creation
+static void inode_map_init(struct inode *inode) {
+	inode->flags &= ~TFS_INLINE_FL;
+	if (superblock->features & TFS_FEATURE_EXTENTS) {
+		ext_init(inode);
+	} else {
+		memset(inode->direct_ptr, -1, sizeof(inode->direct_ptr));
+		memset(inode->indirect_ptr, -1, sizeof(inode->indirect_ptr));
+		inode->flags |= TFS_INDIRECT_FL;
+	}
+}
+
+/*
+ * Small files keep their data in the inode, in place of the block map,
+ * until a write reaches past TFS_INLINE_MAX. Then the data moves out to
+ * the file's first block and the file gets a block map like any other.
+ * Called with the inode lock held exclusively; -ENOSPC leaves it inline.
+ */
+#define TFS_INLINE_MAX	sizeof(((struct inode *)0)->inline_data)
+
+static int inline_expand(struct inode *inode) {
+	char data[TFS_INLINE_MAX];
+	memcpy(data, inode->inline_data, sizeof(data));
+	inode_map_init(inode);
+	if (inode->size == 0) {
+		return 0;
+	}
+	int fresh;
+	int blkno = map_write_block(inode, 0, &fresh);
+	if (blkno < 0) {
+		memcpy(inode->inline_data, data, sizeof(data));
+		inode->flags = (inode->flags & ~(TFS_EXTENTS_FL | TFS_INDIRECT_FL)) | TFS_INLINE_FL;
+		return -ENOSPC;
+	}
+	char* block = calloc(1, BLOCK_SIZE);
+	memcpy(block, data, inode->size);
+	bio_write(superblock->d_start_blk + blkno, block);
+	free(block);
+	return 0;
+}
+
+//Make a block of data to write: zeroes around it if fresh, otherwise what the block held
+static void merge_block(int block_number, int fresh, void *block, int block_offset, const char *data, size_t len) {
+	if (block_offset == 0 && len == BLOCK_SIZE) {
+		//overwritten whole, nothing to keep
+	} else if (fresh) {
+		memset(block, 0, block_offset);
+		memset((char *)block + block_offset + len, 0, BLOCK_SIZE - block_offset - len);
+	} else {
+		bio_read(block_number, block);
+	}
+	if (data != NULL) {
+		memcpy((char *)block + block_offset, data, len);
+	}
+}
+
+int bmap(struct inode *inode, int lblk, int create) {
+	int blkno = map_block(inode, lblk, create);
+	if (create) {
+		bmap_sync(inode->ino);
+	}
+	return blkno;
+}
+
+//Release the blocks listed in indirect block blkno, and the block itself
+static void free_indirect(int blkno, int depth) {
+	int i;
+	int* ptrs = malloc(BLOCK_SIZE);
+	bio_read(superblock->d_start_blk + blkno, ptrs);
+	for (i = 0; i < PTRS_PER_BLOCK; i++) {
+		if (ptrs[i] == -1) {
+			continue;
+		}
+		if (depth > 1) {
+			free_indirect(ptrs[i], depth - 1);
+		} else {
+			release_blkno(ptrs[i]);
+		}
+	}
+	free(ptrs);
+	release_blkno(blkno);
+}
+
+//Release every data block of inode, including its indirect blocks, in the data bitmap
+void free_inode_blocks(struct inode *inode) {
+	int i;
+	if (inode->flags & TFS_INLINE_FL) {
+		memset(inode->inline_data, 0, sizeof(inode->inline_data));
+		return;
+	}
+	struct bmap_cursor* cursor = cursor_lock(inode->ino);
+	if (inode->flags & TFS_EXTENTS_FL) {
+		//leaves held by the cursor may not have been written back
+		bmap_sync(inode->ino);
+		ext_free(inode);
+		bmap_forget(inode->ino);
+		cursor_unlock(cursor);
+		return;
+	}
+	for (i = 0; i < NUM_DIRECT; i++) {
+		if (inode->direct_ptr[i] != -1) {
+			release_blkno(inode->direct_ptr[i]);
+			inode->direct_ptr[i] = -1;
+		}
+	}
+	//the cursor may hold pointers that were never written back
+	bmap_sync(inode->ino);
+	init_indirect(inode);
+	for (i = 0; i < 2; i++) {
+		if (inode->indirect_ptr[i] != -1) {
+			free_indirect(inode->indirect_ptr[i], i + 1);
+			inode->indirect_ptr[i] = -1;
+		}
+	}
+	bmap_forget(inode->ino);
+	cursor_unlock(cursor);
+}
+
+
+/* 
+ * directory block operations
+ */
+
+//The record after rec in a block of dirents, the first one for NULL, NULL after the last
+static struct dirent_rec* dirblk_next(void *block, struct dirent_rec *rec) {
+	size_t j = rec == NULL ? 0 : (char *)rec - (char *)block + rec->rec_len;
+	if (j + sizeof(struct dirent_rec) > BLOCK_SIZE) {
+		return NULL;
+	}
+	rec = (struct dirent_rec *)((char *)block + j);
+	return rec->rec_len != 0 ? rec : NULL;
+}
+
+//Bytes taken by the records of a block of dirents
+static size_t dirblk_used(void *block) {
+	struct dirent_rec* rec = NULL;
+	size_t used = 0;
+	while ((rec = dirblk_next(block, rec)) != NULL) {
+		used += rec->rec_len;
+	}
+	return used;
+}
+
+//Find the entry called name in a block of dirents
+static struct dirent_rec* dirblk_find(void *block, const char *name, size_t name_len) {
+	struct dirent_rec* rec = NULL;
+	while ((rec = dirblk_next(block, rec)) != NULL) {
+		if (rec->name_len == name_len && memcmp(name, rec->name, name_len) == 0) {
+			return rec;
+		}
+	}
+	return NULL;
+}
+
+//Put an entry after the last one in a block of dirents, -1 if the block is full
+static int dirblk_add(void *block, uint32_t ino, const char *name, size_t name_len, uint8_t type) {
+	size_t used = dirblk_used(block);
+	size_t rec_len = DIRENT_REC_LEN(name_len);
+	if (used + rec_len > BLOCK_SIZE) {
+		return -1;
+	}
+	struct dirent_rec* rec = (struct dirent_rec *)((char *)block + used);
+	memset(rec, 0, rec_len);
+	rec->ino = ino;
+	rec->rec_len = rec_len;
+	rec->name_len = name_len;
+	rec->type = type;
+	memcpy(rec->name, name, name_len);
+	return 0;
+}
+
+//Take rec out of its block of dirents, moving the records after it down
+static void dirblk_remove(void *block, struct dirent_rec *rec) {
+	size_t used = dirblk_used(block);
+	size_t start = (char *)rec - (char *)block;
+	size_t rec_len = rec->rec_len;
+	memmove(rec, (char *)rec + rec_len, used - start - rec_len);
+	memset((char *)block + used - rec_len, 0, rec_len);
+}
+
+//Number of entries in a block of dirents
+static int dirblk_count(void *block) {
+	struct dirent_rec* rec = NULL;
+	int count = 0;
+	while ((rec = dirblk_next(block, rec)) != NULL) {
+		count++;
+	}
+	return count;
+}
+
+static void dirent_set(struct dirent *dirent, uint32_t ino, const char *name, size_t name_len, uint8_t type) {
+	memset(dirent, 0, sizeof(struct dirent));
+	dirent->ino = ino;
+	dirent->valid = 1;
+	dirent->type = type;
+	dirent->len = name_len;
+	memcpy(dirent->name, name, name_len);
+}
+
+//Fill in the dirent a record stands for
+static void dirent_from_rec(struct dirent *dirent, struct dirent_rec *rec) {
+	dirent_set(dirent, rec->ino, rec->name, rec->name_len, rec->type);
+}
+
+/*
+ * Directory blocks as the original tfs wrote them: an array of fixed-size
+ * dirents with a 16-bit inode number, and no file type.
+ */
+struct dirent_fixed {
+	uint16_t	ino;
+	uint16_t	valid;
+	char		name[208];
+	uint16_t	len;
+};
+
+#define DIRENTS_OLD_MAX	(BLOCK_SIZE / sizeof(struct dirent_fixed))	/* entries in such a block */
+
+//Read the entries of a directory block in the old format into entries, returning how many there are
+static int dirblk_read_old(void *block, struct dirent *entries) {
+	struct dirent_fixed* old = block;
+	int count = 0;
+	size_t j;
+	//slots were only laid out while a whole one fit before the end of the block
+	for (j = 0; (j + 1) * sizeof(struct dirent_fixed) < BLOCK_SIZE; j++) {
+		if (old[j].valid == 1) {
+			dirent_set(&entries[count++], old[j].ino, old[j].name, strnlen(old[j].name, sizeof(old[j].name) - 1), TFS_FT_UNKNOWN);
+		}
+	}
+	return count;
+}
+
+static int dir_read_block(struct inode *dir_inode, int lblk, void *buf) {
+	int blkno = bmap(dir_inode, lblk, 0);
+	if (blkno < 0) {
+		return -1;
+	}
+	return bio_read(superblock->d_start_blk + blkno, buf);
+}
+
+static int dir_write_block(struct inode *dir_inode, int lblk, const void *buf) {
+	int blkno = bmap(dir_inode, lblk, 1);
+	if (blkno < 0) {
+		return -ENOSPC;
+	}
+	return bio_write(superblock->d_start_blk + blkno, buf);
+}
+
+
+/* 
+ * hashed directory index
+ */
+#define DX_ROOT_LIMIT	((BLOCK_SIZE - sizeof(struct dx_root)) / sizeof(struct dx_entry))
+#define DX_NODE_LIMIT	((BLOCK_SIZE - sizeof(struct dx_node)) / sizeof(struct dx_entry))
+#define DIRENTS_PER_BLOCK	(BLOCK_SIZE / DIRENT_REC_LEN(1))
+
+//FNV-1a, part of the on-disk format: changing it breaks existing indexed directories
+static uint32_t dx_hash(const char *name, size_t name_len) {
+	uint32_t hash = 2166136261u;
+	size_t i;
+	for (i = 0; i < name_len; i++) {
+		hash = (hash ^ (unsigned char)name[i]) * 16777619u;
+	}
+	return hash;
+}
+
+//Index of the entry whose hash range holds hash
+static int dx_search(struct dx_entry *entries, int count, uint32_t hash) {
+	int low = 1;
+	int high = count - 1;
+	while (low <= high) {
+		int mid = (low + high) / 2;
+		if (entries[mid].hash <= hash) {
+			low = mid + 1;
+		} else {
+			high = mid - 1;
+		}
+	}
+	return low - 1;
+}
+
+static void dx_insert_entry(struct dx_entry *entries, uint32_t *count, int pos, uint32_t hash, uint32_t block) {
+	memmove(&entries[pos + 1], &entries[pos], (*count - pos) * sizeof(struct dx_entry));
+	entries[pos].hash = hash;
+	entries[pos].block = block;
+	(*count)++;
+}
+
+/*
+ * Walk the index of dir_inode down to the leaf covering hash. The root and
+ * (for two level indexes) the node are left in the caller's buffers along
+ * with the positions taken in them, so an insert can update them.
+ */
+static int dx_find_leaf(struct inode *dir_inode, uint32_t hash, struct dx_root *root, int *root_pos,
+		struct dx_node *node, int *node_pos) {
+	dir_read_block(dir_inode, 0, root);
+	if (root->magic != DX_ROOT_MAGIC || root->count == 0) {
+		return -1;
+	}
+	*root_pos = dx_search(root->entries, root->count, hash);
+	if (root->levels == 0) {
+		return root->entries[*root_pos].block;
+	}
+	dir_read_block(dir_inode, root->entries[*root_pos].block, node);
+	if (node->magic != DX_NODE_MAGIC || node->count == 0) {
+		return -1;
+	}
+	*node_pos = dx_search(node->entries, node->count, hash);
+	return node->entries[*node_pos].block;
+}
+
+struct dx_sort_entry {
+	uint32_t		hash;
+	struct dirent	dirent;
+};
+
+static int compare_dx_sort_entries(const void *a, const void *b) {
+	uint32_t ha = ((const struct dx_sort_entry *)a)->hash;
+	uint32_t hb = ((const struct dx_sort_entry *)b)->hash;
+	return ha < hb ? -1 : ha > hb;
+}
+
+/*
+ * Add an entry to an indexed directory. When the leaf it hashes to is full
+ * the leaf is split at a hash boundary (entries with equal hashes always
+ * stay in one leaf, so lookups only ever visit one) and the new leaf is
+ * added to the index, growing the root into a second level or splitting
+ * a node as needed.
+ */
+static int dx_add(struct inode *dir_inode, uint32_t f_ino, const char *fname, size_t name_len, uint8_t type) {
+	uint32_t hash = dx_hash(fname, name_len);
+	struct dx_root* root = malloc(BLOCK_SIZE);
+	struct dx_node* node = malloc(BLOCK_SIZE);
+	struct dx_node* new_node = malloc(BLOCK_SIZE);
+	void* leaf = malloc(BLOCK_SIZE);
+	void* new_leaf = malloc(BLOCK_SIZE);
+	struct dx_sort_entry* sorted = NULL;
+	int root_pos = 0, node_pos = 0;
+	int retval = 0;
+
+	int leaf_lblk = dx_find_leaf(dir_inode, hash, root, &root_pos, node, &node_pos);
+	if (leaf_lblk < 0) {
+		retval = -EIO;
+		goto out;
+	}
+	dir_read_block(dir_inode, leaf_lblk, leaf);
+	if (dirblk_add(leaf, f_ino, fname, name_len, type) == 0) {
+		dir_write_block(dir_inode, leaf_lblk, leaf);
+		goto out;
+	}
+
+	//leaf is full, make sure the index has room for one more leaf before touching anything
+	int grow_root = root->levels == 0 && root->count >= DX_ROOT_LIMIT;
+	int split_node = root->levels == 1 && node->count >= DX_NODE_LIMIT;
+	if (split_node && root->count >= DX_ROOT_LIMIT) {
+		retval = -ENOSPC;
+		goto out;
+	}
+	uint32_t new_leaf_lblk = root->nblocks;
+	uint32_t new_node_lblk = root->nblocks + 1;
+	if (bmap(dir_inode, new_leaf_lblk, 1) < 0
+			|| ((grow_root || split_node) && bmap(dir_inode, new_node_lblk, 1) < 0)) {
+		retval = -ENOSPC;
+		goto out;
+	}
+
+	//sort the leaf's entries plus the new one by hash and pick a split point between two hashes
+	sorted = malloc((DIRENTS_PER_BLOCK + 1) * sizeof(struct dx_sort_entry));
+	int count = 0;
+	int j;
+	struct dirent_rec* rec = NULL;
+	while ((rec = dirblk_next(leaf, rec)) != NULL) {
+		dirent_from_rec(&sorted[count].dirent, rec);
+		sorted[count].hash = dx_hash(rec->name, rec->name_len);
+		count++;
+	}
+	memset(&sorted[count].dirent, 0, sizeof(struct dirent));
+	sorted[count].hash = hash;
+	sorted[count].dirent.valid = 1;
+	sorted[count].dirent.ino = f_ino;
+	sorted[count].dirent.type = type;
+	sorted[count].dirent.len = name_len;
+	memcpy(sorted[count].dirent.name, fname, name_len);
+	count++;
+	qsort(sorted, count, sizeof(struct dx_sort_entry), compare_dx_sort_entries);
+
+	//records differ in size, so the halves are split by bytes rather than entries
+	size_t total = 0, below = 0;
+	for (j = 0; j < count; j++) {
+		total += DIRENT_REC_LEN(sorted[j].dirent.len);
+	}
+	int split = 0;
+	while (split < count - 1 && (split == 0 || below < total / 2)) {
+		below += DIRENT_REC_LEN(sorted[split].dirent.len);
+		split++;
+	}
+	while (split < count && sorted[split].hash == sorted[split - 1].hash) {
+		split++;
+	}
+	if (split == count) {
+		split = count / 2;
+		while (split > 0 && sorted[split].hash == sorted[split - 1].hash) {
+			split--;
+		}
+	}
+	if (split == 0) {
+		//every entry in the leaf has the same hash
+		retval = -ENOSPC;
+		goto out;
+	}
+
+	memset(leaf, 0, BLOCK_SIZE);
+	memset(new_leaf, 0, BLOCK_SIZE);
+	for (j = 0; j < count; j++) {
+		struct dirent* entry = &sorted[j].dirent;
+		if (dirblk_add(j < split ? leaf : new_leaf, entry->ino, entry->name, entry->len, entry->type) < 0) {
+			//so many long names share a hash that one side still overflows
+			retval = -ENOSPC;
+			goto out;
+		}
+	}
+	dir_write_block(dir_inode, leaf_lblk, leaf);
+	dir_write_block(dir_inode, new_leaf_lblk, new_leaf);
+	root->nblocks++;
+
+	uint32_t split_hash = sorted[split].hash;
+	if (root->levels == 0 && !grow_root) {
+		dx_insert_entry(root->entries, &root->count, root_pos + 1, split_hash, new_leaf_lblk);
+	} else if (grow_root) {
+		//move the root's entries down into a node, the root now points at that node
+		node->magic = DX_NODE_MAGIC;
+		node->count = root->count;
+		memcpy(node->entries, root->entries, root->count * sizeof(struct dx_entry));
+		dx_insert_entry(node->entries, &node->count, root_pos + 1, split_hash, new_leaf_lblk);
+		dir_write_block(dir_inode, new_node_lblk, node);
+		root->levels = 1;
+		root->count = 1;
+		root->entries[0].hash = 0;
+		root->entries[0].block = new_node_lblk;
+		root->nblocks++;
+	} else if (!split_node) {
+		dx_insert_entry(node->entries, &node->count, node_pos + 1, split_hash, new_leaf_lblk);
+		dir_write_block(dir_inode, root->entries[root_pos].block, node);
+	} else {
+		//split the full node in half and hang the upper half off the root
+		int half = node->count / 2;
+		new_node->magic = DX_NODE_MAGIC;
+		new_node->count = node->count - half;
+		memcpy(new_node->entries, &node->entries[half], new_node->count * sizeof(struct dx_entry));
+		node->count = half;
+		if (node_pos + 1 <= half) {
+			dx_insert_entry(node->entries, &node->count, node_pos + 1, split_hash, new_leaf_lblk);
+		} else {
+			dx_insert_entry(new_node->entries, &new_node->count, node_pos + 1 - half, split_hash, new_leaf_lblk);
+		}
+		dir_write_block(dir_inode, root->entries[root_pos].block, node);
+		dir_write_block(dir_inode, new_node_lblk, new_node);
+		dx_insert_entry(root->entries, &root->count, root_pos + 1, new_node->entries[0].hash, new_node_lblk);
+		root->nblocks++;
+	}
+	dir_write_block(dir_inode, 0, root);
+
+out:
+	free(sorted);
+	free(root);
+	free(node);
+	free(new_node);
+	free(leaf);
+	free(new_leaf);
+	return retval;
+}
+
+/*
+ * Turn a linear directory into an indexed one: its entries are read into
+ * memory and re-added under a fresh root with a single empty leaf, in
+ * newly allocated blocks. The old blocks are released only once every
+ * entry is in the index; if the index cannot be built, its blocks are
+ * released instead and dir_inode is left the linear directory it was.
+ */
+static int dx_convert(struct inode *dir_inode) {
+	struct dirent* entries = malloc(NUM_DIRECT * DIRENTS_PER_BLOCK * sizeof(struct dirent));
+	void* block = malloc(BLOCK_SIZE);
+	struct inode linear = *dir_inode;
+	int count = 0;
+	int i;
+	int retval = 0;
+
+	for (i = 0; i < NUM_DIRECT; i++) {
+		if (dir_inode->direct_ptr[i] == -1) {
+			continue;
+		}
+		bio_read(superblock->d_start_blk + dir_inode->direct_ptr[i], block);
+		struct dirent_rec* rec = NULL;
+		while ((rec = dirblk_next(block, rec)) != NULL) {
+			dirent_from_rec(&entries[count++], rec);
+		}
+	}
+
+	memset(dir_inode->direct_ptr, -1, sizeof(dir_inode->direct_ptr));
+	init_indirect(dir_inode);
+	dir_inode->flags |= TFS_INDEX_FL;
+
+	struct dx_root* root = block;
+	memset(root, 0, BLOCK_SIZE);
+	root->magic = DX_ROOT_MAGIC;
+	root->levels = 0;
+	root->nblocks = 2;
+	root->count = 1;
+	root->entries[0].hash = 0;
+	root->entries[0].block = 1;
+	if (dir_write_block(dir_inode, 0, root) < 0) {
+		retval = -ENOSPC;
+		goto fail;
+	}
+	memset(block, 0, BLOCK_SIZE);
+	if (dir_write_block(dir_inode, 1, block) < 0) {
+		retval = -ENOSPC;
+		goto fail;
+	}
+
+	for (i = 0; i < count && retval == 0; i++) {
+		retval = dx_add(dir_inode, entries[i].ino, entries[i].name, entries[i].len, entries[i].type);
+	}
+	if (retval < 0) {
+		goto fail;
+	}
+
+	for (i = 0; i < NUM_DIRECT; i++) {
+		if (linear.direct_ptr[i] != -1) {
+			release_blkno(linear.direct_ptr[i]);
+		}
+	}
+	goto out;
+
+fail:
+	free_inode_blocks(dir_inode);
+	*dir_inode = linear;
+out:
+	free(entries);
+	free(block);
+	return retval;
+}
+
+
+/* 
+ * directory operations
+ */
+
+/*
+ * Find the data block (data region number) holding name in dir_inode and
+ * read it into block, -1 if the name is not there. Indexed directories go
+ * straight to the one leaf the name hashes to, linear ones are scanned.
+ */
+static int dir_locate(struct inode *dir_inode, const char *fname, size_t name_len, void *block, struct dirent_rec **entry) {
+	int i;
+	if (dir_inode->flags & TFS_INDEX_FL) {
+		struct dx_root* root = malloc(BLOCK_SIZE);
+		struct dx_node* node = malloc(BLOCK_SIZE);
+		int root_pos, node_pos;
+		int blkno = -1;
+		int leaf_lblk = dx_find_leaf(dir_inode, dx_hash(fname, name_len), root, &root_pos, node, &node_pos);
+		free(root);
+		free(node);
+		if (leaf_lblk >= 0) {
+			blkno = bmap(dir_inode, leaf_lblk, 0);
+		}
+		if (blkno < 0) {
+			return -1;
+		}
+		bio_read(superblock->d_start_blk + blkno, block);
+		*entry = dirblk_find(block, fname, name_len);
+		return *entry != NULL ? blkno : -1;
+	}
+
+	for (i = 0; i < NUM_DIRECT; i++) {
+		if (dir_inode->direct_ptr[i] == -1) {
+			continue;
+		}
+		bio_read(superblock->d_start_blk + dir_inode->direct_ptr[i], block);
+		*entry = dirblk_find(block, fname, name_len);
+		if (*entry != NULL) {
+			return dir_inode->direct_ptr[i];
+		}
+	}
+	return -1;
+}
+
+int dir_find(uint32_t ino, const char *fname, size_t name_len, struct dirent *dirent) {
+	// Step 1: Call readi() to get the inode using ino (inode number of current directory)
+	struct inode dir_inode;
+	readi(ino, &dir_inode);
+
+	// Step 2: Get data block of current directory from inode
+	// Step 3: Read directory's data block and check each directory entry.
+	//If the name matches, then copy directory entry to dirent structure
+	void* current_data_block = malloc(BLOCK_SIZE);
+	struct dirent_rec* entry = NULL;
+	int found = dir_locate(&dir_inode, fname, name_len, current_data_block, &entry);
+	if (found >= 0 && dirent != NULL) { //if we're calling dir_find for dir_remove/dir_add, don't copy anything
+		dirent_from_rec(dirent, entry);
+	}
+	free(current_data_block);
+	return found >= 0 ? 0 : -1;
+}
+
+int dir_add(struct inode dir_inode, uint32_t f_ino, const char *fname, size_t name_len) {
+	if (name_len >= sizeof(((struct dirent *)0)->name)) {
+		return -ENAMETOOLONG;
+	}
+	//if the dirent already exists, return -EEXIST
+	if (dir_find(dir_inode.ino, fname, name_len, NULL) == 0){ 
+		return -EEXIST;
+	}
+
+	//store the file type in the entry so lookups and readdir don't need the inode
+	struct inode f_inode;
+	readi(f_ino, &f_inode);
+	uint8_t entry_type = f_inode.type == 0 ? TFS_FT_DIR : TFS_FT_REG;
+
+	int retval = -ENOSPC;
+	if (dir_inode.flags & TFS_INDEX_FL) {
+		retval = dx_add(&dir_inode, f_ino, fname, name_len, entry_type);
+	} else {
+		// Step 1: Read dir_inode's data block and check each directory entry of dir_inode
+		void* current_data_block = malloc(BLOCK_SIZE);
+		int z;
+		int has_blocks = 0;
+		for (z = 0; z < NUM_DIRECT && retval < 0; z++){
+			if(dir_inode.direct_ptr[z] == -1){
+				continue;
+			}
+			has_blocks = 1;
+			int block_number = superblock->d_start_blk + dir_inode.direct_ptr[z];
+			bio_read(block_number, current_data_block);
+			// Step 3: Add directory entry in dir_inode's data block and write to disk
+			if (dirblk_add(current_data_block, f_ino, fname, name_len, entry_type) == 0) {
+				bio_write(block_number, current_data_block);
+				retval = 0;
+			}
+		}
+
+		if (retval < 0 && !has_blocks) {
+			//empty directory, start it off with a single block of dirents
+			int new_data_block_number = get_avail_blkno();
+			if (new_data_block_number != -1) {
+				memset(current_data_block, 0, BLOCK_SIZE);
+				dirblk_add(current_data_block, f_ino, fname, name_len, entry_type);
+				bio_write(superblock->d_start_blk + new_data_block_number, current_data_block);
+				dir_inode.direct_ptr[0] = new_data_block_number;
+				retval = 0;
+			}
+		} else if (retval < 0) {
+			//every block is full, the directory outgrows linear scanning and gets an index
+			retval = dx_convert(&dir_inode);
+			if (retval == 0) {
+				retval = dx_add(&dir_inode, f_ino, fname, name_len, entry_type);
+			}
+		}
+		free(current_data_block);
+	}
+	if (retval < 0) {
+		//an index keeps the blocks it mapped before running out of space, so its inode still has to be written
+		if (dir_inode.flags & TFS_INDEX_FL) {
+			writei(dir_inode.ino, &dir_inode);
+		}
+		return retval;
+	}
+
+	// Update directory inode, whose size is the bytes its records take
+	dir_inode.size += DIRENT_REC_LEN(name_len);
+	dir_inode.mtime = dir_inode.ctime = now_ns();
+	//update link here
+	dir_inode.link += 1;
+	writei(dir_inode.ino, &dir_inode);
+
+	//the name now resolves, replacing any negative entry for it
+	dcache_add(dir_inode.ino, fname, name_len, f_ino);
+	return 0;
+}
+
+int dir_remove(struct inode dir_inode, const char *fname, size_t name_len) {
+	// Step 1: Read dir_inode's data block and checks each directory entry of dir_inode
+	// Step 2: Check if fname exist
+	void* current_data_block = malloc(BLOCK_SIZE);
+	struct dirent_rec* entry = NULL;
+	int blkno = dir_locate(&dir_inode, fname, name_len, current_data_block, &entry);
+	if (blkno < 0) {
+		//we cannot find the dirent
+		free(current_data_block);
+		return -1;
+	}
+
+	// Step 3: If exist, then remove it from dir_inode's data block and write to disk
+	//the inode it names is the caller's to free, once the name is gone
+	dirblk_remove(current_data_block, entry);
+	bio_write(superblock->d_start_blk + blkno, current_data_block);
+
+	//an empty block of a linear directory is not needed anymore, indexed directories keep their leaves
+	if (!(dir_inode.flags & TFS_INDEX_FL) && dirblk_count(current_data_block) == 0) {
+		int i;
+		for (i = 0; i < NUM_DIRECT; i++) {
+			if (dir_inode.direct_ptr[i] == blkno) {
+				release_blkno(blkno);
+				dir_inode.direct_ptr[i] = -1;
+			}
+		}
+	}
+
+	dir_inode.link--;
+	dir_inode.size -= DIRENT_REC_LEN(name_len);
+	dir_inode.mtime = dir_inode.ctime = now_ns();
+	writei(dir_inode.ino, &dir_inode);
 
-	// Step 3: Write inode to disk 
-	bio_write(inode_block_index, buffer);
-	//printf("finished writei\n");
-	//printf("-------------------------\n");
+	free(current_data_block);
+	dcache_add(dir_inode.ino, fname, name_len, DCACHE_NEGATIVE);
 	return 0;
 }
 
-
-/* 
- * directory operations
+/*
+ * Data region numbers of the blocks holding dirents in dir_inode, in
+ * on-disk order; *count is set to how many. Index blocks are skipped.
  */
-int dir_find(uint16_t ino, const char *fname, size_t name_len, struct dirent *dirent) {
-	//printf("----------------------\n");
-	//printf("entered dir_find\n");
-	//printf("ino: %d\n fname: %s\n name_len: %d\n", ino, fname, name_len);
-    // Step 1: Call readi() to get the inode using ino (inode number of current directory)
-
-	//printf("reading directory inode...\n");
-	struct inode dir_inode;
-	readi(ino, &dir_inode);
-	//printf("read directory inode: %d\n", dir_inode.ino);
-	//Step 2: iterate over every dirent and find if matches
+static int* dir_blocks(struct inode *dir_inode, int *count) {
 	int i;
-	int foundDir = -1;
+	*count = 0;
+	if (!(dir_inode->flags & TFS_INDEX_FL)) {
+		int* blocks = malloc(NUM_DIRECT * sizeof(int));
+		for (i = 0; i < NUM_DIRECT; i++) {
+			if (dir_inode->direct_ptr[i] != -1) {
+				blocks[(*count)++] = dir_inode->direct_ptr[i];
+			}
+		}
+		return blocks;
+	}
 
-	//allocate space for current data block being read
-	void* current_data_block = malloc(BLOCK_SIZE);
-	for(i = 0; i < 16; i++){
-		int current_data_block_index = superblock->d_start_blk + dir_inode.direct_ptr[i];
-		//printf("current datablock index at dir_inode.direct_ptr[%d]: %d\n", i, current_data_block_index);
-		if(dir_inode.direct_ptr[i]== -1){
-			//printf("found invalid data block...ignore\n");
+	struct dx_root* root = malloc(BLOCK_SIZE);
+	dir_read_block(dir_inode, 0, root);
+	int nblocks = root->magic == DX_ROOT_MAGIC ? root->nblocks : 0;
+	int* blocks = malloc((nblocks + 1) * sizeof(int));
+	for (i = 1; i < nblocks; i++) {
+		int blkno = bmap(dir_inode, i, 0);
+		if (blkno < 0) {
 			continue;
 		}
-		
-		bio_read(current_data_block_index, current_data_block);
-
-		int j = 0;
-		while(j + sizeof(struct dirent) < BLOCK_SIZE){
-			//void* address_of_dir_entry = block->data + j;
-			void* address_of_dir_entry = current_data_block + j;
-			struct dirent current_entry;
-			memcpy(&current_entry, address_of_dir_entry, sizeof(struct dirent));
-
-			if(strcmp(fname, current_entry.name) == 0 && current_entry.valid == 1){
-				if(dirent != NULL){ //if we're calling dir_find for dir_remove/dir_add, don't copy anything
-					memcpy(dirent, address_of_dir_entry, sizeof(struct dirent));
-				}
-				//if name matches, we found the target directory entry
-				foundDir = 0;
-				break;
-			}
+		//dx_node blocks start with a magic no dirent can have
+		bio_read(superblock->d_start_blk + blkno, root);
+		if (*(uint32_t *)root != DX_NODE_MAGIC) {
+			blocks[(*count)++] = blkno;
+		}
+	}
+	free(root);
+	return blocks;
+}
+
+/* 
+ * namei operation
+ */
 
-			j = j + sizeof(struct dirent);
-			
+/*
+ * Walk path one component at a time starting from directory ino. Each
+ * (directory, name) step is answered from the dentry cache when possible,
+ * and only looked up in the directory blocks on a miss; misses that find
+ * nothing are cached as negative entries. A miss holds the directory's lock
+ * shared until its result is cached, so it cannot cache a name as missing
+ * after a concurrent create has added it.
+ */
+int get_node_by_path(const char *path, uint32_t ino, struct inode *inode) {
+	struct inode current_inode;
+	char name[sizeof(((struct dirent *)0)->name)];
+	const char *component = path;
 
+	readi(ino, &current_inode);
+	for (;;) {
+		while (*component == '/') {
+			component++;
 		}
-		//this logic is kind of messy but we can change later
-		if(foundDir){
+		if (*component == '\0') {
 			break;
 		}
-	}
-	free(current_data_block);
-	//printf("----------------------\n");
-	if(foundDir == 0){
-		//we found the dirent
-		return 0;
-	}
-	//could not find dirent
-	return -1;
-
-	
-  	// Step 2: Get data block of current directory from inode
+		const char *end = strchr(component, '/');
+		size_t name_len = end != NULL ? (size_t)(end - component) : strlen(component);
+		if (name_len >= sizeof(name)) {
+			return -ENAMETOOLONG;
+		}
+		//only directories can have another component underneath them
+		if (current_inode.type != 0) {
+			return -ENOENT;
+		}
 
-  	// Step 3: Read directory's data block and check each directory entry.
-  	//If the name matches, then copy directory entry to dirent structure
+		int next_ino;
+		if (!dcache_lookup(ino, component, name_len, &next_ino)) {
+			struct dirent dirent;
+			memcpy(name, component, name_len);
+			name[name_len] = '\0';
+			inode_lock_shared(ino);
+			next_ino = dir_find(ino, name, name_len, &dirent) == 0 ? dirent.ino : -1;
+			dcache_add(ino, component, name_len, next_ino < 0 ? DCACHE_NEGATIVE : next_ino);
+			inode_unlock(ino);
+		}
+		if (next_ino < 0) {
+			return -ENOENT;
+		}
+		ino = next_ino;
+		readi(ino, &current_inode);
+		component += name_len;
+	}
 
+	memcpy(inode, &current_inode, sizeof(struct inode));
+	return 0; //found the elusive inode, stored inside *inode
 }
 
-int dir_add(struct inode dir_inode, uint16_t f_ino, const char *fname, size_t name_len) {
-	//printf("-------------------\n");
-	//printf("entered dir_add\n");
-	//if the dirent already exists, return -1
-	
-	if (dir_find(dir_inode.ino, fname, strlen(fname), NULL) == 0){ 
-		//printf("Cannot dir_add, duplicate detected\n");
-		//printf("-------------------\n");
-		return -EEXIST;
+//Lock directory ino exclusively and reload it, -ENOENT if it was removed before we got the lock
+static int lock_dir(uint32_t ino, struct inode *dir_inode) {
+	inode_lock_excl(ino);
+	readi(ino, dir_inode);
+	if (dir_inode->valid != 1 || dir_inode->type != 0) {
+		inode_unlock(ino);
+		return -ENOENT;
 	}
-	//printf("dirent does not exist, okay to add\n");
-	
-	// Step 1: Read dir_inode's data block and check each directory entry of dir_inode
-	
-
-	// Step 3: Add directory entry in dir_inode's data block and write to disk
-	
+	return 0;
+}
 
-	int found_data_block_number =-1;
-	void* found_block = NULL;
 
-	//reserve space to read in the data blocks 
-	void* current_data_block = malloc(BLOCK_SIZE);
-	int z = 0;
-	for (z = 0; z < 16; z++){
-		//printf("checking directptr[%d]]\n", z);
-		//check if directptr[j] has enough space for our directory. if so, add using offset
-		//we also know directptr[j] refers to a data block that only has dirents, we just want a dirent that has valid = 0
-
-		//as soon as we see a -1, we know that we've already considered all available data blocks
-		if(dir_inode.direct_ptr[z] == -1){
-			//printf("found invalid datablock...ignore and continue trying to find a valid one\n");
-			continue;
-		}
-		bio_read(dir_inode.direct_ptr[z] + superblock->d_start_blk, current_data_block);
-		int j = 0;
-	
-		while(j + sizeof(struct dirent) < BLOCK_SIZE){
-			
-			void* address_of_dir_entry = current_data_block + j;
-			//printf("current address of dir entry: %p\n", address_of_dir_entry);
-			//struct dirent current_entry;
-			struct dirent *current_entry = (struct dirent*) address_of_dir_entry;
-			//memcpy(&current_entry, address_of_dir_entry, sizeof(struct dirent));
-			//printf("copied dirent into current_entry\n");
-
-			if(current_entry->valid == 0){
-				//printf("found an invalid dirent\n");
-				//not valid, we found an unoccupied one
-				current_entry->valid = 1;
-				current_entry->ino = f_ino;
-				current_entry->len = name_len;
-				int i = 0;
-				while(i < name_len){
-					current_entry->name[i] = *(fname + i);
-					i++;
-				}
-				current_entry->name[i] = '\0';				
-				
-				//save info about the found data block
-				found_data_block_number = dir_inode.direct_ptr[z] + superblock->d_start_blk;
-				found_block = current_data_block;
-				//memcpy(new_data_block + j, &new_dirent, sizeof(struct dirent));
-				memcpy(current_data_block + j, current_entry, sizeof(struct dirent));
-				break;
-			}
+/* 
+ * Make file system
+ */
+/*
+ * Open files. open and create hand out a struct tfs_file, holding the
+ * inode it was opened on, pinned, and what is kept per open across the
+ * requests made through it. Those requests find the inode through the
+ * handle and never walk the path again.
+ */
+struct tfs_file {
+	uint32_t		ino;				/* inode the file was opened on */
+	pthread_mutex_t	lock;				/* reads through one file only share the inode lock */
+	int				written;			/* written through since the last flush */
+	off_t			next_offset;		/* where a sequential read would carry on */
+	int				ra_size;			/* readahead window in blocks, 0 while reads are random */
+	int				ra_next;			/* first block not read ahead yet */
+	char			*report;			/* for a stats file, what it read when opened */
+	size_t			report_len;
+};
 
-			j = j + sizeof(struct dirent);
-			
-		}
-		if(found_data_block_number > 0){
-			break;
-		}
+//Called with the inode locked; NULL if out of memory
+static struct tfs_file* file_open(uint32_t ino) {
+	struct tfs_file* file = calloc(1, sizeof(struct tfs_file));
+	if (file != NULL) {
+		file->ino = ino;
+		pthread_mutex_init(&file->lock, NULL);
+		inode_pin(ino);
 	}
+	return file;
+}
 
-	void* new_data_block = malloc(BLOCK_SIZE);
-	int new_data_block_number= -1;
-	//if we ended up not finding a invalid dirent in the available data blocks, find a new data block
-
-	if (found_data_block_number == -1){ 
-		//printf("did not find available data block for new directory entry\n");
-		//new data block created
-		int j = 0;
-		//printf("GETTING AVAILABLE BLOCK NUM FOR NEW DIRECTORY ENTRY '%s'...\n", fname);
-		new_data_block_number = get_avail_blkno();
-		//printf("new block number: %d\n", new_data_block_number);
-		while(j + sizeof(struct dirent) < BLOCK_SIZE){
-			//printf("populating block with a dirent...\n");
-			//fill new data block with invalid dirents 
-			struct dirent new_dirent = {0, 0, "", 0};
-			//new_dirent->valid = -1;
-			//new_dirent->ino = -1;
-			//new_dirent->name[0] = '\0';
-			//new_dirent->len = 0;
-			//printf("new_dirent valid = %d\nnew_dirent ino=%d\nnew_dirent name=%s\nnew_dirent len=%d\n", new_dirent.valid, new_dirent.ino, new_dirent.name, new_dirent.len);
-			memcpy(new_data_block + j, &new_dirent, sizeof(struct dirent));
-			
-
-			struct dirent assert;
-			memcpy(&assert, new_data_block + j, sizeof(struct dirent));
-			//printf("Checking dirent at address %d to add\n", new_data_block + j);
-			//printf("assert.valid = %d\nassert.ino=%d\nassert.name=%s\nassert.len=%d\n", assert.valid, assert.ino, assert.name, assert.len);
-			j = j + sizeof(struct dirent);
-			//free(new_dirent);
-		}
-		//set first dirent to valid
-		struct dirent* first_dirent = (struct dirent*) new_data_block;
-		first_dirent->valid = 1;
-		first_dirent->ino = f_ino;
-		first_dirent->len = name_len;
-		int i = 0;
-		while(i < name_len){
-			first_dirent->name[i] = *(fname + i);
-			i++;
-		}
-		first_dirent->name[i] = '\0';
-		//memcpy(new_data_block, &first_dirent, sizeof(struct dirent));
-		//add the new block index to the directptr array
-		int a;
-		for(a = 0; a < 16; a++){
-			if(dir_inode.direct_ptr[a] == -1){
-				//printf("adding new block number %d to direct_ptr index %d\n for inode %d\n", new_data_block_number, a, dir_inode.ino);
-				dir_inode.direct_ptr[a] = new_data_block_number;
-				//printf("dir_inode.direct_ptr[%d] = %d\n", a, dir_inode.direct_ptr[a]);
-				break;
-			}
-		}
+//Note a write through file, for the next flush
+static void file_written(struct tfs_file *file) {
+	if (file != NULL) {
+		pthread_mutex_lock(&file->lock);
+		file->written = 1;
+		pthread_mutex_unlock(&file->lock);
 	}
+}
 
-	// Update directory inode
-	dir_inode.size += sizeof(struct dirent);
-	dir_inode.vstat.st_size += sizeof(struct dirent);
-	//update link here
-	dir_inode.link += 1;
-	//update stat here
-	
-	//printf("writing changes for directory inode to disk\n");
-	writei(dir_inode.ino, &dir_inode);
+static void file_release(struct tfs_file *file) {
+	if (file == NULL) {
+		return;
+	}
+	if (file->report != NULL) {
+		pthread_mutex_destroy(&file->lock);
+		free(file->report);
+		free(file);
+		return;
+	}
 
-	// Write directory entry
-	if(found_data_block_number > 0){
-		//printf("writing to existing data block %d...\n", found_data_block_number);
-		bio_write(found_data_block_number, found_block);
+	//the last release of a file unlinked while it was open frees it
+	struct inode inode;
+	inode_lock_excl(file->ino);
+	readi(file->ino, &inode);
+	if (inode_unpin(file->ino) == 0 && (inode.flags & TFS_ORPHAN_FL)) {
+		free_inode_blocks(&inode);
+		release_ino(inode.ino);
+		inode.valid = 0;
+		inode.flags &= ~TFS_ORPHAN_FL;
+		writei(inode.ino, &inode);
+		flush_bitmaps();
+		orphans_count(-1);
 	}
-	else{
+	inode_unlock(file->ino);
 
-		int j = 0;
-		while(j + sizeof(struct dirent) < BLOCK_SIZE){
-			struct dirent* copied_dirent = (struct dirent *)(new_data_block + j);
-			//printf("copied dirent's validity: %d\n", copied_dirent->valid);
-			j = j + sizeof(struct dirent);
-		}
-		//printf("writing to a new data block %d...\n", new_data_block_number);
-		bio_write(new_data_block_number + superblock->d_start_blk, new_data_block);
-		
+	pthread_mutex_destroy(&file->lock);
+	free(file);
+}
+
+/*
+ * Stats files. /.tfs_stats (text) and /.tfs_stats.json have no inode:
+ * open takes a report of the counters kept by stats.c into the handle and
+ * reads are served from it, so a reader sees one report however it splits
+ * its reads. They are read-only, can not be made or removed, and are to be
+ * read direct_io (see tfs_direct_io()), as their size is only known once
+ * they are open.
+ */
+#define STATS_FILE		"/.tfs_stats"
+#define STATS_FILE_JSON	"/.tfs_stats.json"
+
+//1 for the text stats file, 2 for the JSON one, 0 for any other path
+static int stats_file(const char *path) {
+	if (strcmp(path, STATS_FILE) == 0) {
+		return 1;
 	}
-	
-	//we also have to write the updated inode table 
+	return strcmp(path, STATS_FILE_JSON) == 0 ? 2 : 0;
+}
 
-	free(current_data_block);
-	free(new_data_block);
+static void stats_file_attr(struct stat *stbuf) {
+	struct timespec now = ns_to_timespec(now_ns());
+	memset(stbuf, 0, sizeof(*stbuf));
+	stbuf->st_mode = S_IFREG | 0444;
+	stbuf->st_nlink = 1;
+	stbuf->st_uid = getuid();
+	stbuf->st_gid = getgid();
+	stbuf->st_blksize = BLOCK_SIZE;
+	stbuf->st_atim = stbuf->st_mtim = stbuf->st_ctim = now;
+}
 
-	//printf("-------------------\n");
+static int stats_file_open(int which, int flags, struct tfs_file **filep) {
+	if ((flags & O_ACCMODE) != O_RDONLY) {
+		return -EACCES;
+	}
+	struct tfs_file* file = calloc(1, sizeof(struct tfs_file));
+	if (file == NULL || (file->report = stats_report(which == 2, &file->report_len)) == NULL) {
+		free(file);
+		return -ENOMEM;
+	}
+	pthread_mutex_init(&file->lock, NULL);
+	*filep = file;
 	return 0;
 }
 
+//Copy up to size bytes of an open stats file's report from offset, returns how many
+static size_t stats_file_read(struct tfs_file *file, char *buffer, size_t size, off_t offset) {
+	if (offset >= (off_t)file->report_len) {
+		return 0;
+	}
+	if (size > file->report_len - offset) {
+		size = file->report_len - offset;
+	}
+	memcpy(buffer, file->report + offset, size);
+	return size;
+}
 
+/*
+ * The inode as the original tfs wrote it: 256 bytes, with the host's
+ * struct stat, of which only st_size and the root's st_mode were ever set.
+ * Only direct_ptr[] was used.
+ */
+struct inode_stat {
+	uint16_t	ino;
+	uint16_t	valid;
+	uint32_t	size;
+	uint32_t	type;
+	uint32_t	link;
+	int			direct_ptr[16];
+	int			indirect_ptr[8];
+	struct stat	vstat;
+};
 
-int dir_remove(struct inode dir_inode, const char *fname, size_t name_len) {
-	//printf("-------------------\n");
-	//printf("entered dir_remove\n");
-	
-
-	// Step 1: Read dir_inode's data block and checks each directory entry of dir_inode
-	int found_dirent_to_remove = 0;
-	//allocate space for current data block being read
-	void* current_data_block = malloc(BLOCK_SIZE);
+/*
+ * Rewrite the inode table of a file system made by the original tfs in the
+ * 128-byte format, in place at the front of the old table. Inodes get the
+ * mode, owner and times getattr used to make up for them. Which inodes are
+ * in use is taken from the bitmap: the original tfs made the root without
+ * setting valid, and only wrote the root's bit once a file was created.
+ */
+static void inodes_convert() {
+	int old_blocks = (superblock->inodes * sizeof(struct inode_stat) + BLOCK_SIZE - 1) / BLOCK_SIZE;
+	struct inode_stat* old = malloc((size_t)old_blocks * BLOCK_SIZE);
+	struct inode* table = calloc(INODE_BLOCKS, BLOCK_SIZE);
+	int64_t now = now_ns();
 	int i;
-	for(i = 0; i < 16; i++){
-		
-		int data_block_empty = 1;
-		int current_data_block_index = superblock->d_start_blk + dir_inode.direct_ptr[i];
-		if(dir_inode.direct_ptr[i] == -1){
-			continue;
-		}
-		//printf("current_data_block_index = %d\n", current_data_block);
-		bio_read(current_data_block_index, current_data_block);
-
-		int j = 0;
-		while(j + sizeof(struct dirent) < BLOCK_SIZE){
-			//void* address_of_dir_entry = block->data + j;
-			void* address_of_dir_entry = current_data_block + j;
-			struct dirent current_entry;
-			memcpy(&current_entry, address_of_dir_entry, sizeof(struct dirent));
-			if(strcmp(fname, current_entry.name) == 0){// found the dirent we want to remove
-				//printf("found dirent we want to remove\n");
-				found_dirent_to_remove = 1;
-				current_entry.valid = 0;
-				//clear data blocks 
-				//update data bitmap
-				//make the inode invalid and update inode bitmap
-				struct inode inode;
-				readi(current_entry.ino, &inode);
-				inode.valid = 0;
-				unset_bitmap(inode_bitmap, inode.ino);
-
-				//write bitmaps to disk
-				bio_write(superblock->i_bitmap_blk, inode_bitmap);
-				bio_write(superblock->d_bitmap_blk, data_region_bitmap);
-
-				//write inode block to disk
-				writei(current_entry.ino, &inode);
-				dir_inode.link--;
-				dir_inode.size -= sizeof(struct dirent);
-				dir_inode.vstat.st_size -= sizeof(struct dirent);
-				writei(dir_inode.ino, &dir_inode);
-			
-				
-				memcpy(current_data_block + j, &current_entry, sizeof(struct dirent));
-				//write cleared datablock to disk
-				bio_write(current_data_block_index, current_data_block);
-				 
-			}
-			else if(current_entry.valid == 1){
-				data_block_empty = 0;
-			}
-
-			j = j + sizeof(struct dirent);
-			
-
-		}
-		if(data_block_empty == 1){
-			//entire data block is empty, we don't need it anymore
-			//printf("unsetting this bit: %d at inode %d at block %d\n", get_bitmap(data_region_bitmap, dir_inode.direct_ptr[i]), dir_inode.ino, dir_inode.direct_ptr[i]);
 
-			unset_bitmap(data_region_bitmap, dir_inode.direct_ptr[i]);
-			dir_inode.direct_ptr[i] = -1;
-			writei(dir_inode.ino, &dir_inode);
-			bio_write(2, data_region_bitmap);
+	for (i = 0; i < old_blocks; i++) {
+		bio_read(superblock->i_start_blk + i, (char *)old + (size_t)i * BLOCK_SIZE);
+	}
+	if (!get_bitmap(inode_bitmap.bits, 0)) {
+		bitmap_take(&inode_bitmap, 0);
+	}
+	for (i = 0; i < superblock->inodes; i++) {
+		struct inode_stat* o = &old[i];
+		struct inode* inode = &table[i];
+		int live = get_bitmap(inode_bitmap.bits, i);
+		//the root is a directory however much of it was left unset
+		int type = i == 0 ? 0 : o->type;
+		inode->ino = i;
+		inode->valid = live;
+		inode->type = type;
+		inode->link = o->link;
+		inode->size = o->vstat.st_size;
+		inode->mode = type == 0 ? S_IFDIR | 0755 : S_IFREG | 0644;
+		inode->uid = getuid();
+		inode->gid = getgid();
+		inode->atime = inode->mtime = inode->ctime = now;
+		if (!live) {
+			memset(inode->direct_ptr, -1, sizeof(inode->direct_ptr));
+		} else {
+			memcpy(inode->direct_ptr, o->direct_ptr, sizeof(inode->direct_ptr));
 		}
-		
+		//the original tfs never set indirect_ptr[]
+		memset(inode->indirect_ptr, -1, sizeof(inode->indirect_ptr));
+		inode->flags = TFS_INDIRECT_FL;
 	}
-	if(found_dirent_to_remove == 1){
-		//printf("-------------------\n");
-		return 0;
+	for (i = 0; i < INODE_BLOCKS; i++) {
+		bio_write(superblock->i_start_blk + i, (char *)table + (size_t)i * BLOCK_SIZE);
 	}
-	//we cannot find the dirent
-	//printf("cannot find dirent to remove\n");
-	//printf("-------------------\n");
-
-	return -1;
-	// Step 2: Check if fname exist
+	superblock->features |= TFS_FEATURE_INODE128;
+	bio_write(0, superblock);
+	flush_bitmaps();
 
-	// Step 3: If exist, then remove it from dir_inode's data block and write to disk
+	free(old);
+	free(table);
 }
 
-/* 
- * namei operation
+/*
+ * Rewrite the directories of a file system made by the original tfs as
+ * today's records. The new records can take more room than the old
+ * entries did, so rather than convert blocks in place, a directory's
+ * entries are read into memory, its blocks released, and the entries
+ * added back, leaving it as it would be had they been made now.
  */
-int get_node_by_path(const char *path, uint16_t ino, struct inode *inode) {
-	//printf("---------------------------------------\n");
-	//printf("get node by path called\n");
-	//base case we call with path "/"
-	if (strcmp(path, "/") == 0){
-		//printf("found root inode\n");
-		readi(0, inode);
-		//printf("---------------------------------------\n");
-		return 0;
-	}
-	//ignore the first character, which is '/'
-	const char* truncatedPath = path+1;
-	int i;
-	int index = -1;
-	//find the index of the first occurrence of '/'
-	for (i = 0; i < strlen(truncatedPath); i++){
-		if (truncatedPath[i] == '/'){
-			index = i;
-			break;
+static int dirs_convert() {
+	struct inode inode;
+	void* block = malloc(BLOCK_SIZE);
+	struct dirent* entries = NULL;
+	int ino, i;
+	int retval = 0;
+	for (ino = 0; ino < superblock->inodes && retval == 0; ino++) {
+		//in use is what the bitmap says, as inodes_convert() left it
+		if (!get_bitmap(inode_bitmap.bits, ino)) {
+			continue;
+		}
+		readi(ino, &inode);
+		if (inode.type != 0) {
+			continue;
+		}
+		int nblocks, count = 0;
+		int* blocks = dir_blocks(&inode, &nblocks);
+		entries = realloc(entries, ((size_t)nblocks * DIRENTS_OLD_MAX + 1) * sizeof(struct dirent));
+		for (i = 0; i < nblocks; i++) {
+			bio_read(superblock->d_start_blk + blocks[i], block);
+			count += dirblk_read_old(block, entries + count);
+		}
+		free(blocks);
+
+		//dir_add counts each entry back into the link count and size
+		free_inode_blocks(&inode);
+		inode.flags &= ~TFS_INDEX_FL;
+		inode.link = 0;
+		inode.size = 0;
+		writei(ino, &inode);
+		for (i = 0; i < count && retval == 0; i++) {
+			readi(ino, &inode);
+			retval = dir_add(inode, entries[i].ino, entries[i].name, entries[i].len);
+		}
+		if (retval < 0) {
+			fprintf(stderr, "no space to convert directory %d\n", ino);
 		}
 	}
-	//if we could not find one, end of filepath i.e /test
-	if (index == -1){
-		index = strlen(truncatedPath);
-	}
-
-	//get name of directory 
-	//printf("index: %d\n", index);
-	char* directory_name = malloc(index+1);
-	memcpy(directory_name, truncatedPath, index);
-	directory_name[index] = '\0';
-	//printf("path passed in: %s\n", path);
-	//printf("name of directory: %s\n", directory_name);
+	free(entries);
+	free(block);
+	flush_bitmaps();
+	return retval;
+}
 
-	//get the inode of the directory 
-	//printf("reading inode for ino %d...\n", ino);
-	struct inode current_inode;
-	readi(ino, &current_inode);
-	//printf("current inode number: %d\n", current_inode.ino);
-	int next_ino = -1;
-	void* current_data_block = malloc(BLOCK_SIZE);
-	for (i = 0; i < 16; i++){
-		int current_data_block_index = superblock->d_start_blk + current_inode.direct_ptr[i];
-		//printf("looking at data block %d...\n", current_data_block_index);
-		if(current_inode.direct_ptr[i] == -1){
+//Free files that were unlinked while open when the file system last went down
+static void orphans_reclaim() {
+	struct inode inode;
+	int ino;
+	for (ino = 0; ino < superblock->inodes; ino++) {
+		if (!get_bitmap(inode_bitmap.bits, ino)) {
 			continue;
 		}
-		
-		bio_read(current_data_block_index, current_data_block);
-		int j = 0;
-		struct inode* inode_of_current_entry = malloc(sizeof(*inode_of_current_entry));
-		while(j+sizeof(struct dirent) < BLOCK_SIZE){
-			//printf("current offset: %d\n", j);
-			//go through each dirent in the current block
-			//void* address_of_dir_entry = block->data + j;
-			void* address_of_dir_entry = current_data_block + j;
-			struct dirent current_entry;
-			memcpy(&current_entry, address_of_dir_entry, sizeof(struct dirent));
-
-			
-			readi(current_entry.ino, inode_of_current_entry);
-			//printf("current dirent ino: %d\ncurrent dirent validity: %d\ncurrent dirent name: %s\n", current_entry.ino, current_entry.valid, current_entry.name);
-			//printf("inode type: %d\n", inode_of_current_entry->type);
-			//printf("checking: %s == %s\n", directory_name, current_entry.name);
-			
-			//printf("string compare difference: %d\n", strcmp(directory_name, current_entry.name));
-			//checking if we found it and that we're done
-
-			//current directory entry has to be valid
-			if(current_entry.valid == 1){
-				//directory entry name has to match
-				if(strcmp(directory_name, current_entry.name) == 0 && strstr(truncatedPath, "/") == NULL){
-					//dirent is found, and we're at the end of filepath
-					memcpy(inode, inode_of_current_entry, sizeof(struct inode));
-					free(inode_of_current_entry);
-					//printf("Found target inode! Get node by path returning...\n");
-					return 0;
-				} 
-				//found it, have another directory to go into
-				else if(strcmp(directory_name, current_entry.name) == 0 && inode_of_current_entry->type < 1){
-					//printf("found dirent but need to recurse further\n");
-					//dirent is found
-					next_ino = current_entry.ino;
-					//printf("next ino number: %d\n", next_ino);
-					break;				
-				}
-			}
-			
-			j = j + sizeof(struct dirent);
+		readi(ino, &inode);
+		if (inode.valid == 1 && (inode.flags & TFS_ORPHAN_FL)) {
+			free_inode_blocks(&inode);
+			release_ino(inode.ino);
+			inode.valid = 0;
+			inode.flags &= ~TFS_ORPHAN_FL;
+			writei(inode.ino, &inode);
 		}
-		free(inode_of_current_entry);
-		
+	}
+	flush_bitmaps();
+	superblock->orphans = 0;
+	bio_write(0, superblock);
+}
 
-		if(next_ino != -1){
-			break;
+/*
+ * Readahead. A read that starts where the last read through the same open
+ * file stopped doubles the file's window, from RA_MIN_BLOCKS up to
+ * readahead_kb, and any other read closes it. While it is open, the blocks
+ * from the end of the read to a window past it are started in the
+ * background whenever less than half a window of them is already on its
+ * way, into the block cache or, for zero-copy reads, the disk file's page
+ * cache. Called with the inode lock held.
+ */
+#define RA_MIN_BLOCKS	4
+
+static void file_readahead(struct tfs_file *file, struct inode *inode, off_t offset, size_t size, int to_cache) {
+	int max_blocks = config.readahead_kb / (BLOCK_SIZE / 1024);
+	if (file == NULL || max_blocks < RA_MIN_BLOCKS || (inode->flags & TFS_INLINE_FL)) {
+		return;
+	}
+
+	pthread_mutex_lock(&file->lock);
+	if (offset == file->next_offset) {
+		file->ra_size = file->ra_size == 0 ? RA_MIN_BLOCKS : file->ra_size * 2;
+		if (file->ra_size > max_blocks) {
+			file->ra_size = max_blocks;
 		}
+	} else {
+		file->ra_size = 0;
+		file->ra_next = 0;
 	}
-	
-	free(current_data_block);
-	if (next_ino == -1){
-		//printf("not found\n");
-		//printf("---------------------------------------\n");
-		return -ENOENT; //not found
+	file->next_offset = offset + size;
+
+	int next = (offset + size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+	int start = file->ra_next > next ? file->ra_next : next;
+	int end = next + file->ra_size;
+	int file_blocks = (inode->size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+	if (end > file_blocks) {
+		end = file_blocks;
 	}
-	//at this point, current_ino is set to be the inode number of foo
-	//but we also need to check if this current inode is another directory or a file
-	//if it is a file, we should have reached end of path (/a.txt)
-	//if it is a directory, we should have not reached end of path yet (/foo/a.txt)
+	if (file->ra_size == 0 || file->ra_next - next >= file->ra_size / 2 || start >= end) {
+		pthread_mutex_unlock(&file->lock);
+		return;
+	}
+	file->ra_next = end;
+	pthread_mutex_unlock(&file->lock);
+
+	int lblk = start;
+	while (lblk < end) {
+		int run;
+		int block_number = map_run(inode, lblk, end - lblk, 0, &run);
+		if (block_number != -1) {
+			bio_readahead(block_number + superblock->d_start_blk, run, to_cache);
+		}
+		lblk += run;
+	}
+}
 
 
+/*
+ * Lay out a new volume of config.disk_mb MiB with config.inodes inodes, or
+ * one per TFS_INODE_RATIO bytes: the superblock, both bitmaps and the
+ * inode table, then the data region in the blocks left. Block numbers are
+ * ints, which caps a volume at 2^31 blocks. -1 if it can not be made.
+ */
+static int geometry_init(struct superblock *sb) {
+	uint64_t disk_blocks = ((uint64_t)config.disk_mb << 20) / BLOCK_SIZE;
+	uint64_t inodes = config.inodes != 0 ? config.inodes : ((uint64_t)config.disk_mb << 20) / TFS_INODE_RATIO;
+	//bitmaps are whole 64-bit words
+	inodes = (inodes + 63) & ~63ULL;
+	if (config.block_size != 0 && config.block_size != BLOCK_SIZE) {
+		fprintf(stderr, "%u-byte blocks asked for, tfs is built for %d-byte blocks\n", config.block_size, BLOCK_SIZE);
+		return -1;
+	}
+	if (disk_blocks > INT_MAX || inodes > INT_MAX - 63) {
+		fprintf(stderr, "%lu MiB with %llu inodes is past the %d blocks tfs can address\n",
+			config.disk_mb, (unsigned long long)inodes, INT_MAX);
+		return -1;
+	}
 
-	int retval;
-	//get next file path "/foo/bar/a.txt" -> "/bar/a.txt"
-	char* substring = strstr(truncatedPath, "/");
-	retval = get_node_by_path(substring, next_ino, inode);
-	if (retval < 0) {
-		return -ENOENT; //file or dir not found
+	memset(sb, 0, sizeof(*sb));
+	sb->magic_num = MAGIC_NUM;
+	sb->features = (config.extents ? TFS_FEATURE_EXTENTS : 0) | TFS_FEATURE_DIRREC | TFS_FEATURE_INODE128 | TFS_FEATURE_INLINE;
+	sb->block_size = BLOCK_SIZE;
+	sb->inodes = inodes;
+	sb->disk_blocks = disk_blocks;
+	sb->i_bitmap_blk = 1;
+	sb->d_bitmap_blk = sb->i_bitmap_blk + bitmap_blocks(inodes);
+	//the data bitmap is sized for the whole volume, a little more than the data region needs
+	sb->i_start_blk = sb->d_bitmap_blk + bitmap_blocks(disk_blocks);
+	sb->d_start_blk = sb->i_start_blk + (inodes + INODES_PER_BLOCK - 1) / INODES_PER_BLOCK;
+	if (sb->d_start_blk + 64 > disk_blocks) {
+		fprintf(stderr, "%lu MiB is too small for %llu inodes\n", config.disk_mb, (unsigned long long)inodes);
+		return -1;
 	}
-	//printf("Successfully found\n");
-	//printf("---------------------------------------\n");
-	return 0; //found the elusive inode, stored inside *inode
+	sb->data_blocks = (disk_blocks - sb->d_start_blk) & ~63ULL;
+	return 0;
 }
 
-
-/* 
- * Make file system
+/*
+ * Fill in the superblock of a volume made by the original tfs, which had
+ * 4096-byte blocks, single-block bitmaps and the counts in max_inum and
+ * max_dnum, and none of the features. The data region was not sized to the
+ * disk file, which grew as blocks past its end were written. The volume
+ * gets MAGIC_NUM the first time the superblock is written back, by which
+ * time features records how far it has been converted.
  */
+static void geometry_legacy() {
+	superblock->magic_num = MAGIC_NUM;
+	superblock->features = 0;
+	superblock->block_size = 4096;
+	superblock->inodes = superblock->max_inum;
+	superblock->data_blocks = superblock->max_dnum;
+	superblock->disk_blocks = superblock->d_start_blk + superblock->max_dnum;
+	superblock->orphans = 0;
+}
+
 int tfs_mkfs() {
 	//printf("---------------------------------------\n");
 	//printf("tfs_mkfs called\n");
-	// Call dev_init() to initialize (Create) Diskfile
-	
-	//printf("calling dev_init...\n");
-	dev_init(diskfile_path);
-	//printf("dev_init succeeded\n");
-	// write superblock information
-
-	//printf("mallocing memory for superblock and initializing...\n");
-	superblock = malloc(sizeof(*superblock));
-	superblock->magic_num = MAGIC_NUM;
-
-	superblock->max_inum = MAX_INUM;
-	superblock->max_dnum = MAX_DNUM;
-
-	superblock->i_bitmap_blk = 1;
-	superblock->d_bitmap_blk = 2;
-	superblock->i_start_blk = 3;
-
+	struct superblock sb;
+	if (geometry_init(&sb) < 0) {
+		return -1;
+	}
 
-	//printf("calculating number blocks needed for inode table...\n");
-	int num_bytes_inode = MAX_INUM * sizeof(struct inode);
-	int blocks_needed = num_bytes_inode / BLOCK_SIZE;
-	if (num_bytes_inode % BLOCK_SIZE != 0) {
-		blocks_needed++;
-	} 
-	//printf("number of blocks needed for inode table: %d\n", blocks_needed);
-	
+	// Call dev_init() to initialize (Create) Diskfile
+	dev_init(diskfile_path, sb.disk_blocks * BLOCK_SIZE);
+	map_disk();
 
-	//printf("data block region starts at block number %d\n",superblock->i_start_blk + blocks_needed);
-	superblock->d_start_blk = superblock->i_start_blk + blocks_needed; 
-	
-	
-	//printf("calling bio_write to write superblock struct into block 0...\n");
+	// write superblock information
+	//superblock and bitmaps are written as whole blocks, so give them a whole block of memory
+	superblock = meta_alloc(0, BLOCK_SIZE);
+	memset(superblock, 0, BLOCK_SIZE);
+	memcpy(superblock, &sb, sizeof(sb));
 	bio_write(0, superblock);
-	//printf("bio_write succeeded\n");
-
-
-	// initialize inode bitmap
+	inode_cache_init();
 
-	//printf("calculating number of elements in inode bitmap...\n");
-	int number_of_elements = MAX_INUM / 8;
-	//printf("mallocing %d bytes for inode bitmap: \n", number_of_elements);
-	inode_bitmap = malloc(number_of_elements);
-
-	//printf("setting all bits in bitmap to 0\n");
-	memset(inode_bitmap, 0, number_of_elements);
-	//printf("writing inode bitmap to disk\n");
-	bio_write(1, inode_bitmap);
-	//printf("successfully wrote inode bitmap to disk\n");
-
-	//printf("calculating number of elements in datablock bitmap...\n");
-	// initialize data block bitmap
-	number_of_elements = MAX_DNUM / 8;
-	//printf("mallocing %d bytes for datanode bitmap \n", number_of_elements);
-	data_region_bitmap = malloc(number_of_elements);
-	//printf("setting datablock bitmap bits to 0\n");
-	memset(data_region_bitmap, 0, number_of_elements);
-	//printf("writing datablock bitmap to disk\n");
-	bio_write(2, data_region_bitmap);
-	//printf("successfully wrote data bitmap to disk\n");
-
-	
-	
+	// initialize inode bitmap and data block bitmap, all clear, written back by flush_bitmaps()
+	alloc_init(1);
 
 	// update bitmap information for root directory
 	// allocating 0-th inode for root
-	//printf("allocating first inode for the root in inode bitmap\n");
-	set_bitmap(inode_bitmap, 0);
-	//printf("checking inode bitmap value at index 0: %d\n", get_bitmap(inode_bitmap, 0));
+	bitmap_take(&inode_bitmap, 0);
 
 	// update inode for root directory
-	//printf("updating inode for root directory\n");
 	struct inode root_inode;
+	memset(&root_inode, 0, sizeof(struct inode));
 	root_inode.ino = 0; //0 as 'well-known' ino
 	root_inode.type = 0; //0 for directory, 0 for file
-	root_inode.vstat.st_mode = S_IFDIR | 0755;
-	memset(root_inode.direct_ptr, -1, sizeof(int) * 16);
-	//printf("Verifying root_inode.ino: %d should be 0, root_inode.type: %d should be 0\n", root_inode.ino, root_inode.type);
+	inode_stamp(&root_inode, S_IFDIR | 0755, getuid(), getgid());
+	root_inode.valid = 1;
+	memset(root_inode.direct_ptr, -1, sizeof(root_inode.direct_ptr));
+	memset(root_inode.indirect_ptr, -1, sizeof(root_inode.indirect_ptr));
+	root_inode.flags = TFS_INDIRECT_FL;
 
 	//write to disk
-
-	//printf("writing root_inode to block...\n");
-	void *tempbuffer = malloc(BLOCK_SIZE);
-	bio_read(3, tempbuffer);
-	struct inode* before = tempbuffer;
-	//printf("buffer before writei: %d\n", before->ino);
-
 	writei(root_inode.ino, &root_inode);
-	
-	bio_read(3, tempbuffer);
-	struct inode* after = tempbuffer;
-	//printf("buffer after writei: %d\n", after->ino);
-	//printf("write successful\n");
-	
+	flush_inodes();
+	flush_bitmaps();
 	//printf("---------------------------------------\n");
 
 	return 0;
@@ -702,136 +2400,172 @@ int tfs_mkfs() {
 
 
 /* 
- * FUSE file operations
+ * File system operations
  */
-static void *tfs_init(struct fuse_conn_info *conn) {
-	//printf("INITIALIZING MUTEX LOCK\n");
-	pthread_mutex_init(&lock, NULL);
-	//printf("LOCKING MUTEX IN TFS_INIT\n");
-	pthread_mutex_lock(&lock);
+int tfs_mount(const char *diskfile, const struct tfs_options *opts) {
 	//printf("---------------------------------------\n");
 	//printf("TFS INIT CALLED\n");
+	int retval;
 	
+	snprintf(diskfile_path, PATH_MAX, "%s", diskfile);
+	config = *opts;
+	stats_enable(!config.nostats);
+
+	// The disk is the file at diskfile unless another backend was asked for
+	if (dev_backend(config.backend) < 0) {
+		fprintf(stderr, "%s: no such backend\n", config.backend);
+		return -EINVAL;
+	}
+
+	// Block cache sits between us and the disk file for the whole mount, unless it is mapped
+	if (!config.mmap) {
+		bio_cache_init(config.cache_mb << 20);
+	}
+	// Runs of whole blocks are kept in flight together through io_uring when asked for
+	if (config.uring > 0 && bio_uring_init(config.uring) < 0) {
+		fprintf(stderr, "io_uring unavailable, using synchronous I/O\n");
+	}
+	bmap_init();
+	dcache_init(config.dcache_entries);
 
-	// Step 1a: If disk file is not found, call mkfs
-	if(dev_open(diskfile_path) == -1){
+	// Step 1a: If disk file is not found, or a new file system is asked for, call mkfs
+	if (config.format || dev_open(diskfile_path) == -1) {
 		//printf("Diskfile not found... calling tfs_mkfs()\n");
-		tfs_mkfs();
+		if (tfs_mkfs() < 0) {
+			retval = -EINVAL;
+			goto fail;
+		}
 	} else {
 		//printf("Diskfile found... initializing in-memory data structures\n");
+		map_disk();
 		// Step 1b: If disk file is found, just initialize in-memory data structures and read superblock from disk
-		// initialize inode bitmap
-		int number_of_elements = MAX_INUM / 8;
-		//printf("mallocing %d elements for inode bitmap\n", number_of_elements);
-		inode_bitmap = malloc(number_of_elements);
-		// initialize data block bitmap
-		number_of_elements = MAX_DNUM / 8;
-		//printf("mallocing %d elements for data bitmap\n", number_of_elements);
-		data_region_bitmap = malloc(number_of_elements);
-		//printf("mallocing superblock\n");
-		superblock = malloc(sizeof(*superblock));
-		//bioread for the bitmaps
-		//printf("Reading superblock from disk...\n");
+		superblock = meta_alloc(0, BLOCK_SIZE);
 		void* block_buffer = malloc(BLOCK_SIZE);
 		bio_read(0, block_buffer);
-
 		memcpy(superblock, block_buffer, sizeof(struct superblock));
-		//printf("read contents into superblock from disk!\n");
+		free(block_buffer);
 		//printf("superblock d_start_blk: %d\n", superblock->d_start_blk);
+		if (superblock->magic_num == MAGIC_NUM_LEGACY) {
+			geometry_legacy();
+		}
+		if (superblock->magic_num != MAGIC_NUM || superblock->block_size != BLOCK_SIZE) {
+			fprintf(stderr, "%s: not a tfs volume with %d-byte blocks\n", diskfile_path, BLOCK_SIZE);
+			retval = -EINVAL;
+			goto fail;
+		}
 
-		bio_read(1, block_buffer);
-		memcpy(inode_bitmap, block_buffer, number_of_elements);
-		//printf("read contents into inode bitmap from disk!\n");
-
-		bio_read(2, block_buffer);
-		memcpy(data_region_bitmap, block_buffer, number_of_elements);
-		//printf("read contents into data region bitmap from disk!\n");
+		// initialize inode bitmap and data block bitmap, read from disk
+		inode_cache_init();
+		alloc_init(0);
+	}
+	inode_locks_init();
 
-		int i;
-		int counter = 0;
-		for(i = 0; i < MAX_DNUM; i++){
-			if(get_bitmap(data_region_bitmap, i) == 1){
-				counter++;
-			}
+	// Step 2: Bring a file system made by the original tfs up to date
+	if (!(superblock->features & TFS_FEATURE_INODE128)) {
+		inodes_convert();
+	}
+	if (!(superblock->features & TFS_FEATURE_DIRREC)) {
+		if (dirs_convert() < 0) {
+			retval = -EIO;
+			goto fail;
 		}
-		//printf("Number of data blocks used in data region: %d\n", counter);
+		flush_inodes();
+		superblock->features |= TFS_FEATURE_DIRREC;
+		bio_write(0, superblock);
+	}
+	if (superblock->orphans > 0) {
+		orphans_reclaim();
 	}
 	
 
 	//printf("TFS INIT COMPLETED\n");
 	//printf("---------------------------------------\n");
-	//printf("UNLOCKING MUTEX IN TFS INIT\n");
-	pthread_mutex_unlock(&lock);
-	return NULL;
+	return 0;
+
+fail:
+	// Undo what got set up, in the order tfs_unmount() does, so another tfs_mount() starts clean
+	bmap_destroy();
+	if (inode_blocks != NULL) {
+		alloc_destroy();
+		inode_cache_destroy();
+	}
+	dcache_destroy();
+	meta_free(superblock);
+	superblock = NULL;
+	inode_locks_destroy();
+	dev_close();
+	metadata_mapped = 0;
+	return retval;
 }
 
-static void tfs_destroy(void *userdata) {
+void tfs_unmount() {
 	//printf("---------------------------------------\n");
 	//printf("entered tfs_destroy. freeing in-memory DS\n");
 	// Step 1: De-allocate in-memory data structures
-	free(inode_bitmap); 
-	free(data_region_bitmap);
-	free(superblock);
-	//printf("DESTROYING MUTEX\n");
-	pthread_mutex_destroy(&lock);
+	bmap_destroy();
+	flush_bitmaps();
+	alloc_destroy();
+	flush_inodes();
+	inode_cache_destroy();
+	dcache_destroy();
+	meta_free(superblock);
+	superblock = NULL;
+	inode_locks_destroy();
 	// Step 2: Close diskfile
 	//printf("closing diskfile...\n");
 	dev_close();
+	metadata_mapped = 0;
 	//printf("---------------------------------------\n");
 
 }
 
-static int tfs_getattr(const char *path, struct stat *stbuf) {
-	//printf("LOCKING MUTEX IN TFS_GETATTR\n");
-	pthread_mutex_lock(&lock);
+int tfs_getattr(const char *path, struct stat *stbuf) {
 	//printf("---------------------------------------\n");
 	//printf("entered tfs_getattr\n");
 	// Step 1: call get_node_by_path() to get inode from path
 
+	if (stats_file(path)) {
+		stats_file_attr(stbuf);
+		return 0;
+	}
+
 	struct inode target_inode;
 	//printf("getting inode for path %s\n", path);
 	int ret_val = get_node_by_path(path, 0, &target_inode);
 	if(ret_val < 0){
 		//printf("file not found\n");
-		//printf("UNLOCKING MUTEX GETATTR\n");
-		pthread_mutex_unlock(&lock);
 		return -ENOENT;
 	}
 	//printf("ino: %d\n", target_inode.ino);
 	//printf("size of inode: %d\n", target_inode.size);
-	//printf("size of inode from vstat: %d\n", target_inode.vstat.st_size);
 
 	// Step 2: fill attribute of file into stbuf from inode
 
+	stbuf->st_mode = target_inode.mode;
 	if (target_inode.type == 0){ //dir
-		stbuf->st_mode   = S_IFDIR | 0755;
 		stbuf->st_nlink  = target_inode.link;
 	}
 	else{ //file
-		stbuf->st_mode   = S_IFREG | 0644;
 		stbuf->st_nlink  = 1;
 	}
-	stbuf->st_uid = getuid();
-	stbuf->st_gid = getgid();
+	stbuf->st_uid = target_inode.uid;
+	stbuf->st_gid = target_inode.gid;
 	stbuf->st_ino = target_inode.ino;
-	
-	time(&stbuf->st_mtime);
+	stbuf->st_atim = ns_to_timespec(target_inode.atime);
+	stbuf->st_mtim = ns_to_timespec(target_inode.mtime);
+	stbuf->st_ctim = ns_to_timespec(target_inode.ctime);
 
 	//more attributes to fill in to stbuf
 	stbuf->st_blksize = BLOCK_SIZE;
-	stbuf->st_size = target_inode.vstat.st_size;
+	stbuf->st_size = target_inode.size;
 
 	//printf("inode attributes filled in\n");
 	//printf("---------------------------------------\n");
-	//printf("RELEASING LOCK IN GETATTR\n");
-	pthread_mutex_unlock(&lock);
 	return 0;
 	
 }
 
-static int tfs_opendir(const char *path, struct fuse_file_info *fi) {
-	//printf("LOCKING MUTEX IN OPENDIR\n");
-	pthread_mutex_lock(&lock);
+int tfs_opendir(const char *path) {
 	//printf("---------------------------------------\n");
 	//printf("entered tfs_opendir\n");
 	struct inode* inode = malloc(sizeof(*inode));
@@ -840,8 +2574,7 @@ static int tfs_opendir(const char *path, struct fuse_file_info *fi) {
 
 	//printf("---------------------------------------\n");
 	int retval = get_node_by_path(path, 0, inode);
-	//printf("UNLOCKING MUTEX IN OPENDIR\n");
-	pthread_mutex_unlock(&lock);
+	free(inode);
 	return retval;
 	// Step 1: Call get_node_by_path() to get inode from path
 	
@@ -851,9 +2584,7 @@ static int tfs_opendir(const char *path, struct fuse_file_info *fi) {
     //return 0;
 }
 
-static int tfs_readdir(const char *path, void *buffer, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info *fi) {
-	//printf("LOCKING MUTEX IN READDIR\n");
-	pthread_mutex_lock(&lock);
+int tfs_readdir(const char *path, void *buffer, tfs_fill_dir_t filler) {
 	//printf("---------------------------------------\n");
 	//printf("entered tfs_readdir\n");
 	// Step 1: Call get_node_by_path() to get inode from path
@@ -862,38 +2593,41 @@ static int tfs_readdir(const char *path, void *buffer, fuse_fill_dir_t filler, o
 	int retval = get_node_by_path(path, 0, inode);
 	//printf("get node by path returned %d\n", retval);
 	if (retval < 0){
-		//printf("UNLOCKING MUTEX IN READDIR\n");
-		pthread_mutex_unlock(&lock);
+		free(inode);
 		return -ENOENT;
 	}
+	//entries cannot change under us while the directory is locked shared
+	inode_lock_shared(inode->ino);
+	readi(inode->ino, inode);
 	int i;
+	int count;
+	int* blocks = dir_blocks(inode, &count);
 
 	void* current_data_block = malloc(BLOCK_SIZE);
-	for(i = 0; i < 16; i++){
-		int current_data_block_index = inode->direct_ptr[i] + superblock->d_start_blk;
-		if(inode->direct_ptr[i] == -1){
-			continue;
-		}
-		bio_read(current_data_block_index, current_data_block);
+	for(i = 0; i < count; i++){
+		bio_read(blocks[i] + superblock->d_start_blk, current_data_block);
 
-		int j = 0;
-		while(j + sizeof(struct dirent) < BLOCK_SIZE){
-			//void* address_of_dir_entry = block->data + j;
-			void* address_of_dir_entry = current_data_block + j;
-			struct dirent current_entry;
-			memcpy(&current_entry, address_of_dir_entry, sizeof(struct dirent));
-
-			
+		struct dirent_rec* rec = NULL;
+		while ((rec = dirblk_next(current_data_block, rec)) != NULL) {
 			//filler function here with name of dirent as the second arg
-			//filler(buffer, name_of_dirent, NULL, 0);
-			if(current_entry.valid == 1)
-				filler(buffer, current_entry.name, NULL ,offset);
-
-			j = j + sizeof(struct dirent);
-			
-
+			//the entry type comes from the dirent, entries written before it was stored fall back to the inode
+			struct stat entry_stat;
+			memset(&entry_stat, 0, sizeof(entry_stat));
+			entry_stat.st_ino = rec->ino;
+			uint8_t type = rec->type;
+			if(type == TFS_FT_UNKNOWN){
+				struct inode entry_inode;
+				readi(rec->ino, &entry_inode);
+				type = entry_inode.type == 0 ? TFS_FT_DIR : TFS_FT_REG;
+			}
+			entry_stat.st_mode = type == TFS_FT_DIR ? S_IFDIR : S_IFREG;
+			filler(buffer, rec->name, &entry_stat, 0);
 		}
 	}
+	free(current_data_block);
+	free(blocks);
+	inode_unlock(inode->ino);
+	free(inode);
 	//printf("---------------------------------------\n");
 
 	// Step 2: Read directory entries from its data blocks, and copy them to filler
@@ -901,15 +2635,14 @@ static int tfs_readdir(const char *path, void *buffer, fuse_fill_dir_t filler, o
 
 	//iterate over every directptr block to find all dirents
 	//for every dirent found, call the filler function
-	//printf("RELEASING LOCK IN READDIR\n");
-	pthread_mutex_unlock(&lock);
 	return 0;
 }
 
 
-static int tfs_mkdir(const char *path, mode_t mode) {
-	//printf("LOCKING MKDIR\n");
-	pthread_mutex_lock(&lock);
+int tfs_mkdir(const char *path, mode_t mode, uid_t uid, gid_t gid) {
+	if (stats_file(path)) {
+		return -EEXIST;
+	}
 	//printf("-----------------------------\n");
 	// Step 1: Use dirname() and basename() to separate parent directory path and target directory name
 	//printf("entered tfs_mkdir\n");
@@ -937,31 +2670,38 @@ static int tfs_mkdir(const char *path, mode_t mode) {
 		int retval = get_node_by_path(dirname, 0, &parent_inode);
 		if (retval < 0) {
 			//printf("dir not found\n");
-			//printf("RELEASING LOCK IN MKDIR\n");
-			pthread_mutex_unlock(&lock);
 			return -ENOENT;
 		}
 	}
+	//the parent stays locked until the new entry is in it
+	if (lock_dir(parent_inode.ino, &parent_inode) < 0) {
+		return -ENOENT;
+	}
 	//printf("successfully retrieved parent inode\n");
 	basename += 1;
 	//printf("dirname: %s, truncated basename: %s\n", dirname, basename);
 	// Step 3: Call get_avail_ino() to get an available inode number
 	int new_inode_number = get_avail_ino();
+	if (new_inode_number < 0) {
+		inode_unlock(parent_inode.ino);
+		return -ENOSPC;
+	}
 	//printf("found available inode %d\n", new_inode_number);
-
-	// Step 4: Call dir_add() to add directory entry of target directory to parent directory
-	printf("calling dir_add to add this dirent to the parent directory \n");
-	dir_add(parent_inode, new_inode_number, basename, strlen(basename));
+	//nobody can see the new directory yet, but lookups may find it as soon as it is in the parent
+	inode_lock_excl(new_inode_number);
 
 	//make new inode for directory
 	//printf("making new directory inode\n");
 	struct inode new_inode;
+	memset(&new_inode, 0, sizeof(struct inode));
 	new_inode.ino = new_inode_number;
 	new_inode.type = 0; //directory
 	new_inode.size = 0;
-	new_inode.vstat.st_size = 0;
+	inode_stamp(&new_inode, S_IFDIR | (mode & 07777), uid, gid);
 	new_inode.valid = 1;
-	memset(new_inode.direct_ptr, -1, sizeof(int)*16);
+	memset(new_inode.direct_ptr, -1, sizeof(new_inode.direct_ptr));
+	memset(new_inode.indirect_ptr, -1, sizeof(new_inode.indirect_ptr));
+	new_inode.flags = TFS_INDIRECT_FL;
 	
 	// Step 5: Update inode for target directory
 	//printf("updating parent inode\n");
@@ -974,23 +2714,29 @@ static int tfs_mkdir(const char *path, mode_t mode) {
 	//printf("write success\n");
 	//printf("-----------------------------\n");
 
-	dir_add(new_inode, new_inode.ino, ".", 1);
-	readi(new_inode.ino, &new_inode);
-	dir_add(new_inode, parent_inode.ino, "..", 2);
-	//printf("RELEASING LOCK IN MKDIR\n");
-	pthread_mutex_unlock(&lock);
-	return 0;
-}
-
-static int tfs_releasedir(const char *path, struct fuse_file_info *fi) {
-	// For this project, you don't need to fill this function
-	// But DO NOT DELETE IT!
-    return 0;
+	// Step 4: Call dir_add() to add directory entry of target directory to parent directory
+	// (after writei, so dir_add can record the new inode's type in the entry)
+	//printf("calling dir_add to add this dirent to the parent directory \n");
+	int retval = dir_add(parent_inode, new_inode_number, basename, strlen(basename));
+	if (retval < 0) {
+		new_inode.valid = 0;
+		writei(new_inode.ino, &new_inode);
+		release_ino(new_inode.ino);
+	} else {
+		dir_add(new_inode, new_inode.ino, ".", 1);
+		readi(new_inode.ino, &new_inode);
+		dir_add(new_inode, parent_inode.ino, "..", 2);
+	}
+	flush_bitmaps();
+	inode_unlock(new_inode_number);
+	inode_unlock(parent_inode.ino);
+	return retval;
 }
 
-static int tfs_create(const char *path, mode_t mode, struct fuse_file_info *fi) {
-	//printf("LOCKING TFS CREAT\n");
-	pthread_mutex_lock(&lock);
+int tfs_create(const char *path, mode_t mode, uid_t uid, gid_t gid, struct tfs_file **filep) {
+	if (stats_file(path)) {
+		return -EEXIST;
+	}
 	//printf("-----------------------------\n");
 	// Step 1: Use dirname() and basename() to separate parent directory path and target directory name
 	//printf("entered tfs_create\n");
@@ -1009,18 +2755,20 @@ static int tfs_create(const char *path, mode_t mode, struct fuse_file_info *fi)
 	else {
 		int length_of_parent_directory_name = basename - path;
 		
-		char* dirname = malloc(length_of_parent_directory_name + 1);
+		dirname = malloc(length_of_parent_directory_name + 1);
 		memcpy(dirname, path, length_of_parent_directory_name);
 		dirname[length_of_parent_directory_name] = '\0';
 		// Step 2: Call get_node_by_path() to get inode of parent directory
 		int retval = get_node_by_path(dirname, 0, &parent_inode);
 		if (retval < 0) {
 			//printf("dir not found\n");
-			//printf("RELEASING LOCK IN MKDIR\n");
-			pthread_mutex_unlock(&lock);
 			return -ENOENT;
 		}
 	}
+	//the parent stays locked until the new entry is in it
+	if (lock_dir(parent_inode.ino, &parent_inode) < 0) {
+		return -ENOENT;
+	}
 
 	
 	//truncate basename by 1
@@ -1035,22 +2783,33 @@ static int tfs_create(const char *path, mode_t mode, struct fuse_file_info *fi)
 	
 	// Step 3: Call get_avail_ino() to get an available inode number
 	int new_inode_number = get_avail_ino();
+	if (new_inode_number < 0) {
+		inode_unlock(parent_inode.ino);
+		return -ENOSPC;
+	}
 	//printf("found available inode %d\n", new_inode_number);
-
-	// Step 4: Call dir_add() to add directory entry of target file to parent directory
-	dir_add(parent_inode, new_inode_number, basename, strlen(basename));
+	//an unlink that freed the ino may still be finishing with it, and lookups may find the file as soon as it is in the parent
+	inode_lock_excl(new_inode_number);
 
 	// Step 5: Update inode for target file
 	//make new inode for file
 	//printf("making new directory inode\n");
 	struct inode new_inode;
+	memset(&new_inode, 0, sizeof(struct inode));
 	new_inode.ino = new_inode_number;
 	new_inode.link = 0;
 	new_inode.type = 1; //file
 	new_inode.size = 0;
-	new_inode.vstat.st_size = 0;
+	inode_stamp(&new_inode, S_IFREG | (mode & 07777), uid, gid);
 	new_inode.valid = 1;
-	memset(new_inode.direct_ptr, -1, sizeof(int)*16);
+	//files start out with their data inline, and get a block map once they outgrow it
+	new_inode.flags = 0;
+	if (superblock->features & TFS_FEATURE_INLINE) {
+		memset(new_inode.inline_data, 0, sizeof(new_inode.inline_data));
+		new_inode.flags = TFS_INLINE_FL;
+	} else {
+		inode_map_init(&new_inode);
+	}
 
 	//printf("new inode info\nino: %d\n link: %d\n type: %d\n size: %d\n valid: %d\n", new_inode.ino, new_inode.link, new_inode.type, new_inode.size, new_inode.valid);
 
@@ -1062,262 +2821,527 @@ static int tfs_create(const char *path, mode_t mode, struct fuse_file_info *fi)
 	//printf("writing inode...\n");
 	writei(new_inode.ino, &new_inode);	
 	//printf("write success\n");
+
+	// Step 4: Call dir_add() to add directory entry of target file to parent directory
+	// (after writei, so dir_add can record the new inode's type in the entry)
+	int retval = dir_add(parent_inode, new_inode_number, basename, strlen(basename));
+	if (retval < 0) {
+		new_inode.valid = 0;
+		writei(new_inode.ino, &new_inode);
+		release_ino(new_inode.ino);
+	} else if ((*filep = file_open(new_inode.ino)) == NULL) {
+		retval = -ENOMEM;
+	}
 	//printf("writing inode bitmap to disk...\n");
-	bio_write(1, inode_bitmap);
+	flush_bitmaps();
 	//printf("tfs_create finished\n");
 	//printf("---------------------------------------\n");
-	//printf("RELEASING LOCK IN MKDIR\n");
-	pthread_mutex_unlock(&lock);
-	return 0;
+	inode_unlock(new_inode_number);
+	inode_unlock(parent_inode.ino);
+	return retval;
 }
 
-static int tfs_open(const char *path, struct fuse_file_info *fi) {
-	//printf("LOCKING OPEN\n");
-	pthread_mutex_lock(&lock);
+int tfs_open(const char *path, int flags, struct tfs_file **filep) {
 	//printf("---------------------------------------\n");
 	//printf("entered tfs_open\n");
 
+	if (stats_file(path)) {
+		return stats_file_open(stats_file(path), flags, filep);
+	}
+
 	// Step 1: Call get_node_by_path() to get inode from path
 	//printf("getting node from path %s\n", path);
 	struct inode inode;
 	int retval = get_node_by_path(path, 0, &inode);
-	//printf("RELEASING LOCK IN OPEN\n");
-	pthread_mutex_unlock(&lock);
-	return retval;
 	// Step 2: If not find, return -1
+	if (retval < 0) {
+		return retval;
+	}
+	// Step 3: Pin the inode in a handle, unless it was unlinked since the lookup
+	inode_lock_shared(inode.ino);
+	readi(inode.ino, &inode);
+	if (inode.valid != 1 || (inode.flags & TFS_ORPHAN_FL)) {
+		inode_unlock(inode.ino);
+		return -ENOENT;
+	}
+	*filep = file_open(inode.ino);
+	inode_unlock(inode.ino);
+	return *filep != NULL ? 0 : -ENOMEM;
 
 }
 
-static int tfs_read(const char *path, char *buffer, size_t size, off_t offset, struct fuse_file_info *fi) {
-	//printf("LOCKING TFS_READ\n");
-	//printf("path: %s\n", path);
-	//printf("buffer: %s\n", buffer);
-	//printf("size: %d\n", size);
-	//printf("offset: %d\n", offset);
-
+int tfs_read(struct tfs_file *file, char *buffer, size_t size, off_t offset) {
+	if (file->report != NULL) {
+		return stats_file_read(file, buffer, size, offset);
+	}
 
-	pthread_mutex_lock(&lock);
-	// Step 1: You could call get_node_by_path() to get inode from path
+	// Step 1: Get the inode from the open file
 	struct inode target_file_inode;
-	int rv = get_node_by_path(path, 0, &target_file_inode);
-	if (rv < 0) {
-		//printf("dir not found\n");
-		//printf("RELEASING LOCK IN read\n");
-		pthread_mutex_unlock(&lock);
+	target_file_inode.ino = file->ino;
+	//readers share the file, reload it in case a writer got in before us
+	inode_lock_shared(target_file_inode.ino);
+	readi(target_file_inode.ino, &target_file_inode);
+	if (target_file_inode.valid != 1) {
+		inode_unlock(target_file_inode.ino);
 		return -ENOENT;
 	}
 
-	//printf("target file inode number is: %d\n", target_file_inode.ino);
-	// Step 2: Based on size and offset, read its data blocks from disk
-	int start_block_index = offset / BLOCK_SIZE;
-	int end_block_index = (offset+size) / BLOCK_SIZE;
-
-	
-	if((offset+size) % BLOCK_SIZE != 0){
-		end_block_index++;
+	//nothing to read past the end of the file
+	off_t file_size = target_file_inode.size;
+	if (offset >= file_size || size == 0) {
+		inode_unlock(target_file_inode.ino);
+		return 0;
+	}
+	if (offset + size > file_size) {
+		size = file_size - offset;
 	}
-	//printf("start block: %d\n", start_block_index);
-	//printf("end block index: %d\n", end_block_index);
-	int bytes_written = 0;
 
-	int beginning = start_block_index;
+	//a small file's data is right there in its inode
+	if (target_file_inode.flags & TFS_INLINE_FL) {
+		memcpy(buffer, target_file_inode.inline_data + offset, size);
+		inode_unlock(target_file_inode.ino);
+		return size;
+	}
 
+	// Step 2: Based on size and offset, read its data blocks from disk
+	// Step 3: copy the correct amount of data from offset to buffer
+	int first = offset / BLOCK_SIZE;
+	int last = (offset + size - 1) / BLOCK_SIZE;
 	void* current_block = malloc(BLOCK_SIZE);
-	if(offset % BLOCK_SIZE != 0){
-		//calculate offset for middle of page
-		int block_offset = offset % BLOCK_SIZE;
-
-		int remaining_block_room = BLOCK_SIZE - block_offset;
-		bio_read(target_file_inode.direct_ptr[beginning] + superblock->d_start_blk, current_block);
-
-		if(size <= remaining_block_room){
-			
-			memcpy(buffer, current_block + block_offset, size);
-			bytes_written += size;
-		}
-		else{
-			memcpy(buffer, current_block + block_offset, remaining_block_room);
-			bytes_written +=remaining_block_room;
+	if (first == last) {
+		//within one block: through the cache, where small reads of the same block keep hitting
+		int block_number = map_block(&target_file_inode, first, 0);
+		if (block_number == -1) {
+			//hole, never written
+			memset(buffer, 0, size);
+		} else {
+			bio_read(block_number + superblock->d_start_blk, current_block);
+			memcpy(buffer, current_block + offset % BLOCK_SIZE, size);
 		}
-
-		beginning++;
-
+		free(current_block);
+		file_readahead(file, &target_file_inode, offset, size, 1);
+		inode_unlock(target_file_inode.ino);
+		return size;
 	}
-	int i;
-	for(i = beginning; i < end_block_index; i++){
-		int remaining_bytes = size - bytes_written;
-		//printf("remaining bytes: %d\n", remaining_bytes);
-		bio_read(target_file_inode.direct_ptr[i]+superblock->d_start_blk, current_block);
-		//printf("read block %d in current block\n", target_file_inode.direct_ptr[i]+superblock->d_start_blk);
-		if(remaining_bytes <= BLOCK_SIZE){
-			//printf("bytes can fit in current block: copying at offset of %d\n", bytes_written);
-			memcpy(buffer+bytes_written, current_block, remaining_bytes);
-			bytes_written += remaining_bytes;
-		}
-		else{
-			memcpy(buffer+bytes_written, current_block, BLOCK_SIZE);
-			bytes_written += BLOCK_SIZE;
-		}                        
 
+	//every block goes in one vector, whole ones read straight into buffer and the partial
+	//first and last ones into blocks of their own, so adjacent blocks cost one read
+	char* last_block = malloc(BLOCK_SIZE);
+	struct bio_vec* vec = malloc((last - first + 1) * sizeof(struct bio_vec));
+	int nvec = 0;
+	int lblk = first;
+	while (lblk <= last) {
+		int run, i;
+		int block_number = map_run(&target_file_inode, lblk, last - lblk + 1, 0, &run);
+		for (i = 0; i < run; i++, lblk++) {
+			char* dst = buffer + ((off_t)lblk * BLOCK_SIZE - offset);
+			if (lblk == first && offset % BLOCK_SIZE != 0) {
+				dst = current_block;
+			} else if (lblk == last && (offset + size) % BLOCK_SIZE != 0) {
+				dst = last_block;
+			}
+			if (block_number == -1) {
+				//hole, never written
+				memset(dst, 0, BLOCK_SIZE);
+			} else {
+				vec[nvec].block = block_number + superblock->d_start_blk + i;
+				vec[nvec].buf = dst;
+				nvec++;
+			}
+		}
 	}
-
-	// Step 3: copy the correct amount of data from offset to buffer
+	bio_readv(vec, nvec);
+	if (offset % BLOCK_SIZE != 0) {
+		memcpy(buffer, current_block + offset % BLOCK_SIZE, BLOCK_SIZE - offset % BLOCK_SIZE);
+	}
+	if ((offset + size) % BLOCK_SIZE != 0) {
+		memcpy(buffer + ((off_t)last * BLOCK_SIZE - offset), last_block, (offset + size) % BLOCK_SIZE);
+	}
+	free(vec);
+	free(last_block);
+	free(current_block);
+	size_t bytes_read = size;
+	file_readahead(file, &target_file_inode, offset, size, 1);
 
 	// Note: this function should return the amount of bytes you copied to buffer
-	//printf("RELEASING LOCK IN read\n");
-	pthread_mutex_unlock(&lock);
-	//printf("total bytes read: %d\n", bytes_written);
-	return bytes_written;
+	inode_unlock(target_file_inode.ino);
+	return bytes_read;
 }
 
-static int tfs_write(const char *path, const char *buffer, size_t size, off_t offset, struct fuse_file_info *fi) {
-	//printf("LOCKING TFS_WRITE\n");
-	pthread_mutex_lock(&lock);
-	// Step 1: You could call get_node_by_path() to get inode from path
-	//printf("-------------------------\n");
-	//printf("entered tfs write\n");
-	//printf("path: %s\n", path);
-	//printf("buffer: %s\n", buffer);
-	//printf("size: %d\n", size);
-	//printf("offset: %d\n", offset);
-	struct inode target_file_inode;
+/*
+ * Zero-copy read: instead of copying file data into a buffer, describe
+ * the range as (disk file fd, offset) pieces for libfuse, which splices
+ * them into /dev/fuse. Holes are the only pieces backed by memory. The
+ * pieces are consumed after the inode lock is dropped, so a write racing
+ * with the read may or may not be seen, as with any overlapping read.
+ */
+//A vector of a single piece of memory, size bytes of it, that libfuse frees with the vector
+static struct fuse_bufvec* mem_bufvec(size_t size) {
+	struct fuse_bufvec* bufv = malloc(sizeof(struct fuse_bufvec));
+	void* mem = malloc(size > 0 ? size : 1);
+	if (bufv == NULL || mem == NULL) {
+		free(bufv);
+		free(mem);
+		return NULL;
+	}
+	*bufv = FUSE_BUFVEC_INIT(size);
+	bufv->buf[0].mem = mem;
+	return bufv;
+}
 
+int tfs_read_buf(struct tfs_file *file, struct fuse_bufvec **bufp, size_t size, off_t offset) {
+	if (file->report != NULL) {
+		struct fuse_bufvec* bufv = mem_bufvec(size);
+		if (bufv == NULL) {
+			return -ENOMEM;
+		}
+		bufv->buf[0].size = stats_file_read(file, bufv->buf[0].mem, size, offset);
+		*bufp = bufv;
+		return 0;
+	}
+	//with no host file under the disk there is nothing to splice from, so the data is copied
+	if (bio_fd() < 0) {
+		struct fuse_bufvec* bufv = mem_bufvec(size);
+		if (bufv == NULL) {
+			return -ENOMEM;
+		}
+		int retval = tfs_read(file, bufv->buf[0].mem, size, offset);
+		if (retval < 0) {
+			free(bufv->buf[0].mem);
+			free(bufv);
+			return retval;
+		}
+		bufv->buf[0].size = retval;
+		*bufp = bufv;
+		return 0;
+	}
 
-	//printf("calling get node to see if file exists\n");
-	int ret_val = get_node_by_path(path, 0, &target_file_inode);
-	if(ret_val < 0){
-		//printf("inode does not exist\n");
-		//printf("RELEASING LOCK IN write\n");
-		pthread_mutex_unlock(&lock);
+	// Step 1: Get the inode from the open file
+	struct inode target_file_inode;
+	target_file_inode.ino = file->ino;
+	inode_lock_shared(target_file_inode.ino);
+	readi(target_file_inode.ino, &target_file_inode);
+	if (target_file_inode.valid != 1) {
+		inode_unlock(target_file_inode.ino);
 		return -ENOENT;
 	}
 
-	//printf("file found!\n");
-
-
-	//printf("target file inode number is: %d\n", target_file_inode.ino);
-
-	int start_block_index = offset / BLOCK_SIZE;
-	int end_block_index = (offset+size) / BLOCK_SIZE;
-	if((offset+size) % BLOCK_SIZE > 0){
-		end_block_index++;
+	off_t file_size = target_file_inode.size;
+	if (offset >= file_size) {
+		size = 0;
+	} else if (offset + size > file_size) {
+		size = file_size - offset;
 	}
 
-	int bytes_written = 0;
-
-	int beginning = start_block_index;
-	//printf("first block: %d\n", start_block_index);
-	//printf("last block: %d\n", end_block_index);
-	void* current_block = malloc(BLOCK_SIZE);
-	if(offset % BLOCK_SIZE != 0){
-		//calculate offset for middle of page
-		int block_offset = offset % BLOCK_SIZE;
-
-		int remaining_block_room = BLOCK_SIZE - block_offset;
-
-		int block_number = target_file_inode.direct_ptr[beginning]+superblock->d_start_blk;
-		//if this block has not been made yet, allocate a new block
-		if(target_file_inode.direct_ptr[beginning] == -1){
-			//printf("need to allocate new block\n");
-			int data_region_block_number = get_avail_blkno();
-			int new_block_number =data_region_block_number + superblock->d_start_blk;
-			//printf("generated block num: %d\n", new_block_number);
-			target_file_inode.direct_ptr[beginning] = data_region_block_number;
-			//set_bitmap(data_region_bitmap, get_avail_blkno);
-			block_number = new_block_number;
+	//a small file's data is in its inode, and goes out as a single piece of memory
+	if ((target_file_inode.flags & TFS_INLINE_FL) && size > 0) {
+		struct fuse_bufvec* bufv = mem_bufvec(size);
+		if (bufv == NULL) {
+			inode_unlock(target_file_inode.ino);
+			return -ENOMEM;
+		}
+		memcpy(bufv->buf[0].mem, target_file_inode.inline_data + offset, size);
+		inode_unlock(target_file_inode.ino);
+		*bufp = bufv;
+		return 0;
+	}
 
+	// Step 2: One piece per contiguous run, at most one per block touched
+	int first = offset / BLOCK_SIZE;
+	int last = size > 0 ? (offset + size - 1) / BLOCK_SIZE : first;
+	struct fuse_bufvec* bufv = malloc(sizeof(struct fuse_bufvec) + (last - first) * sizeof(struct fuse_buf));
+	if (bufv == NULL) {
+		inode_unlock(target_file_inode.ino);
+		return -ENOMEM;
+	}
+	*bufv = FUSE_BUFVEC_INIT(0);
+	if (size > 0) {
+		bufv->count = 0;
+	}
 
+	// Step 3: Map the runs, writing back any dirty cached blocks in them
+	size_t bytes_mapped = 0;
+	while (bytes_mapped < size) {
+		off_t position = offset + bytes_mapped;
+		int lblk = position / BLOCK_SIZE;
+		int run;
+		int block_number = map_run(&target_file_inode, lblk, last - lblk + 1, 0, &run);
+		size_t len = (off_t)(lblk + run) * BLOCK_SIZE - position;
+		if (len > size - bytes_mapped) {
+			len = size - bytes_mapped;
 		}
-		//if block already exists 
-		else{
-			//printf("block exists with num %d, reading from block\n", block_number);
-			
-		}
-		bio_read(block_number, current_block);
 
-		if(size <= remaining_block_room){
-			//printf("remaining size fits into block\n");
-			memcpy(current_block+ block_offset, buffer, size);
-			bytes_written += size;
-		}
-		else{
-			//printf("cannot fit all bytes in current block, writing what we can fit\n");
-			memcpy(current_block + block_offset, buffer, remaining_block_room);
-			bytes_written +=remaining_block_room;
+		struct fuse_buf* piece = &bufv->buf[bufv->count];
+		memset(piece, 0, sizeof(struct fuse_buf));
+		piece->size = len;
+		piece->fd = -1;
+		if (block_number == -1) {
+			//hole, never written; libfuse frees the memory with the vector
+			piece->mem = calloc(1, len);
+			if (piece->mem == NULL) {
+				break;
+			}
+		} else {
+			block_number += superblock->d_start_blk;
+			if (bio_sync_range(block_number, run) < 0) {
+				break;
+			}
+			piece->flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+			piece->fd = bio_fd();
+			piece->pos = (off_t)block_number * BLOCK_SIZE + position % BLOCK_SIZE;
 		}
+		bufv->count++;
+		bytes_mapped += len;
+	}
+	file_readahead(file, &target_file_inode, offset, bytes_mapped, 0);
+	inode_unlock(target_file_inode.ino);
 
-		//printf("writing changes to disk\n");
-		bio_write(block_number, current_block);
-		beginning++;
+	if (bytes_mapped < size && bufv->count == 0) {
+		free(bufv);
+		return -EIO;
 	}
-	int i;
-	for(i = beginning; i < end_block_index; i++){
-		int remaining_bytes = size - bytes_written;
-		int block_number = target_file_inode.direct_ptr[i]+superblock->d_start_blk;
-		if(target_file_inode.direct_ptr[i] == -1){
-			//printf("need to allocate new block\n");
-			int data_region_block_number = get_avail_blkno();
-			int new_block_number = data_region_block_number + superblock->d_start_blk;
-			//printf("generated block num: %d\n", new_block_number);
-			target_file_inode.direct_ptr[i] = data_region_block_number;
-			//set_bitmap(data_region_bitmap, new_block_number);
-			block_number = new_block_number;
+	*bufp = bufv;
+	return 0;
+}
 
+int tfs_write(struct tfs_file *file, const char *buffer, size_t size, off_t offset) {
+	// Step 1: Get the inode from the open file
+	struct inode target_file_inode;
+	target_file_inode.ino = file->ino;
+	if (file->report != NULL) {
+		return -EBADF;
+	}
+	if (offset + size > (off_t)MAX_FILE_BLOCKS * BLOCK_SIZE) {
+		return -EFBIG;
+	}
+	if (size == 0) {
+		return 0;
+	}
+	//writers have the file to themselves
+	inode_lock_excl(target_file_inode.ino);
+	readi(target_file_inode.ino, &target_file_inode);
+	if (target_file_inode.valid != 1) {
+		inode_unlock(target_file_inode.ino);
+		return -ENOENT;
+	}
 
+	// Step 2: Based on size and offset, read its data blocks from disk
+	// Step 3: Write the correct amount of data from offset to disk
+	int first = offset / BLOCK_SIZE;
+	int last = (offset + size - 1) / BLOCK_SIZE;
+	void* current_block = malloc(BLOCK_SIZE);
+	size_t bytes_written = 0;
+	if ((target_file_inode.flags & TFS_INLINE_FL) && offset + size <= TFS_INLINE_MAX) {
+		//still small enough to stay in the inode
+		memcpy(target_file_inode.inline_data + offset, buffer, size);
+		bytes_written = size;
+	} else if ((target_file_inode.flags & TFS_INLINE_FL) && inline_expand(&target_file_inode) < 0) {
+		//no block to move the data out to
+	} else if (first == last) {
+		//within one block: merged in the cache, where small writes to the same block gather
+		//allocates the block (and any indirect block leading to it) if it has not been made yet
+		int fresh;
+		int block_number = map_write_block(&target_file_inode, first, &fresh);
+		if (block_number != -1) {
+			block_number += superblock->d_start_blk;
+			merge_block(block_number, fresh, current_block, offset % BLOCK_SIZE, buffer, size);
+			bio_write(block_number, current_block);
+			bytes_written = size;
 		}
-		//if block already exists 
-		else{
-			//printf("block already exists\n");
-			//printf("reading block %d\n", block_number);
-			
-		}
-
-		bio_read(block_number, current_block);
-
-
-		if(remaining_bytes <= BLOCK_SIZE){
-			//printf("can finish all of write in this block\n");
-			memcpy(current_block,buffer+bytes_written,  remaining_bytes);
-			bytes_written += remaining_bytes;
+	} else {
+		//whole blocks are allocated together and written from buffer, the partial first and
+		//last ones merged with what they held first, and it all goes out as one vector
+		char* last_block = malloc(BLOCK_SIZE);
+		struct bio_vec* vec = malloc((last - first + 1) * sizeof(struct bio_vec));
+		int nvec = 0;
+		//edges that are about to be allocated have nothing to read
+		int first_fresh = map_block(&target_file_inode, first, 0) == -1;
+		int last_fresh = map_block(&target_file_inode, last, 0) == -1;
+		int lblk = first;
+		while (lblk <= last) {
+			int run, i;
+			int block_number = map_run(&target_file_inode, lblk, last - lblk + 1, 1, &run);
+			if (block_number == -1) {
+				//out of data blocks
+				break;
+			}
+			block_number += superblock->d_start_blk;
+			for (i = 0; i < run; i++, lblk++) {
+				char* src = (char *)buffer + ((off_t)lblk * BLOCK_SIZE - offset);
+				if (lblk == first && offset % BLOCK_SIZE != 0) {
+					src = current_block;
+					merge_block(block_number + i, first_fresh, src, offset % BLOCK_SIZE, buffer, BLOCK_SIZE - offset % BLOCK_SIZE);
+				} else if (lblk == last && (offset + size) % BLOCK_SIZE != 0) {
+					src = last_block;
+					merge_block(block_number + i, last_fresh, src, 0, buffer + ((off_t)last * BLOCK_SIZE - offset), (offset + size) % BLOCK_SIZE);
+				}
+				vec[nvec].block = block_number + i;
+				vec[nvec].buf = src;
+				nvec++;
+			}
 		}
-		else{
-			//printf("can't fit, need new block\n");
-			memcpy(current_block,buffer+bytes_written,  BLOCK_SIZE);
-			bytes_written += BLOCK_SIZE;
+		bio_writev(vec, nvec);
+		free(vec);
+		free(last_block);
+		if (lblk > last) {
+			bytes_written = size;
+		} else if (lblk > first) {
+			bytes_written = (off_t)lblk * BLOCK_SIZE - offset;
 		}
+	}
+	free(current_block);
+	bmap_sync(target_file_inode.ino);
+	flush_bitmaps();
 
-		bio_write(block_number, current_block);               
+	// Step 4: Update the inode info and write it to disk
+	if (offset + bytes_written > target_file_inode.size) {
+		target_file_inode.size = offset + bytes_written;
+	}
+	if (bytes_written > 0) {
+		target_file_inode.mtime = target_file_inode.ctime = now_ns();
+	}
+	writei(target_file_inode.ino, &target_file_inode);
+	file_written(file);
 
+	// Note: this function should return the amount of bytes you write to disk
+	inode_unlock(target_file_inode.ino);
+	if (bytes_written == 0 && size > 0) {
+		return -ENOSPC;
+	}
+	return bytes_written;
+}
 
+/*
+ * Zero-copy write: whole blocks go from the request, usually a pipe
+ * spliced off /dev/fuse, straight into the disk file, with cached copies
+ * dropped first. Partial blocks are merged through the cache as in
+ * tfs_write().
+ */
+int tfs_write_buf(struct tfs_file *file, struct fuse_bufvec *buf, off_t offset) {
+	size_t size = fuse_buf_size(buf);
 
+	// Step 1: Get the inode from the open file
+	struct inode target_file_inode;
+	target_file_inode.ino = file->ino;
+	if (file->report != NULL) {
+		return -EBADF;
+	}
+	//with no host file under the disk there is nothing to splice into, so the data is copied
+	if (bio_fd() < 0) {
+		struct fuse_bufvec dst = FUSE_BUFVEC_INIT(size);
+		dst.buf[0].mem = malloc(size > 0 ? size : 1);
+		if (dst.buf[0].mem == NULL) {
+			return -ENOMEM;
+		}
+		ssize_t copied = fuse_buf_copy(&dst, buf, 0);
+		int retval = copied < 0 ? copied : tfs_write(file, dst.buf[0].mem, copied, offset);
+		free(dst.buf[0].mem);
+		return retval;
+	}
+	if (offset + size > (off_t)MAX_FILE_BLOCKS * BLOCK_SIZE) {
+		return -EFBIG;
+	}
+	inode_lock_excl(target_file_inode.ino);
+	readi(target_file_inode.ino, &target_file_inode);
+	if (target_file_inode.valid != 1) {
+		inode_unlock(target_file_inode.ino);
+		return -ENOENT;
 	}
 
-	// Step 2: Based on size and offset, read its data blocks from disk
+	// Step 2: A small file is copied into its inode, unless this write makes it outgrow it
+	void* current_block = malloc(BLOCK_SIZE);
+	size_t bytes_written = 0;
+	ssize_t copied = 0;
+	int in_inode = target_file_inode.flags & TFS_INLINE_FL;
+	if (in_inode && offset + size <= TFS_INLINE_MAX) {
+		struct fuse_bufvec dst = FUSE_BUFVEC_INIT(size);
+		dst.buf[0].mem = target_file_inode.inline_data + offset;
+		copied = fuse_buf_copy(&dst, buf, 0);
+		if (copied > 0) {
+			bytes_written = copied;
+		}
+	} else if (in_inode && inline_expand(&target_file_inode) == 0) {
+		in_inode = 0;
+	}
 
-	// Step 3: Write the correct amount of data from offset to disk
+	// Step 3: Copy each contiguous run of whole blocks with one fuse_buf_copy
+	while (!in_inode && bytes_written < size) {
+		off_t position = offset + bytes_written;
+		int block_offset = position % BLOCK_SIZE;
+		size_t chunk = BLOCK_SIZE - block_offset;
+		if (chunk > size - bytes_written) {
+			chunk = size - bytes_written;
+		}
 
-	// Step 4: Update the inode info and write it to disk
-	target_file_inode.size += bytes_written;
-	target_file_inode.vstat.st_size += bytes_written;
-	//printf("updated size of file: %d\n", target_file_inode.size);
-	//printf("updated size of file from vstat : %d\n", target_file_inode.vstat.st_size);
+		int whole = block_offset == 0 ? (size - bytes_written) / BLOCK_SIZE : 0;
+		if (whole > 0) {
+			int run;
+			int block_number = map_run(&target_file_inode, position / BLOCK_SIZE, whole, 1, &run);
+			if (block_number == -1) {
+				//out of data blocks
+				break;
+			}
+			block_number += superblock->d_start_blk;
+			bio_invalidate_range(block_number, run);
+			struct fuse_bufvec dst = FUSE_BUFVEC_INIT((size_t)run * BLOCK_SIZE);
+			dst.buf[0].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+			dst.buf[0].fd = bio_fd();
+			dst.buf[0].pos = (off_t)block_number * BLOCK_SIZE;
+			copied = fuse_buf_copy(&dst, buf, 0);
+			//and again, in case readahead queued before we had the file loaded the old contents meanwhile
+			bio_invalidate_range(block_number, run);
+			if (copied < 0) {
+				break;
+			}
+			bytes_written += copied;
+			if ((size_t)copied < (size_t)run * BLOCK_SIZE) {
+				break;
+			}
+			continue;
+		}
 
+		// Step 4: A partial block is read (unless just allocated), patched and written back through the cache
+		int fresh;
+		int block_number = map_write_block(&target_file_inode, position / BLOCK_SIZE, &fresh);
+		if (block_number == -1) {
+			break;
+		}
+		block_number += superblock->d_start_blk;
+		merge_block(block_number, fresh, current_block, block_offset, NULL, chunk);
+		struct fuse_bufvec dst = FUSE_BUFVEC_INIT(chunk);
+		dst.buf[0].mem = current_block + block_offset;
+		copied = fuse_buf_copy(&dst, buf, 0);
+		if (copied < 0) {
+			break;
+		}
+		bio_write(block_number, current_block);
+		bytes_written += copied;
+		if ((size_t)copied < chunk) {
+			break;
+		}
+	}
+	free(current_block);
+	bmap_sync(target_file_inode.ino);
+	flush_bitmaps();
 
+	// Step 5: Update the inode info and write it to disk
+	if (offset + bytes_written > target_file_inode.size) {
+		target_file_inode.size = offset + bytes_written;
+	}
+	if (bytes_written > 0) {
+		target_file_inode.mtime = target_file_inode.ctime = now_ns();
+	}
 	writei(target_file_inode.ino, &target_file_inode);
-	readi(target_file_inode.ino, &target_file_inode);
-	//printf("updated size of file in disk: %d\n", target_file_inode.size);
-	//printf("updated size of file from vstat indisk : %d\n", target_file_inode.vstat.st_size);
+	file_written(file);
 
-	// Note: this function should return the amount of bytes you write to disk
-	//printf("RELEASING LOCK IN WRITE\n");
-	
-	pthread_mutex_unlock(&lock);
+	inode_unlock(target_file_inode.ino);
+	if (bytes_written == 0 && size > 0) {
+		return copied < 0 ? copied : -ENOSPC;
+	}
 	return bytes_written;
 }
 
-static int tfs_rmdir(const char *path) {
-	//printf("LOCKING RMDIR\n");
-	pthread_mutex_lock(&lock);
+int tfs_rmdir(const char *path) {
 	//printf("-----------------------------\n");
 	// Step 1: Use dirname() and basename() to separate parent directory path and target directory name
 	//printf("entered tfs_rmdir\n");
@@ -1332,7 +3356,7 @@ static int tfs_rmdir(const char *path) {
 	//file is not directly under root
 	else {
 		int length_of_parent_directory_name = basename - path;
-		char* dirname = malloc(length_of_parent_directory_name + 1);
+		dirname = malloc(length_of_parent_directory_name + 1);
 		memcpy(dirname, path, length_of_parent_directory_name);
 		dirname[length_of_parent_directory_name] = '\0';
 	}
@@ -1343,49 +3367,51 @@ static int tfs_rmdir(const char *path) {
 	// if absolute path is /foo/bar/tmp, basename will be "/tmp" after strrchr
 
 
-	//get target directory inode 
+	//get and lock the parent directory first, then find and lock the target directory in it
+	struct inode parent_directory_inode;
 	struct inode target_directory_inode;
-	int retval = get_node_by_path(path, 0, &target_directory_inode);
-	if(retval < 0){
+	struct dirent target_entry;
+	int retval = get_node_by_path(dirname, 0, &parent_directory_inode);
+	if (retval < 0 || lock_dir(parent_directory_inode.ino, &parent_directory_inode) < 0) {
+		//printf("dir not found\n");
+		return -ENOENT;
+	}
+	if (dir_find(parent_directory_inode.ino, basename, strlen(basename), &target_entry) < 0) {
 		//printf("target directory not found \n");
-		//printf("RELEASING LOCK IN RMDIR\n");
-		pthread_mutex_unlock(&lock);
+		inode_unlock(parent_directory_inode.ino);
 		return -ENOENT;
 	}
-
-	//clear data block bitmap of target directory
-	int i;
-	for(i = 0; i < 16; i++){
-		int data_block_to_clear = target_directory_inode.direct_ptr[i];
-		if(data_block_to_clear == -1){
-			continue;
-		}
-		//printf("unsetting this bit: %d for inode %d at block %d\n", get_bitmap(data_region_bitmap, data_block_to_clear), target_directory_inode.ino, target_directory_inode.direct_ptr[i]);
-		unset_bitmap(data_region_bitmap, data_block_to_clear);
-		target_directory_inode.direct_ptr[i] = -1;
+	inode_lock_excl(target_entry.ino);
+	readi(target_entry.ino, &target_directory_inode);
+	retval = 0;
+	if (target_directory_inode.type != 0) {
+		retval = -ENOTDIR;
+	} else if (target_directory_inode.link > 2) {
+		//anything besides . and ..
+		retval = -ENOTEMPTY;
+	}
+	if (retval < 0) {
+		inode_unlock(target_directory_inode.ino);
+		inode_unlock(parent_directory_inode.ino);
+		return retval;
 	}
-	bio_write(2, data_region_bitmap);
 
-	//clear inode bitmap for target directory inode 
-	unset_bitmap(inode_bitmap, target_directory_inode.ino);
-	bio_write(1, inode_bitmap);
+	//remove the directory entry corresponding to the target directory inside the parent directory
+	dir_remove(parent_directory_inode, basename, strlen(basename));
 
-	//clear inodes data block
-	target_directory_inode.valid = 0;
-	writei(target_directory_inode.ino, &target_directory_inode);
+	//names cached under the removed directory must not outlive it, its ino will be reused
+	dcache_remove_dir(target_directory_inode.ino);
 
+	//clear data block bitmap of target directory
+	free_inode_blocks(&target_directory_inode);
 
-	//remove the directory entry corresponding to the target directory inside the parent directory
-	struct inode parent_directory_inode;
-	//Call get_node_by_path() to get inode of parent directory
-	retval = get_node_by_path(dirname, 0, &parent_directory_inode);
-	if (retval < 0) {
-		//printf("dir not found\n");
-		//printf("RELEASING LOCK IN RMDIR\n");
-		pthread_mutex_unlock(&lock);
-		return -ENOENT;
-	}
-	dir_remove(parent_directory_inode, basename, strlen(basename));
+	//clear inode bitmap for target directory inode, a create may take the ino as soon as it is released
+	target_directory_inode.valid = 0;
+	writei(target_directory_inode.ino, &target_directory_inode);
+	release_ino(target_directory_inode.ino);
+	flush_bitmaps();
+	inode_unlock(target_directory_inode.ino);
+	inode_unlock(parent_directory_inode.ino);
 	// Step 1: Use dirname() and basename() to separate parent directory path and target directory name
 
 	// Step 2: Call get_node_by_path() to get inode of target directory
@@ -1399,13 +3425,13 @@ static int tfs_rmdir(const char *path) {
 
 	// Step 6: Call dir_remove() to remove directory entry of target directory in its parent directory
 	//printf("RELEASING LOCK IN RMDIR\n");
-	pthread_mutex_unlock(&lock);
 	return 0;
 }
 
-static int tfs_unlink(const char *path) {
-	//printf("LOCKING UNLINK\n");
-	pthread_mutex_lock(&lock);
+int tfs_unlink(const char *path) {
+	if (stats_file(path)) {
+		return -EPERM;
+	}
 	//printf("-----------------------------\n");
 	// Step 1: Use dirname() and basename() to separate parent directory path and target directory name
 	//printf("entered tfs_unlink\n");
@@ -1421,7 +3447,7 @@ static int tfs_unlink(const char *path) {
 	//file is not directly under root
 	else {
 		int length_of_parent_directory_name = basename - path;
-		char* dirname = malloc(length_of_parent_directory_name + 1);
+		dirname = malloc(length_of_parent_directory_name + 1);
 		memcpy(dirname, path, length_of_parent_directory_name);
 		dirname[length_of_parent_directory_name] = '\0';
 	}
@@ -1431,111 +3457,112 @@ static int tfs_unlink(const char *path) {
 	//printf("dirname: %s, truncated basename: %s\n", dirname, basename);
 	// if absolute path is /foo/bar/tmp, basename will be "/tmp" after strrchr
 	
-	// Step 2: Call get_node_by_path() to get inode of target file
-	int retval = get_node_by_path(path, 0, &target_inode);
-	if (retval < 0) {
+	// Step 2: Call get_node_by_path() to get inode of parent directory, and lock it before the target file
+	struct inode parent_inode;
+	struct dirent target_entry;
+	int retval = get_node_by_path(dirname, 0, &parent_inode);
+	if (retval < 0 || lock_dir(parent_inode.ino, &parent_inode) < 0) {
+		//printf("parent inode not found\n");
+		return -ENOENT;
+	}
+	if (dir_find(parent_inode.ino, basename, strlen(basename), &target_entry) < 0) {
 		//printf("target_file inode not found\n");
-		//printf("RELEASING LOCK IN UNLINK\n");
-		pthread_mutex_unlock(&lock);
+		inode_unlock(parent_inode.ino);
 		return -ENOENT;
 	}
-
-	// Step 3: Clear data block bitmap of target file
-	int i;
-	for(i = 0; i < 16; i++){
-		int current_data_block_number = target_inode.direct_ptr[i];
-		if(current_data_block_number == -1){
-			continue;
-		}
-		//printf("unsetting this bit: %d for inode %d at block %d\n", get_bitmap(data_region_bitmap, current_data_block_number), target_inode.ino, target_inode.direct_ptr[i]);
-		unset_bitmap(data_region_bitmap, current_data_block_number);
-		target_inode.direct_ptr[i] = -1;
+	inode_lock_excl(target_entry.ino);
+	readi(target_entry.ino, &target_inode);
+	if (target_inode.type == 0) {
+		inode_unlock(target_inode.ino);
+		inode_unlock(parent_inode.ino);
+		return -EISDIR;
 	}
-	bio_write(2, data_region_bitmap);
 
-	// Step 4: Clear inode bitmap and its data block
-	unset_bitmap(inode_bitmap, target_inode.ino);
-	target_inode.valid = 0;
-	writei(target_inode.ino, &target_inode);
-	bio_write(1, inode_bitmap);
-	
-	// Step 5: Call get_node_by_path() to get inode of parent directory
-	struct inode parent_inode;
-	retval = get_node_by_path(dirname, 0, &parent_inode);
-	if (retval < 0) {
-		//printf("parent inode not found\n");
-		//printf("RELEASING LOCK IN UNLINK\n");
-		pthread_mutex_unlock(&lock);
-		return -ENOENT;
-	}
-	
-	
-	// Step 6: Call dir_remove() to remove directory entry of target file in its parent directory
+	// Step 3: Call dir_remove() to remove directory entry of target file in its parent directory
 	dir_remove(parent_inode, basename, strlen(basename));
-	//printf("RELEASING LOCK IN UNLINK\n");
-	pthread_mutex_unlock(&lock);
-	return 0;
-}
 
-static int tfs_truncate(const char *path, off_t size) {
-	// For this project, you don't need to fill this function
-	// But DO NOT DELETE IT!
-    return 0;
-}
+	if (inode_pinned(target_inode.ino)) {
+		// Step 4: A file still open keeps its blocks and inode until its last release
+		orphans_count(1);
+		target_inode.flags |= TFS_ORPHAN_FL;
+		writei(target_inode.ino, &target_inode);
+	} else {
+		// Step 4: Clear data block bitmap of target file
+		free_inode_blocks(&target_inode);
 
-static int tfs_release(const char *path, struct fuse_file_info *fi) {
-	// For this project, you don't need to fill this function
-	// But DO NOT DELETE IT!
+		// Step 5: Clear inode bitmap and its data block, a create may take the ino as soon as it is released
+		target_inode.valid = 0;
+		writei(target_inode.ino, &target_inode);
+		release_ino(target_inode.ino);
+	}
+	flush_bitmaps();
+	//printf("RELEASING LOCK IN UNLINK\n");
+	inode_unlock(target_inode.ino);
+	inode_unlock(parent_inode.ino);
 	return 0;
 }
 
-static int tfs_flush(const char * path, struct fuse_file_info * fi) {
+int tfs_truncate(const char *path, off_t size) {
 	// For this project, you don't need to fill this function
 	// But DO NOT DELETE IT!
     return 0;
 }
 
-static int tfs_utimens(const char *path, const struct timespec tv[2]) {
-	// For this project, you don't need to fill this function
-	// But DO NOT DELETE IT!
-    return 0;
+void tfs_release(struct tfs_file *file) {
+	// Drop what open or create kept for this file
+	file_release(file);
 }
 
+//Whether reads of file must bypass the kernel page cache, as a stats file's must
+int tfs_direct_io(struct tfs_file *file) {
+	return file->report != NULL;
+}
 
-static struct fuse_operations tfs_ope = {
-	.init		= tfs_init,
-	.destroy	= tfs_destroy,
-
-	.getattr	= tfs_getattr,
-	.readdir	= tfs_readdir,
-	.opendir	= tfs_opendir,
-	.releasedir	= tfs_releasedir,
-	.mkdir		= tfs_mkdir,
-	.rmdir		= tfs_rmdir,
-
-	.create		= tfs_create,
-	.open		= tfs_open,
-	.read 		= tfs_read,
-	.write		= tfs_write,
-	.unlink		= tfs_unlink,
-
-	.truncate   = tfs_truncate,
-	.flush      = tfs_flush,
-	.utimens    = tfs_utimens,
-	.release	= tfs_release
-};
-
-
-int main(int argc, char *argv[]) {
-	int fuse_stat;
-
-	getcwd(diskfile_path, PATH_MAX);
-	strcat(diskfile_path, "/DISKFILE");
+int tfs_flush(struct tfs_file *file) {
+	// Nothing to do for a file that was not written through since it was last flushed
+	if (file != NULL) {
+		pthread_mutex_lock(&file->lock);
+		int written = file->written;
+		file->written = 0;
+		pthread_mutex_unlock(&file->lock);
+		if (!written) {
+			return 0;
+		}
+	}
 
-	fuse_stat = fuse_main(argc, argv, &tfs_ope, NULL);
+	// Write back inodes and blocks the caches are still holding for this mount
+	flush_bitmaps();
+	flush_inodes();
+	int retval = bio_flush();
+	return retval < 0 ? -EIO : 0;
+}
 
-	
+int tfs_utimens(const char *path, const struct timespec tv[2]) {
+	// Step 1: Call get_node_by_path() to get inode from path
+	struct inode inode;
+	if (get_node_by_path(path, 0, &inode) < 0) {
+		return -ENOENT;
+	}
+	inode_lock_excl(inode.ino);
+	readi(inode.ino, &inode);
+	if (inode.valid != 1) {
+		inode_unlock(inode.ino);
+		return -ENOENT;
+	}
 
-	return fuse_stat;
+	// Step 2: Set access and modification times, NULL meaning now as for utimes(2)
+	int64_t now = now_ns();
+	int64_t* times[2] = { &inode.atime, &inode.mtime };
+	int i;
+	for (i = 0; i < 2; i++) {
+		if (tv == NULL || tv[i].tv_nsec == UTIME_NOW) {
+			*times[i] = now;
+		} else if (tv[i].tv_nsec != UTIME_OMIT) {
+			*times[i] = (int64_t)tv[i].tv_sec * 1000000000 + tv[i].tv_nsec;
+		}
+	}
+	inode.ctime = now;
+	writei(inode.ino, &inode);
+	inode_unlock(inode.ino);
+	return 0;
 }
-
@@ -17,55 +17,168 @@
 #ifndef _TFS_H
 #define _TFS_H
 
-#define MAGIC_NUM 0x5C3A
-#define MAX_INUM 1024
-#define MAX_DNUM 16384
+/*
+ * The original tfs wrote its superblock from a struct holding only the
+ * fields up to d_start_blk, so on its volumes the rest of block 0 is
+ * whatever was in memory. They have MAGIC_NUM_LEGACY; MAGIC_NUM says the
+ * whole superblock was written.
+ */
+#define MAGIC_NUM			0x5C3B
+#define MAGIC_NUM_LEGACY	0x5C3A
 
+/* mkfs defaults */
+#define TFS_DISK_MB		32			/* volume size in MiB */
+#define TFS_INODE_RATIO	32768		/* bytes of volume per inode, unless the inode count is given */
 
+/*
+ * The volume is laid out as the superblock in block 0, then the inode
+ * bitmap, the data block bitmap and the inode table, each as many blocks
+ * as it needs, then the data region. Inode and data block counts are
+ * multiples of 64, so bitmaps are whole 64-bit words.
+ */
 struct superblock {
 	uint32_t	magic_num;			/* magic number */
-	uint16_t	max_inum;			/* maximum inode number */
-	uint16_t	max_dnum;			/* maximum data block number */
+	uint16_t	max_inum;			/* number of inodes, with MAGIC_NUM_LEGACY */
+	uint16_t	max_dnum;			/* number of data blocks, with MAGIC_NUM_LEGACY */
 	uint32_t	i_bitmap_blk;		/* start block of inode bitmap */
 	uint32_t	d_bitmap_blk;		/* start block of data block bitmap */
 	uint32_t	i_start_blk;		/* start block of inode region */
 	uint32_t	d_start_blk;		/* start block of data block region */
+	uint32_t	features;			/* TFS_FEATURE_* chosen at mkfs */
+	uint32_t	block_size;			/* bytes per block */
+	uint32_t	inodes;				/* number of inodes */
+	uint32_t	data_blocks;		/* number of data region blocks */
+	uint64_t	disk_blocks;		/* blocks on the volume */
+	uint32_t	orphans;			/* inodes with TFS_ORPHAN_FL, which mount looks for when not 0 */
 };
 
+/* superblock features */
+#define TFS_FEATURE_EXTENTS	0x0001		/* regular files are created with extent maps */
+#define TFS_FEATURE_DIRREC	0x0002		/* directory blocks hold struct dirent_rec records */
+#define TFS_FEATURE_INODE128	0x0004	/* inodes are the 128-byte struct inode */
+#define TFS_FEATURE_INLINE	0x0008		/* small files may keep their data in inline_data */
+
+/*
+ * On-disk inode, 128 bytes with fixed-width fields only, so the format
+ * does not depend on the host. Times are nanoseconds since the epoch.
+ */
 struct inode {
-	uint16_t	ino;				/* inode number */
-	uint16_t	valid;				/* validity of the inode */
-	uint32_t	size;				/* size of the file */
-	uint32_t	type;				/* type of the file */
+	uint32_t	ino;				/* inode number */
+	uint8_t		valid;				/* validity of the inode */
+	uint8_t		type;				/* type of the file */
+	uint16_t	flags;				/* TFS_*_FL inode flags */
 	uint32_t	link;				/* link count */
-	int			direct_ptr[16];		/* direct pointer to data block */
-	int			indirect_ptr[8];	/* indirect pointer to data block */
-	struct stat	vstat;				/* inode stat */
+	uint32_t	mode;				/* file type and permission bits, as st_mode */
+	uint32_t	uid;				/* owner */
+	uint32_t	gid;				/* group */
+	uint64_t	size;				/* size of the file, for a directory the bytes of its records */
+	int64_t		atime;				/* last access */
+	int64_t		mtime;				/* last change of the contents */
+	int64_t		ctime;				/* last change of the inode */
+	union {
+		struct {
+			int		direct_ptr[16];		/* direct pointer to data block */
+			int		indirect_ptr[2];	/* single and double indirect block */
+		};
+		uint32_t	extent_root[18];	/* extent tree root, with TFS_EXTENTS_FL */
+		char		inline_data[72];	/* the file's data, with TFS_INLINE_FL */
+	};
 };
 
+/* inode flags, kept in what used to be the upper half of a 32-bit type */
+#define TFS_INDIRECT_FL	0x0001			/* indirect_ptr[] has been initialised */
+#define TFS_INDEX_FL	0x0002			/* directory uses a hashed index (struct dx_root) */
+#define TFS_EXTENTS_FL	0x0004			/* blocks are mapped by extents in extent_root */
+#define TFS_ORPHAN_FL	0x0008			/* unlinked while open, freed by the last release */
+#define TFS_INLINE_FL	0x0010			/* data is in inline_data and the file has no blocks */
+
+/* dirent file types, 0 for entries written before the type was recorded */
+#define TFS_FT_UNKNOWN	0
+#define TFS_FT_REG		1
+#define TFS_FT_DIR		2
+
+/* a directory entry as lookups return it */
 struct dirent {
-	uint16_t ino;					/* inode number of the directory entry */
+	uint32_t ino;					/* inode number of the directory entry */
 	uint16_t valid;					/* validity of the directory entry */
-	char name[208];					/* name of the directory entry */
+	char name[207];					/* name of the directory entry */
+	uint8_t type;					/* file type of the entry (TFS_FT_*) */
 	uint16_t len;					/* length of name */
 };
 
+/*
+ * Directory blocks hold variable-length records packed from the start of
+ * the block and followed by zeroes, so a record with rec_len 0 ends the
+ * block. Removing an entry moves the records after it down.
+ */
+struct dirent_rec {
+	uint32_t ino;					/* inode number of the directory entry */
+	uint16_t rec_len;				/* bytes from this record to the next */
+	uint8_t name_len;				/* length of name */
+	uint8_t type;					/* file type of the entry (TFS_FT_*) */
+	char name[];					/* name_len bytes and a NUL */
+};
+
+#define DIRENT_REC_LEN(name_len)	((sizeof(struct dirent_rec) + (name_len) + 1 + 3) & ~3)
 
 /*
- * bitmap operations
+ * Hashed directory index. Logical block 0 of an indexed directory holds a
+ * dx_root whose entries map name hash ranges to leaf blocks (levels 0) or
+ * to dx_node blocks that map them to leaf blocks (levels 1). Leaf blocks
+ * hold ordinary dirents. Entry i covers hashes from entries[i].hash up to
+ * the next entry's hash; entries[0].hash is always 0.
  */
-typedef unsigned char* bitmap_t;
+#define DX_ROOT_MAGIC	0xD1CE7E50
+#define DX_NODE_MAGIC	0xD1CE7E51		/* never a dirent: ino would read this, past any inode count */
 
-void set_bitmap(bitmap_t b, int i) {
-    b[i / 8] |= 1 << (i & 7);
-}
+struct dx_entry {
+	uint32_t	hash;				/* lowest name hash covered */
+	uint32_t	block;				/* logical block within the directory */
+};
+
+struct dx_root {
+	uint32_t	magic;				/* DX_ROOT_MAGIC */
+	uint32_t	levels;				/* dx_node levels below the root, 0 or 1 */
+	uint32_t	nblocks;			/* logical blocks used by the directory */
+	uint32_t	count;				/* entries in use */
+	struct dx_entry	entries[];
+};
+
+struct dx_node {
+	uint32_t	magic;				/* DX_NODE_MAGIC */
+	uint32_t	count;				/* entries in use */
+	struct dx_entry	entries[];
+};
+
+/*
+ * Extent maps. An extent maps len logical blocks starting at lblk onto
+ * consecutive data region blocks starting at pblk. The root of an inode's
+ * tree sits in extent_root: with depth 0 it holds the extents itself,
+ * otherwise extent_idx entries pointing at blocks of depth one less, down
+ * to leaf blocks of depth 0. Each node is a header followed by its
+ * entries, kept sorted by lblk. A full root moves its entries down into a
+ * new block, so the tree gets deeper as a file gets more fragmented. The
+ * root has the 72 bytes of the block map, room for 5 entries.
+ */
+#define EXT_MAGIC		0xE7E5
+
+struct extent_header {
+	uint16_t	magic;				/* EXT_MAGIC */
+	uint16_t	entries;			/* entries in use */
+	uint16_t	max;				/* entries that fit */
+	uint16_t	depth;				/* 0 if the entries are extents */
+};
 
-void unset_bitmap(bitmap_t b, int i) {
-    b[i / 8] &= ~(1 << (i & 7));
-}
+struct extent {
+	uint32_t	lblk;				/* first logical block */
+	uint32_t	pblk;				/* first data region block */
+	uint32_t	len;				/* number of blocks */
+};
 
-uint8_t get_bitmap(bitmap_t b, int i) {
-    return b[i / 8] & (1 << (i & 7)) ? 1 : 0;
-}
+struct extent_idx {
+	uint32_t	lblk;				/* first logical block covered by the child */
+	uint32_t	child;				/* data region block holding the node one level down */
+	uint32_t	unused;
+};
 
 #endif
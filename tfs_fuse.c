@@ -0,0 +1,246 @@
+/*
+ *	Tiny File System
+ *	File:	tfs_fuse.c
+ *
+ */
+#define FUSE_USE_VERSION 26
+
+#include <fuse.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <limits.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <fcntl.h>
+
+#include "stats.h"
+#include "libtfs.h"
+
+/*
+ * The FUSE front end: mount options, and handlers that hand each request
+ * to libtfs. Open files are kept in fi->fh.
+ */
+static char diskfile_path[PATH_MAX];
+
+/*
+ * Mount options, parsed in main() with fuse_opt_parse
+ */
+struct tfs_config {
+	struct tfs_options	opts;			/* given to tfs_mount() */
+	int					nosplice;		/* copy file data instead of using read_buf/write_buf */
+};
+
+static struct tfs_config config;
+
+#define TFS_OPT(templ, field) { templ, offsetof(struct tfs_config, opts.field), 0 }
+#define TFS_FLAG(templ, field) { templ, offsetof(struct tfs_config, opts.field), 1 }
+
+static struct fuse_opt tfs_opts[] = {
+	TFS_OPT("cache_mb=%lu", cache_mb),
+	TFS_OPT("dcache_entries=%d", dcache_entries),
+	TFS_OPT("uring=%d", uring),
+	TFS_OPT("readahead_kb=%d", readahead_kb),
+	TFS_OPT("backend=%s", backend),
+	TFS_OPT("disk_mb=%lu", disk_mb),
+	TFS_OPT("inodes=%lu", inodes),
+	TFS_OPT("block_size=%u", block_size),
+	TFS_FLAG("extents", extents),
+	TFS_FLAG("mmap", mmap),
+	TFS_FLAG("nostats", nostats),
+	{ "nosplice", offsetof(struct tfs_config, nosplice), 1 },
+	FUSE_OPT_END
+};
+
+//The file a request is for: the one open in fi, or failing that, path opened for just this request
+static int file_for(const char *path, struct fuse_file_info *fi, struct tfs_file **filep) {
+	*filep = fi != NULL ? (struct tfs_file *)(uintptr_t)fi->fh : NULL;
+	if (*filep != NULL) {
+		return 0;
+	}
+	return tfs_open(path, O_RDWR, filep);
+}
+
+static void file_done(struct fuse_file_info *fi, struct tfs_file *file) {
+	if (fi == NULL || fi->fh == 0) {
+		tfs_release(file);
+	}
+}
+
+static void *tfs_init(struct fuse_conn_info *conn) {
+	// Let the kernel splice file data straight to and from the disk file
+	if (!config.nosplice) {
+		conn->want |= conn->capable & (FUSE_CAP_SPLICE_READ | FUSE_CAP_SPLICE_WRITE | FUSE_CAP_SPLICE_MOVE);
+	}
+	if (tfs_mount(diskfile_path, &config.opts) < 0) {
+		fprintf(stderr, "%s: can not mount\n", diskfile_path);
+		exit(1);
+	}
+	return NULL;
+}
+
+static void tfs_destroy(void *userdata) {
+	tfs_unmount();
+}
+
+static int open_file(const char *path, struct fuse_file_info *fi) {
+	struct tfs_file* file = NULL;
+	int retval = tfs_open(path, fi->flags, &file);
+	if (retval == 0) {
+		fi->fh = (uintptr_t)file;
+		fi->direct_io = tfs_direct_io(file);
+	}
+	return retval;
+}
+
+static int create_file(const char *path, mode_t mode, struct fuse_file_info *fi) {
+	struct tfs_file* file = NULL;
+	struct fuse_context* ctx = fuse_get_context();
+	int retval = tfs_create(path, mode, ctx->uid, ctx->gid, &file);
+	if (retval == 0) {
+		fi->fh = (uintptr_t)file;
+	}
+	return retval;
+}
+
+static int read_file(const char *path, char *buffer, size_t size, off_t offset, struct fuse_file_info *fi) {
+	struct tfs_file* file;
+	int retval = file_for(path, fi, &file);
+	if (retval == 0) {
+		retval = tfs_read(file, buffer, size, offset);
+		file_done(fi, file);
+	}
+	return retval;
+}
+
+static int write_file(const char *path, const char *buffer, size_t size, off_t offset, struct fuse_file_info *fi) {
+	struct tfs_file* file;
+	int retval = file_for(path, fi, &file);
+	if (retval == 0) {
+		retval = tfs_write(file, buffer, size, offset);
+		file_done(fi, file);
+	}
+	return retval;
+}
+
+static int read_buf(const char *path, struct fuse_bufvec **bufp, size_t size, off_t offset, struct fuse_file_info *fi) {
+	struct tfs_file* file;
+	int retval = file_for(path, fi, &file);
+	if (retval == 0) {
+		retval = tfs_read_buf(file, bufp, size, offset);
+		file_done(fi, file);
+	}
+	return retval;
+}
+
+static int write_buf(const char *path, struct fuse_bufvec *buf, off_t offset, struct fuse_file_info *fi) {
+	struct tfs_file* file;
+	int retval = file_for(path, fi, &file);
+	if (retval == 0) {
+		retval = tfs_write_buf(file, buf, offset);
+		file_done(fi, file);
+	}
+	return retval;
+}
+
+static int release_file(struct fuse_file_info *fi) {
+	tfs_release((struct tfs_file *)(uintptr_t)fi->fh);
+	fi->fh = 0;
+	return 0;
+}
+
+/*
+ * Every handler is timed for the stats files: its latency, whether it
+ * failed, and the bytes it moved.
+ */
+#define TIMED(op, call, bytes) { \
+	uint64_t start = stats_now(); \
+	int retval = call; \
+	stats_op_done(op, start, retval < 0, retval < 0 ? 0 : (bytes)); \
+	return retval; \
+}
+
+static int timed_getattr(const char *path, struct stat *stbuf)
+	TIMED(STATS_GETATTR, tfs_getattr(path, stbuf), 0)
+static int timed_opendir(const char *path, struct fuse_file_info *fi)
+	TIMED(STATS_OPENDIR, tfs_opendir(path), 0)
+static int timed_readdir(const char *path, void *buffer, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info *fi)
+	TIMED(STATS_READDIR, tfs_readdir(path, buffer, filler), 0)
+static int timed_releasedir(const char *path, struct fuse_file_info *fi)
+	TIMED(STATS_RELEASEDIR, 0, 0)
+static int timed_mkdir(const char *path, mode_t mode)
+	TIMED(STATS_MKDIR, tfs_mkdir(path, mode, fuse_get_context()->uid, fuse_get_context()->gid), 0)
+static int timed_rmdir(const char *path)
+	TIMED(STATS_RMDIR, tfs_rmdir(path), 0)
+static int timed_create(const char *path, mode_t mode, struct fuse_file_info *fi)
+	TIMED(STATS_CREATE, create_file(path, mode, fi), 0)
+static int timed_open(const char *path, struct fuse_file_info *fi)
+	TIMED(STATS_OPEN, open_file(path, fi), 0)
+static int timed_read(const char *path, char *buffer, size_t size, off_t offset, struct fuse_file_info *fi)
+	TIMED(STATS_READ, read_file(path, buffer, size, offset, fi), retval)
+static int timed_write(const char *path, const char *buffer, size_t size, off_t offset, struct fuse_file_info *fi)
+	TIMED(STATS_WRITE, write_file(path, buffer, size, offset, fi), retval)
+static int timed_read_buf(const char *path, struct fuse_bufvec **bufp, size_t size, off_t offset, struct fuse_file_info *fi)
+	TIMED(STATS_READ_BUF, read_buf(path, bufp, size, offset, fi), fuse_buf_size(*bufp))
+static int timed_write_buf(const char *path, struct fuse_bufvec *buf, off_t offset, struct fuse_file_info *fi)
+	TIMED(STATS_WRITE_BUF, write_buf(path, buf, offset, fi), retval)
+static int timed_unlink(const char *path)
+	TIMED(STATS_UNLINK, tfs_unlink(path), 0)
+static int timed_truncate(const char *path, off_t size)
+	TIMED(STATS_TRUNCATE, tfs_truncate(path, size), 0)
+static int timed_flush(const char *path, struct fuse_file_info *fi)
+	TIMED(STATS_FLUSH, tfs_flush(fi != NULL ? (struct tfs_file *)(uintptr_t)fi->fh : NULL), 0)
+static int timed_utimens(const char *path, const struct timespec tv[2])
+	TIMED(STATS_UTIMENS, tfs_utimens(path, tv), 0)
+static int timed_release(const char *path, struct fuse_file_info *fi)
+	TIMED(STATS_RELEASE, release_file(fi), 0)
+
+static struct fuse_operations tfs_ope = {
+	.init		= tfs_init,
+	.destroy	= tfs_destroy,
+
+	.getattr	= timed_getattr,
+	.readdir	= timed_readdir,
+	.opendir	= timed_opendir,
+	.releasedir	= timed_releasedir,
+	.mkdir		= timed_mkdir,
+	.rmdir		= timed_rmdir,
+
+	.create		= timed_create,
+	.open		= timed_open,
+	.read 		= timed_read,
+	.write		= timed_write,
+	.read_buf	= timed_read_buf,
+	.write_buf	= timed_write_buf,
+	.unlink		= timed_unlink,
+
+	.truncate   = timed_truncate,
+	.flush      = timed_flush,
+	.utimens    = timed_utimens,
+	.release	= timed_release
+};
+
+
+int main(int argc, char *argv[]) {
+	int fuse_stat;
+
+	getcwd(diskfile_path, PATH_MAX);
+	strcat(diskfile_path, "/DISKFILE");
+
+	tfs_options_init(&config.opts);
+	struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+	if (fuse_opt_parse(&args, &config, tfs_opts, NULL) == -1) {
+		return 1;
+	}
+	if (config.nosplice) {
+		tfs_ope.read_buf = NULL;
+		tfs_ope.write_buf = NULL;
+	}
+
+	fuse_stat = fuse_main(args.argc, args.argv, &tfs_ope, NULL);
+
+	fuse_opt_free_args(&args);
+
+	return fuse_stat;
+}
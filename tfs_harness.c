@@ -0,0 +1,604 @@
+/*
+ *	Tiny File System
+ *	File:	tfs_harness.c
+ *
+ */
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "libtfs.h"
+
+/*
+ * In-process benchmark. Mounts a DISKFILE through libtfs and drives the
+ * calls FUSE would make straight from N threads, so the allocators, the
+ * directory code and the data paths are timed without kernel round trips
+ * and can be profiled with perf. Prints one JSON object with a result per
+ * phase, as benchmark/tfs_bench does for a mount.
+ *
+ *	seq		sequential write, then read, of a file per thread
+ *	rand	random aligned writes, then reads, over the same files
+ *	meta	each thread creates, stats, then unlinks files in its own directory
+ *	alloc	each thread creates a file, writes it, and unlinks it, over and over
+ *	bigdir	all threads creating, stating, listing and unlinking names in one directory
+ *
+ *	./tfs_harness -t 8 -s 4k -c 8 DISKFILE
+ *	./tfs_harness -b hdd:rpm=5400 -w seq,rand DISKFILE
+ *	./tfs_harness -F -d 16g -i 1000000 -n 10000 -e 100000 DISKFILE
+ *
+ * The disk file is made if it is not there, or with -F, sized by -d and
+ * -i; with -b ram, hdd or ssd the disk is made in memory instead and
+ * diskfile only names it. Everything is made under /tfs_harness and
+ * removed afterwards. Threads times files, and the directory entries,
+ * have to fit in the disk's inodes, 1024 on the default 32 MiB disk.
+ */
+#define HARNESS_DIR "/tfs_harness"
+#define PATHLEN 256
+#define FILEPERM (S_IFREG | 0666)
+#define DIRPERM 0755
+#define MAX_PHASES 32
+
+struct params {
+	const char	*diskfile;
+	int			threads;
+	size_t		io_size;				/* bytes per read or write for seq, rand and alloc */
+	size_t		file_size;				/* bytes per thread for seq and rand */
+	int			files;					/* files per thread for meta and alloc */
+	int			dir_entries;			/* names in the directory for bigdir */
+	const char	*workloads;
+};
+
+static struct params p = {
+	.threads = 4,
+	.io_size = 4 << 10,
+	.file_size = 4 << 20,
+	.files = 64,
+	.dir_entries = 512,
+	.workloads = "seq,rand,meta,alloc,bigdir",
+};
+
+struct worker {
+	int			id;
+	pthread_t	thread;
+	uint64_t	*lat;					/* ns per operation */
+	size_t		nlat;
+	size_t		cap;
+	uint64_t	bytes;
+	int			errors;
+	uint64_t	began;					/* when the thread started and finished the phase */
+	uint64_t	ended;
+	unsigned	seed;
+	char		*buf;
+};
+
+typedef void (*phase_fn)(struct worker *w);
+
+struct result {
+	const char	*name;
+	size_t		ops;
+	uint64_t	bytes;
+	int			errors;
+	double		secs;
+	double		p50, p99, p999;			/* us */
+};
+
+static struct worker *workers;
+static pthread_barrier_t start_line;
+static struct result results[MAX_PHASES];
+static int nresults = 0;
+
+static uint64_t now_ns() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void record(struct worker *w, uint64_t start) {
+	if (w->nlat == w->cap) {
+		w->cap = w->cap ? w->cap * 2 : 1024;
+		w->lat = realloc(w->lat, w->cap * sizeof(uint64_t));
+	}
+	w->lat[w->nlat++] = now_ns() - start;
+}
+
+static void count(struct worker *w, int retval, size_t want) {
+	if (retval < 0 || (size_t)retval != want) {
+		w->errors++;
+	} else {
+		w->bytes += want;
+	}
+}
+
+/*
+ * Workloads. Each runs in every thread, between the start line and the
+ * join that ends the phase's wall time.
+ */
+static struct tfs_file* thread_file(struct worker *w, int creating) {
+	struct tfs_file *file = NULL;
+	char path[PATHLEN];
+	int retval;
+
+	snprintf(path, PATHLEN, HARNESS_DIR "/t%d/data", w->id);
+	if (creating) {
+		retval = tfs_create(path, FILEPERM, getuid(), getgid(), &file);
+		if (retval == -EEXIST) {
+			retval = tfs_open(path, O_RDWR, &file);
+		}
+	} else {
+		retval = tfs_open(path, O_RDWR, &file);
+	}
+	if (retval < 0) {
+		fprintf(stderr, "%s: %s\n", path, strerror(-retval));
+		w->errors++;
+		return NULL;
+	}
+	return file;
+}
+
+static void seq_io(struct worker *w, int writing) {
+	struct tfs_file *file = thread_file(w, writing);
+	off_t off;
+
+	if (file == NULL) {
+		return;
+	}
+	for (off = 0; off + p.io_size <= p.file_size; off += p.io_size) {
+		uint64_t start = now_ns();
+		int retval = writing ? tfs_write(file, w->buf, p.io_size, off) : tfs_read(file, w->buf, p.io_size, off);
+		record(w, start);
+		count(w, retval, p.io_size);
+	}
+	if (writing) {
+		tfs_flush(file);
+	}
+	tfs_release(file);
+}
+
+static void seq_write(struct worker *w) {
+	seq_io(w, 1);
+}
+
+static void seq_read(struct worker *w) {
+	seq_io(w, 0);
+}
+
+static void rand_io(struct worker *w, int writing) {
+	struct tfs_file *file = thread_file(w, 0);
+	size_t n = p.file_size / p.io_size, i;
+
+	if (file == NULL) {
+		return;
+	}
+	for (i = 0; i < n; i++) {
+		off_t off = (off_t)(rand_r(&w->seed) % n) * p.io_size;
+		uint64_t start = now_ns();
+		int retval = writing ? tfs_write(file, w->buf, p.io_size, off) : tfs_read(file, w->buf, p.io_size, off);
+		record(w, start);
+		count(w, retval, p.io_size);
+	}
+	if (writing) {
+		tfs_flush(file);
+	}
+	tfs_release(file);
+}
+
+static void rand_write(struct worker *w) {
+	rand_io(w, 1);
+}
+
+static void rand_read(struct worker *w) {
+	rand_io(w, 0);
+}
+
+static void meta_create(struct worker *w) {
+	struct tfs_file *file;
+	char path[PATHLEN];
+	int i;
+	for (i = 0; i < p.files; i++) {
+		snprintf(path, PATHLEN, HARNESS_DIR "/t%d/m%d", w->id, i);
+		uint64_t start = now_ns();
+		if (tfs_create(path, FILEPERM, getuid(), getgid(), &file) < 0) {
+			w->errors++;
+		} else {
+			tfs_release(file);
+		}
+		record(w, start);
+	}
+}
+
+static void meta_stat(struct worker *w) {
+	char path[PATHLEN];
+	struct stat st;
+	int i;
+	for (i = 0; i < p.files; i++) {
+		snprintf(path, PATHLEN, HARNESS_DIR "/t%d/m%d", w->id, i);
+		uint64_t start = now_ns();
+		if (tfs_getattr(path, &st) < 0) {
+			w->errors++;
+		}
+		record(w, start);
+	}
+}
+
+static void meta_unlink(struct worker *w) {
+	char path[PATHLEN];
+	int i;
+	for (i = 0; i < p.files; i++) {
+		snprintf(path, PATHLEN, HARNESS_DIR "/t%d/m%d", w->id, i);
+		uint64_t start = now_ns();
+		if (tfs_unlink(path) < 0) {
+			w->errors++;
+		}
+		record(w, start);
+	}
+}
+
+//One operation is a whole create, write of io_size, release and unlink, so inodes and blocks go round
+static void alloc_churn(struct worker *w) {
+	struct tfs_file *file;
+	char path[PATHLEN];
+	int i;
+	snprintf(path, PATHLEN, HARNESS_DIR "/t%d/churn", w->id);
+	for (i = 0; i < p.files; i++) {
+		uint64_t start = now_ns();
+		if (tfs_create(path, FILEPERM, getuid(), getgid(), &file) < 0) {
+			w->errors++;
+			record(w, start);
+			continue;
+		}
+		int retval = tfs_write(file, w->buf, p.io_size, 0);
+		tfs_release(file);
+		if (tfs_unlink(path) < 0) {
+			retval = -1;
+		}
+		record(w, start);
+		count(w, retval, p.io_size);
+	}
+}
+
+//Thread id makes names id, id + threads, ... of the shared directory
+static void bigdir_create(struct worker *w) {
+	struct tfs_file *file;
+	char path[PATHLEN];
+	int i;
+	for (i = w->id; i < p.dir_entries; i += p.threads) {
+		snprintf(path, PATHLEN, HARNESS_DIR "/big/entry-%06d", i);
+		uint64_t start = now_ns();
+		if (tfs_create(path, FILEPERM, getuid(), getgid(), &file) < 0) {
+			w->errors++;
+		} else {
+			tfs_release(file);
+		}
+		record(w, start);
+	}
+}
+
+static void bigdir_stat(struct worker *w) {
+	char path[PATHLEN];
+	struct stat st;
+	int i;
+	for (i = 0; i < p.dir_entries; i++) {
+		snprintf(path, PATHLEN, HARNESS_DIR "/big/entry-%06d", rand_r(&w->seed) % p.dir_entries);
+		uint64_t start = now_ns();
+		if (tfs_getattr(path, &st) < 0) {
+			w->errors++;
+		}
+		record(w, start);
+	}
+}
+
+static int count_entry(void *buf, const char *name, const struct stat *stbuf, off_t off) {
+	(*(int *)buf)++;
+	return 0;
+}
+
+static void bigdir_list(struct worker *w) {
+	int n = 0;
+	uint64_t start = now_ns();
+	if (tfs_readdir(HARNESS_DIR "/big", &n, count_entry) < 0) {
+		w->errors++;
+	}
+	record(w, start);
+	if (n < p.dir_entries) {
+		w->errors++;
+	}
+}
+
+static void bigdir_unlink(struct worker *w) {
+	char path[PATHLEN];
+	int i;
+	for (i = w->id; i < p.dir_entries; i += p.threads) {
+		snprintf(path, PATHLEN, HARNESS_DIR "/big/entry-%06d", i);
+		uint64_t start = now_ns();
+		if (tfs_unlink(path) < 0) {
+			w->errors++;
+		}
+		record(w, start);
+	}
+}
+
+/*
+ * Phases
+ */
+static phase_fn current;
+
+static void *worker_main(void *arg) {
+	struct worker *w = arg;
+	pthread_barrier_wait(&start_line);
+	w->began = now_ns();
+	current(w);
+	w->ended = now_ns();
+	return NULL;
+}
+
+static int cmp_u64(const void *a, const void *b) {
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+	return x < y ? -1 : x > y;
+}
+
+static double pct(uint64_t *lat, size_t n, double q) {
+	if (n == 0) {
+		return 0;
+	}
+	size_t i = (size_t)(q * n);
+	return lat[i < n ? i : n - 1] / 1000.0;
+}
+
+static void run_phase(const char *name, phase_fn run) {
+	struct result *r = &results[nresults++];
+	uint64_t began = UINT64_MAX, ended = 0;
+	size_t total = 0;
+	int i;
+
+	current = run;
+	pthread_barrier_init(&start_line, NULL, p.threads + 1);
+	for (i = 0; i < p.threads; i++) {
+		struct worker *w = &workers[i];
+		w->nlat = 0;
+		w->bytes = 0;
+		w->errors = 0;
+		pthread_create(&w->thread, NULL, worker_main, w);
+	}
+	pthread_barrier_wait(&start_line);
+	for (i = 0; i < p.threads; i++) {
+		pthread_join(workers[i].thread, NULL);
+		began = workers[i].began < began ? workers[i].began : began;
+		ended = workers[i].ended > ended ? workers[i].ended : ended;
+	}
+	pthread_barrier_destroy(&start_line);
+
+	//the phase lasts from the first thread starting it to the last one finishing
+	memset(r, 0, sizeof(*r));
+	r->name = name;
+	r->secs = (ended - began) / 1e9;
+	for (i = 0; i < p.threads; i++) {
+		total += workers[i].nlat;
+		r->bytes += workers[i].bytes;
+		r->errors += workers[i].errors;
+	}
+	uint64_t *all = malloc((total ? total : 1) * sizeof(uint64_t));
+	for (i = 0, total = 0; i < p.threads; i++) {
+		memcpy(all + total, workers[i].lat, workers[i].nlat * sizeof(uint64_t));
+		total += workers[i].nlat;
+	}
+	qsort(all, total, sizeof(uint64_t), cmp_u64);
+	r->ops = total;
+	r->p50 = pct(all, total, 0.50);
+	r->p99 = pct(all, total, 0.99);
+	r->p999 = pct(all, total, 0.999);
+	free(all);
+	fprintf(stderr, "%-16s %8zu ops %8.3f s %10.0f ops/s %8.1f MB/s  p50 %.1f p99 %.1f p999 %.1f us%s\n",
+		r->name, r->ops, r->secs, r->ops / r->secs, r->bytes / r->secs / (1 << 20),
+		r->p50, r->p99, r->p999, r->errors ? "  ERRORS" : "");
+}
+
+static int wanted(const char *workload) {
+	size_t len = strlen(workload);
+	const char *s = p.workloads;
+	while (s != NULL && *s) {
+		if (strncmp(s, workload, len) == 0 && (s[len] == ',' || s[len] == '\0')) {
+			return 1;
+		}
+		s = strchr(s, ',');
+		s = s != NULL ? s + 1 : NULL;
+	}
+	return 0;
+}
+
+static void make_dir(const char *path) {
+	int retval = tfs_mkdir(path, DIRPERM, getuid(), getgid());
+	if (retval < 0) {
+		fprintf(stderr, "%s: %s\n", path, strerror(-retval));
+		if (retval == -EEXIST) {
+			fprintf(stderr, "a run that did not finish left it behind, start from a fresh disk file\n");
+		}
+		exit(1);
+	}
+}
+
+static void setup() {
+	char path[PATHLEN];
+	int i;
+	make_dir(HARNESS_DIR);
+	for (i = 0; i < p.threads; i++) {
+		snprintf(path, PATHLEN, HARNESS_DIR "/t%d", i);
+		make_dir(path);
+	}
+}
+
+static void teardown() {
+	char path[PATHLEN];
+	int i;
+	for (i = 0; i < p.threads; i++) {
+		snprintf(path, PATHLEN, HARNESS_DIR "/t%d/data", i);
+		tfs_unlink(path);
+		snprintf(path, PATHLEN, HARNESS_DIR "/t%d", i);
+		tfs_rmdir(path);
+	}
+	tfs_rmdir(HARNESS_DIR);
+}
+
+static size_t parse_size(const char *s) {
+	char *end;
+	size_t n = strtoul(s, &end, 10);
+	if (*end == 'k' || *end == 'K') {
+		n <<= 10;
+	} else if (*end == 'm' || *end == 'M') {
+		n <<= 20;
+	} else if (*end == 'g' || *end == 'G') {
+		n <<= 30;
+	}
+	return n;
+}
+
+static void usage(const char *prog) {
+	fprintf(stderr,
+		"usage: %s [options] diskfile\n"
+		"  -t threads     threads running each phase at once (%d)\n"
+		"  -s size        bytes per read or write (4k)\n"
+		"  -f size        file size per thread for seq and rand (4m)\n"
+		"  -n files       files per thread for meta and alloc (%d)\n"
+		"  -e entries     names in the directory for bigdir (%d)\n"
+		"  -w workloads   any of seq,rand,meta,alloc,bigdir (all)\n"
+		"  -c mb          block cache size, 0 to turn it off (8)\n"
+		"  -D entries     dentry cache size, 0 to turn it off (16384)\n"
+		"  -r kb          largest readahead window, 0 to turn it off (512)\n"
+		"  -u depth       io_uring depth per thread (off)\n"
+		"  -x             make the disk file with extent-mapped files\n"
+		"  -m             map the disk file\n"
+		"  -S             do not keep stats\n"
+		"  -b backend     file, ram, hdd or ssd, with :param=value for hdd and ssd (file)\n"
+		"  -F             make a new file system on the disk, even if it has one\n"
+		"  -d size        size of a new disk (32m)\n"
+		"  -i inodes      inodes on a new disk (one per 32k)\n"
+		"  -o file        write the JSON there rather than to stdout\n",
+		prog, p.threads, p.files, p.dir_entries);
+	exit(1);
+}
+
+static void print_json(FILE *f, const struct tfs_options *opts) {
+	int i;
+	fprintf(f, "{\n  \"diskfile\": \"%s\",\n  \"threads\": %d,\n  \"io_size\": %zu,\n  \"file_size\": %zu,\n"
+		"  \"backend\": \"%s\",\n  \"cache_mb\": %lu,\n  \"extents\": %d,\n  \"mmap\": %d,\n  \"uring\": %d,\n"
+		"  \"results\": [\n",
+		p.diskfile, p.threads, p.io_size, p.file_size, opts->backend != NULL ? opts->backend : "file",
+		opts->cache_mb, opts->extents, opts->mmap, opts->uring);
+	for (i = 0; i < nresults; i++) {
+		struct result *r = &results[i];
+		fprintf(f, "    {\"phase\": \"%s\", \"ops\": %zu, \"bytes\": %llu, \"errors\": %d, "
+			"\"secs\": %.6f, \"ops_per_sec\": %.1f, \"mb_per_sec\": %.2f, "
+			"\"p50_us\": %.2f, \"p99_us\": %.2f, \"p999_us\": %.2f}%s\n",
+			r->name, r->ops, (unsigned long long)r->bytes, r->errors, r->secs,
+			r->ops / r->secs, r->bytes / r->secs / (1 << 20), r->p50, r->p99, r->p999,
+			i < nresults - 1 ? "," : "");
+	}
+	fprintf(f, "  ]\n}\n");
+}
+
+int main(int argc, char **argv) {
+	struct tfs_options opts;
+	const char *out = NULL;
+	char *buf_pool;
+	int i, opt, retval, errors = 0;
+
+	tfs_options_init(&opts);
+	while ((opt = getopt(argc, argv, "t:s:f:n:e:w:c:D:r:u:xmSb:Fd:i:o:")) != -1) {
+		switch (opt) {
+		case 't': p.threads = atoi(optarg); break;
+		case 's': p.io_size = parse_size(optarg); break;
+		case 'f': p.file_size = parse_size(optarg); break;
+		case 'n': p.files = atoi(optarg); break;
+		case 'e': p.dir_entries = atoi(optarg); break;
+		case 'w': p.workloads = optarg; break;
+		case 'c': opts.cache_mb = strtoul(optarg, NULL, 10); break;
+		case 'D': opts.dcache_entries = atoi(optarg); break;
+		case 'r': opts.readahead_kb = atoi(optarg); break;
+		case 'u': opts.uring = atoi(optarg); break;
+		case 'x': opts.extents = 1; break;
+		case 'm': opts.mmap = 1; break;
+		case 'S': opts.nostats = 1; break;
+		case 'b': opts.backend = optarg; break;
+		case 'F': opts.format = 1; break;
+		case 'd': opts.disk_mb = parse_size(optarg) >> 20; break;
+		case 'i': opts.inodes = strtoul(optarg, NULL, 10); break;
+		case 'o': out = optarg; break;
+		default: usage(argv[0]);
+		}
+	}
+	if (optind != argc - 1 || p.threads < 1) {
+		usage(argv[0]);
+	}
+	p.diskfile = argv[optind];
+	if (p.io_size == 0 || p.io_size > p.file_size) {
+		fprintf(stderr, "I/O size %zu does not fit the %zu byte files\n", p.io_size, p.file_size);
+		exit(1);
+	}
+
+	if ((retval = tfs_mount(p.diskfile, &opts)) < 0) {
+		fprintf(stderr, "%s: %s\n", p.diskfile, strerror(-retval));
+		exit(1);
+	}
+	workers = calloc(p.threads, sizeof(struct worker));
+	buf_pool = malloc(p.threads * p.io_size);
+	for (i = 0; i < p.threads; i++) {
+		workers[i].id = i;
+		workers[i].seed = i + 1;
+		workers[i].buf = buf_pool + (size_t)i * p.io_size;
+		memset(workers[i].buf, 'a' + i % 26, p.io_size);
+	}
+	setup();
+
+	if (wanted("seq") || wanted("rand")) {
+		run_phase("seq_write", seq_write);
+	}
+	if (wanted("seq")) {
+		run_phase("seq_read", seq_read);
+	}
+	if (wanted("rand")) {
+		run_phase("rand_write", rand_write);
+		run_phase("rand_read", rand_read);
+	}
+	if (wanted("meta")) {
+		run_phase("meta_create", meta_create);
+		run_phase("meta_stat", meta_stat);
+		run_phase("meta_unlink", meta_unlink);
+	}
+	if (wanted("alloc")) {
+		run_phase("alloc_churn", alloc_churn);
+	}
+	if (wanted("bigdir")) {
+		make_dir(HARNESS_DIR "/big");
+		run_phase("bigdir_create", bigdir_create);
+		run_phase("bigdir_stat", bigdir_stat);
+		run_phase("bigdir_readdir", bigdir_list);
+		run_phase("bigdir_unlink", bigdir_unlink);
+		tfs_rmdir(HARNESS_DIR "/big");
+	}
+	teardown();
+	tfs_unmount();
+
+	for (i = 0; i < nresults; i++) {
+		errors += results[i].errors;
+	}
+	FILE *f = out != NULL ? fopen(out, "w") : stdout;
+	if (f == NULL) {
+		perror(out);
+		exit(1);
+	}
+	print_json(f, &opts);
+	if (f != stdout) {
+		fclose(f);
+	}
+	for (i = 0; i < p.threads; i++) {
+		free(workers[i].lat);
+	}
+	free(workers);
+	free(buf_pool);
+	return errors ? 2 : 0;
+}